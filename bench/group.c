@@ -0,0 +1,120 @@
+/*
+  Group benchmark: submitters put batches of empty grouped requests to
+  worker and wait for each batch, and threads enter and leave one shared
+  group in a loop. Prints requests and enter/leave pairs per second for
+  1, 2, 4... threads of each kind.
+  
+  Usage: bench-group [duration_ms] [max_threads]
+*/
+
+#include "jq.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define BATCH 100
+
+typedef struct {
+  pthread_t thread;
+  unsigned long count;
+} bench_thread;
+
+static volatile int running = 0;
+static volatile int stop = 0;
+static jq_worker_t worker;
+static jq_group_t shared_group;
+
+static void empty( void* arg ) {
+
+}
+
+static void* submit_main( void* arg ) {
+  bench_thread* t = (bench_thread*)arg;
+  int i;
+  
+  while( !running )
+    sched_yield();
+  
+  while( !stop ) {
+    jq_group_t group = jq_group_create();
+    
+    for( i = 0; i < BATCH; ++i )
+      jq_worker_async_group( worker, group, empty, NULL );
+    
+    jq_group_wait( group );
+    jq_release( group );
+    
+    t->count += BATCH;
+  }
+  
+  return NULL;
+}
+
+static void* enter_main( void* arg ) {
+  bench_thread* t = (bench_thread*)arg;
+  
+  while( !running )
+    sched_yield();
+  
+  while( !stop ) {
+    jq_group_enter( shared_group );
+    jq_group_leave( shared_group );
+    
+    t->count++;
+  }
+  
+  return NULL;
+}
+
+static void run( const char* name, void* (*proc)( void* ), int threads, int duration_ms ) {
+  static bench_thread t[MAX_THREADS];
+  unsigned long total = 0;
+  int i;
+  
+  running = 0;
+  stop = 0;
+  
+  for( i = 0; i < threads; ++i ) {
+    t[i].count = 0;
+    pthread_create( &t[i].thread, NULL, proc, &t[i] );
+  }
+  
+  running = 1;
+  usleep( duration_ms * 1000 );
+  stop = 1;
+  
+  for( i = 0; i < threads; ++i ) {
+    pthread_join( t[i].thread, NULL );
+    total += t[i].count;
+  }
+  
+  printf( "%-16s %7d %12.2f\n", name, threads, total / (duration_ms * 1000.0) );
+  fflush( stdout );
+}
+
+int main( int argc, char** argv ) {
+  int duration_ms = argc > 1 ? atoi( argv[1] ) : 200;
+  int max_threads = argc > 2 ? atoi( argv[2] ) : MAX_THREADS;
+  int threads;
+  
+  if( max_threads > MAX_THREADS ) max_threads = MAX_THREADS;
+  
+  worker = jq_worker_create( NULL, sysconf( _SC_NPROCESSORS_ONLN ) );
+  shared_group = jq_group_create();
+  
+  printf( "%ld cpus, %d ms per run\n", sysconf( _SC_NPROCESSORS_ONLN ), duration_ms );
+  printf( "%-16s %7s %12s\n", "test", "threads", "Mops/s" );
+  
+  for( threads = 1; threads <= max_threads; threads *= 2 ) {
+    run( "grouped submit", submit_main, threads, duration_ms );
+    run( "enter+leave", enter_main, threads, duration_ms );
+  }
+  
+  jq_release( shared_group );
+  jq_release( worker );
+  
+  return 0;
+}
@@ -0,0 +1,179 @@
+/*
+  Lock contention benchmark: threads take lock in a loop, touch shared data
+  and do a bit of work outside of lock. Prints throughput and fairness (how
+  many times less the least lucky thread took lock than the luckiest one)
+  of jq_lock against the locks it replaced.
+  
+  Usage: bench-lock [duration_ms] [max_threads]
+*/
+
+#include "jq-private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+
+typedef struct {
+  const char* name;
+  void (*init)( void );
+  void (*lock)( void );
+  void (*unlock)( void );
+} lock_ops;
+
+typedef struct {
+  pthread_t thread;
+  const lock_ops* ops;
+  unsigned long count;
+} __attribute__((aligned(JQ_CACHE_LINE))) bench_thread;
+
+static volatile int running = 0;
+static volatile int stop = 0;
+static volatile unsigned long shared[2 * JQ_CACHE_LINE / sizeof(unsigned long)];
+
+/* Former emulation of pthread spinlock. */
+static volatile int yield_lock;
+
+static void yield_init( void ) {
+  yield_lock = 0;
+}
+
+static void yield_lock_lock( void ) {
+  while( jq_atomic_cas( &yield_lock, 0, 1 ) != 0 )
+    sched_yield();
+}
+
+static void yield_lock_unlock( void ) {
+  jq_atomic_cas( &yield_lock, 1, 0 );
+}
+
+static pthread_spinlock_t spin;
+
+static void spin_init( void ) {
+  pthread_spin_init( &spin, PTHREAD_PROCESS_PRIVATE );
+}
+
+static void spin_lock( void ) {
+  pthread_spin_lock( &spin );
+}
+
+static void spin_unlock( void ) {
+  pthread_spin_unlock( &spin );
+}
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void mutex_init( void ) {
+}
+
+static void mutex_lock( void ) {
+  pthread_mutex_lock( &mutex );
+}
+
+static void mutex_unlock( void ) {
+  pthread_mutex_unlock( &mutex );
+}
+
+static jq_lock_t lock = JQ_LOCK_INITIALIZER;
+
+static void jq_init( void ) {
+  jq_lock_init( &lock );
+}
+
+static void jq_lock_lock( void ) {
+  jq_lock( &lock );
+}
+
+static void jq_lock_unlock( void ) {
+  jq_unlock( &lock );
+}
+
+static const lock_ops locks[] = {
+  { "spin+yield", yield_init, yield_lock_lock, yield_lock_unlock },
+  { "pthread_spin", spin_init, spin_lock, spin_unlock },
+  { "pthread_mutex", mutex_init, mutex_lock, mutex_unlock },
+#if defined(JQ_LOCK_TICKET)
+  { "jq_lock ticket", jq_init, jq_lock_lock, jq_lock_unlock },
+#else
+  { "jq_lock", jq_init, jq_lock_lock, jq_lock_unlock },
+#endif
+};
+
+static void* bench_main( void* arg ) {
+  bench_thread* t = (bench_thread*)arg;
+  size_t i;
+  int j;
+  
+  while( !running )
+    sched_yield();
+  
+  while( !stop ) {
+    t->ops->lock();
+    
+    for( i = 0; i < sizeof(shared) / sizeof(shared[0]); i += JQ_CACHE_LINE / sizeof(unsigned long) )
+      shared[i]++;
+    
+    t->ops->unlock();
+    
+    for( j = 0; j < 50; ++j )
+      jq_cpu_relax();
+    
+    t->count++;
+  }
+  
+  return NULL;
+}
+
+static void run( const lock_ops* ops, int threads, int duration_ms ) {
+  static bench_thread t[MAX_THREADS];
+  unsigned long total = 0, min = (unsigned long)-1, max = 0;
+  int i;
+  
+  ops->init();
+  running = 0;
+  stop = 0;
+  
+  for( i = 0; i < threads; ++i ) {
+    t[i].ops = ops;
+    t[i].count = 0;
+    pthread_create( &t[i].thread, NULL, bench_main, &t[i] );
+  }
+  
+  running = 1;
+  usleep( duration_ms * 1000 );
+  stop = 1;
+  
+  for( i = 0; i < threads; ++i ) {
+    pthread_join( t[i].thread, NULL );
+    
+    total += t[i].count;
+    if( t[i].count < min ) min = t[i].count;
+    if( t[i].count > max ) max = t[i].count;
+  }
+  
+  printf( "%-16s %7d %12.2f %10.1f\n", ops->name, threads,
+    total / (duration_ms * 1000.0), min ? (double)max / min : -1.0 );
+  
+  fflush( stdout );
+}
+
+int main( int argc, char** argv ) {
+  int duration_ms = argc > 1 ? atoi( argv[1] ) : 200;
+  int max_threads = argc > 2 ? atoi( argv[2] ) : MAX_THREADS;
+  int threads;
+  size_t i;
+  
+  if( max_threads > MAX_THREADS ) max_threads = MAX_THREADS;
+  
+  printf( "%ld cpus, %d ms per run\n", sysconf( _SC_NPROCESSORS_ONLN ), duration_ms );
+  printf( "%-16s %7s %12s %10s\n", "lock", "threads", "Mops/s", "max/min" );
+  
+  for( threads = 1; threads <= max_threads; threads *= 2 ) {
+    for( i = 0; i < sizeof(locks) / sizeof(locks[0]); ++i )
+      run( &locks[i], threads, duration_ms );
+  }
+  
+  return 0;
+}
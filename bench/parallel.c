@@ -0,0 +1,113 @@
+/*
+  Parallel algorithms benchmark: jq_parallel_sort against qsort, scan and
+  partition against serial loops, on random ints, for worker of 1, 2, 4...
+  threads up to number of cpus.
+  
+  Usage: bench-parallel [count] [max_threads]
+*/
+
+#include "jq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare( const void* a, const void* b ) {
+  int x = *(const int*)a, y = *(const int*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void add( void* arg, void* result, const void* a, const void* b ) {
+  *(int*)result = *(const int*)a + *(const int*)b;
+}
+
+static int is_small( void* arg, const void* item ) {
+  return *(const int*)item < RAND_MAX / 2;
+}
+
+static void fill( int* data, size_t count ) {
+  size_t i;
+  
+  srand( 1 );
+  
+  for( i = 0; i < count; ++i )
+    data[i] = rand();
+}
+
+static void report( const char* name, const char* threads, double serial, double elapsed ) {
+  printf( "%-10s %8s %10.1f %8.2fx\n", name, threads, elapsed * 1000, serial / elapsed );
+  fflush( stdout );
+}
+
+int main( int argc, char** argv ) {
+  size_t count = argc > 1 ? (size_t)atol( argv[1] ) : 4000000;
+  long max_threads = argc > 2 ? atol( argv[2] ) : sysconf( _SC_NPROCESSORS_ONLN );
+  int* data = (int*)malloc( count * sizeof(int) );
+  int* out = (int*)malloc( count * sizeof(int) );
+  double sort_serial, scan_serial, partition_serial, start;
+  char name[16];
+  size_t i, selected;
+  long threads;
+  
+  printf( "%lu ints, %ld cpus\n", (unsigned long)count, sysconf( _SC_NPROCESSORS_ONLN ) );
+  printf( "%-10s %8s %10s %9s\n", "algorithm", "threads", "ms", "speedup" );
+  
+  fill( data, count );
+  start = now();
+  qsort( data, count, sizeof(int), compare );
+  sort_serial = now() - start;
+  report( "sort", "qsort", sort_serial, sort_serial );
+  
+  start = now();
+  for( i = 0, out[0] = data[0]; i + 1 < count; ++i )
+    out[i + 1] = out[i] + data[i + 1];
+  scan_serial = now() - start;
+  report( "scan", "serial", scan_serial, scan_serial );
+  
+  fill( data, count );
+  start = now();
+  for( i = 0, selected = 0; i < count; ++i ) {
+    if( is_small( NULL, &data[i] ) )
+      out[selected++] = data[i];
+  }
+  for( i = 0; i < count; ++i ) {
+    if( !is_small( NULL, &data[i] ) )
+      out[selected++] = data[i];
+  }
+  memcpy( data, out, count * sizeof(int) );
+  partition_serial = now() - start;
+  report( "partition", "serial", partition_serial, partition_serial );
+  
+  for( threads = 1; threads <= max_threads; threads *= 2 ) {
+    jq_worker_t worker = jq_worker_create( NULL, (size_t)threads );
+    
+    snprintf( name, sizeof(name), "%ld", threads );
+    
+    fill( data, count );
+    start = now();
+    jq_parallel_sort( worker, data, count, sizeof(int), compare );
+    report( "sort", name, sort_serial, now() - start );
+    
+    start = now();
+    jq_parallel_inclusive_scan( worker, data, out, count, sizeof(int), add, NULL );
+    report( "scan", name, scan_serial, now() - start );
+    
+    fill( data, count );
+    start = now();
+    jq_parallel_partition( worker, data, count, sizeof(int), is_small, NULL, &selected );
+    report( "partition", name, partition_serial, now() - start );
+    
+    jq_release( worker );
+  }
+  
+  free( data );
+  free( out );
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include "jq.h"
 #include <stdio.h>
+#include <unistd.h>
 
 void test( void* p ) {
   printf( "Hi! %lu\n", (size_t)p );
@@ -7,10 +8,20 @@ void test( void* p ) {
 }
 
 int main() {
-  jq_worker_t worker = jq_worker_create( NULL, 100 );
-  jq_group_t group = jq_group_create();
-  
+  jq_worker_config config;
+  jq_worker_t worker;
+  jq_group_t group;
   size_t i;
+  
+  jq_worker_config_init( &config );
+  config.threads = 100;
+  config.lazy = 1;
+  config.stack_size = 256 * 1024;
+  config.name = "main";
+  
+  worker = jq_worker_create_ex( NULL, &config );
+  group = jq_group_create();
+  
   for( i = 0; i < 500000; ++i )
     jq_worker_async_group( worker, group, test, (void*)i );
   
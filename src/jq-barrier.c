@@ -0,0 +1,275 @@
+#include "jq-private.h"
+#include <string.h>
+#include <limits.h>
+
+/*-----------------------------------------------------------------------------
+  Internals.
+  Each primitive keeps its state in int word used as futex, and count of
+  threads sleeping on it, so uncontended operations take single atomic and
+  no syscall. Waiting worker thread executes its requests instead of
+  sleeping (see jq_worker_help).
+-----------------------------------------------------------------------------*/
+
+/** How many times word is re-checked before going to sleep. */
+#define JQ_SPIN_COUNT 100
+
+typedef struct jq_barrier jq_barrier;
+typedef struct jq_latch jq_latch;
+typedef struct jq_semaphore jq_semaphore;
+
+/* Sleep while *word == value, keeping count of sleepers. */
+static void jq_park( volatile int* word, int value, volatile int* sleepers, int timeout_ms ) {
+  int i;
+  
+  for( i = 0; i < JQ_SPIN_COUNT; ++i )
+    if( *word != value ) return;
+  
+  if( timeout_ms == 0 ) return;
+  
+  jq_atomic_add( sleepers, 1 );
+  jq_futex_wait( word, value, timeout_ms );
+  jq_atomic_sub( sleepers, 1 );
+}
+
+/* Wake helper of jq_worker_help sleeping on word. */
+static inline void jq_park_wake( volatile int* word ) {
+  jq_futex_wake( word, INT_MAX );
+}
+
+static inline void jq_unpark( volatile int* word, volatile int* sleepers, int count ) {
+  jq_atomic_barrier();
+  
+  if( *sleepers )
+    jq_futex_wake( word, count );
+}
+
+/*-----------------------------------------------------------------------------
+  Barrier.
+  Last thread arriving resets arrived counter and bumps generation, others
+  wait for generation to change.
+-----------------------------------------------------------------------------*/
+
+struct jq_barrier {
+  jq_object object;
+  
+  /** Number of threads to arrive in each phase. */
+  int count;
+  
+  /** Threads arrived in current phase. */
+  volatile int arrived;
+  
+  /** Phase number. Futex word. */
+  volatile int generation;
+  
+  volatile int sleepers;
+};
+
+/* Waited object of jq_barrier_wait: barrier and phase being waited for. */
+typedef struct {
+  jq_barrier* barrier;
+  int generation;
+} jq_barrier_phase;
+
+static jq_fsa barrier_allocator = JQ_FSA_INITIALIZER( sizeof(jq_barrier), 0 );
+
+static void jq_barrier_vtable_destroy( void* object ) {
+  jq_fsa_free( &barrier_allocator, object );
+}
+
+static jq_object_vtable barrier_vtable = {
+  jq_barrier_vtable_destroy
+};
+
+static int jq_barrier_wait_for( void* object, int timeout_ms ) {
+  jq_barrier_phase* phase = (jq_barrier_phase*)object;
+  jq_barrier* barrier = phase->barrier;
+  
+  if( barrier->generation == phase->generation )
+    jq_park( &barrier->generation, phase->generation, &barrier->sleepers, timeout_ms );
+  
+  return barrier->generation != phase->generation;
+}
+
+static void jq_barrier_wake( void* object ) {
+  jq_park_wake( &((jq_barrier_phase*)object)->barrier->generation );
+}
+
+jq_barrier_t jq_barrier_create( int count ) {
+  jq_barrier* barrier;
+  
+  if( count < 1 ) return NULL;
+  
+  if( (barrier = (jq_barrier*)jq_fsa_alloc( &barrier_allocator )) ) {
+    memset( barrier, 0, sizeof(*barrier) );
+    jq_object_init( &barrier->object, &barrier_vtable );
+    barrier->count = count;
+  }
+  
+  return barrier;
+}
+
+int jq_barrier_wait( jq_barrier_t barrier ) {
+  jq_barrier_phase phase;
+  
+  phase.barrier = barrier;
+  phase.generation = barrier->generation;
+  
+  if( jq_atomic_add( &barrier->arrived, 1 ) + 1 == barrier->count ) {
+    /* Nobody arrives for next phase until generation changes. */
+    barrier->arrived = 0;
+    jq_atomic_add( &barrier->generation, 1 );
+    jq_unpark( &barrier->generation, &barrier->sleepers, INT_MAX );
+    return 1;
+  }
+  
+  if( !jq_worker_help( jq_barrier_wait_for, jq_barrier_wake, &phase ) ) {
+    while( !jq_barrier_wait_for( &phase, -1 ) );
+  }
+  
+  return 0;
+}
+
+/*-----------------------------------------------------------------------------
+  Latch.
+-----------------------------------------------------------------------------*/
+
+struct jq_latch {
+  jq_object object;
+  
+  /** Counts left. Futex word. */
+  volatile int count;
+  
+  volatile int sleepers;
+};
+
+static jq_fsa latch_allocator = JQ_FSA_INITIALIZER( sizeof(jq_latch), 0 );
+
+static void jq_latch_vtable_destroy( void* object ) {
+  jq_fsa_free( &latch_allocator, object );
+}
+
+static jq_object_vtable latch_vtable = {
+  jq_latch_vtable_destroy
+};
+
+static int jq_latch_wait_for( void* object, int timeout_ms ) {
+  jq_latch* latch = (jq_latch*)object;
+  int count = latch->count;
+  
+  if( count > 0 )
+    jq_park( &latch->count, count, &latch->sleepers, timeout_ms );
+  
+  return latch->count <= 0;
+}
+
+static void jq_latch_wake( void* object ) {
+  jq_park_wake( &((jq_latch*)object)->count );
+}
+
+jq_latch_t jq_latch_create( int count ) {
+  jq_latch* latch;
+  
+  if( (latch = (jq_latch*)jq_fsa_alloc( &latch_allocator )) ) {
+    memset( latch, 0, sizeof(*latch) );
+    jq_object_init( &latch->object, &latch_vtable );
+    latch->count = count;
+  }
+  
+  return latch;
+}
+
+void jq_latch_count_down( jq_latch_t latch, int n ) {
+  int count = jq_atomic_sub( &latch->count, n );
+  
+  if( count > 0 && count <= n )
+    jq_unpark( &latch->count, &latch->sleepers, INT_MAX );
+}
+
+int jq_latch_try_wait( jq_latch_t latch ) {
+  return latch->count <= 0;
+}
+
+void jq_latch_wait( jq_latch_t latch ) {
+  if( latch->count <= 0 ) return;
+  
+  if( !jq_worker_help( jq_latch_wait_for, jq_latch_wake, latch ) ) {
+    while( !jq_latch_wait_for( latch, -1 ) );
+  }
+}
+
+/*-----------------------------------------------------------------------------
+  Semaphore.
+-----------------------------------------------------------------------------*/
+
+struct jq_semaphore {
+  jq_object object;
+  
+  /** Available units. Futex word. */
+  volatile int value;
+  
+  volatile int sleepers;
+};
+
+static jq_fsa semaphore_allocator = JQ_FSA_INITIALIZER( sizeof(jq_semaphore), 0 );
+
+static void jq_semaphore_vtable_destroy( void* object ) {
+  jq_fsa_free( &semaphore_allocator, object );
+}
+
+static jq_object_vtable semaphore_vtable = {
+  jq_semaphore_vtable_destroy
+};
+
+/* Acquires unit when returns non-zero. */
+static int jq_semaphore_wait_for( void* object, int timeout_ms ) {
+  jq_semaphore* sem = (jq_semaphore*)object;
+  
+  if( jq_semaphore_try_wait( sem ) )
+    return 1;
+  
+  jq_park( &sem->value, 0, &sem->sleepers, timeout_ms );
+  
+  return jq_semaphore_try_wait( sem );
+}
+
+static void jq_semaphore_wake( void* object ) {
+  jq_park_wake( &((jq_semaphore*)object)->value );
+}
+
+jq_semaphore_t jq_semaphore_create( int value ) {
+  jq_semaphore* sem;
+  
+  if( value < 0 ) return NULL;
+  
+  if( (sem = (jq_semaphore*)jq_fsa_alloc( &semaphore_allocator )) ) {
+    memset( sem, 0, sizeof(*sem) );
+    jq_object_init( &sem->object, &semaphore_vtable );
+    sem->value = value;
+  }
+  
+  return sem;
+}
+
+void jq_semaphore_post( jq_semaphore_t sem, int n ) {
+  jq_atomic_add( &sem->value, n );
+  jq_unpark( &sem->value, &sem->sleepers, n );
+}
+
+int jq_semaphore_try_wait( jq_semaphore_t sem ) {
+  int value;
+  
+  while( (value = sem->value) > 0 ) {
+    if( jq_atomic_cas( &sem->value, value, value - 1 ) == value )
+      return 1;
+  }
+  
+  return 0;
+}
+
+void jq_semaphore_wait( jq_semaphore_t sem ) {
+  if( jq_semaphore_try_wait( sem ) ) return;
+  
+  if( !jq_worker_help( jq_semaphore_wait_for, jq_semaphore_wake, sem ) ) {
+    while( !jq_semaphore_wait_for( sem, -1 ) );
+  }
+}
@@ -1,11 +1,223 @@
 #include "jq-private.h"
 
+#include <stdlib.h>
+
 #define OBJECT_MAGIC 0xFADEDFAC
 
+/*-----------------------------------------------------------------------------
+  Biased reference counting.
+  Owner thread counts its references in plain field, others in atomic shared
+  count offset by JQ_OBJECT_BIAS. Total number of references is their sum.
+  When other threads release more than they retained, shared count drops
+  below bias: object is flagged as queued and put to owner's merge queue.
+  Owner moves shared part into its own count on its next call and unbiases
+  object when own count reaches zero. Queues of exited owners are merged
+  at once by releasing thread.
+-----------------------------------------------------------------------------*/
+
+#define JQ_OBJECT_QUEUED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define JQ_OBJECT_BIAS ((size_t)1 << (sizeof(size_t) * 8 - 2))
+
+struct jq_object_owner {
+  /** Protects fields below. */
+  jq_lock_t lock;
+  
+  /** Owner thread is running. */
+  int alive;
+  
+  /** Objects to merge. */
+  jq_object* queue;
+  
+  /** Number of biased objects plus one while thread runs. */
+  volatile size_t refs;
+};
+
+static JQ_THREAD_LOCAL jq_object_owner* current_owner = NULL;
+static pthread_key_t owner_key;
+static pthread_once_t owner_key_once = PTHREAD_ONCE_INIT;
+
+static void jq_object_owner_release( jq_object_owner* owner ) {
+  if( jq_atomic_sub( &owner->refs, 1 ) == 1 ) {
+    jq_lock_destroy( &owner->lock );
+    free( owner );
+  }
+}
+
+/*
+  Called by owner, or by thread holding QUEUED flag after owner exited, so
+  biased count is not raced.
+*/
+static void jq_object_unbias( jq_object* obj ) {
+  jq_object_owner* owner = obj->owner;
+  size_t refs;
+  
+  obj->owner = NULL;
+  refs = jq_atomic_sub( &obj->refs, JQ_OBJECT_BIAS ) - JQ_OBJECT_BIAS;
+  
+  jq_object_owner_release( owner );
+  
+  /* Queued object is destroyed by merge. */
+  if( refs == 0 )
+    obj->vtable->destroy( obj );
+}
+
+/*
+  Move negative shared count of queued object to biased one. Called by
+  owner, or by any releasing thread once owner exited.
+  Flag is kept until biased count is updated and object is unbiased if it
+  drops to zero, so nobody queues it again meanwhile: once flag is cleared
+  object may be merged and destroyed by other thread.
+*/
+static void jq_object_merge( jq_object* obj ) {
+  size_t refs;
+  
+  while( obj->owner ) {
+    refs = obj->refs;
+    
+    if( (refs & ~JQ_OBJECT_QUEUED) < JQ_OBJECT_BIAS ) {
+      if( jq_atomic_cas( &obj->refs, refs, JQ_OBJECT_BIAS | JQ_OBJECT_QUEUED ) == refs )
+        obj->biased += (refs & ~JQ_OBJECT_QUEUED) - JQ_OBJECT_BIAS;
+    }
+    else if( obj->biased == 0 ) {
+      jq_object_unbias( obj );
+    }
+    else if( jq_atomic_cas( &obj->refs, refs, refs & ~JQ_OBJECT_QUEUED ) == refs ) {
+      return;
+    }
+  }
+  
+  /* Unbiased: clear the flag, the last reference may have been dropped. */
+  refs = jq_atomic_sub( &obj->refs, JQ_OBJECT_QUEUED ) - JQ_OBJECT_QUEUED;
+  
+  if( refs == 0 )
+    obj->vtable->destroy( obj );
+}
+
+static void jq_object_merge_all( jq_object* obj ) {
+  while( obj ) {
+    jq_object* next = obj->queued_next;
+    jq_object_merge( obj );
+    obj = next;
+  }
+}
+
+static void jq_object_enqueue( jq_object_owner* owner, jq_object* obj ) {
+  jq_lock( &owner->lock );
+  
+  if( owner->alive ) {
+    obj->queued_next = owner->queue;
+    owner->queue = obj;
+    obj = NULL;
+  }
+  
+  jq_unlock( &owner->lock );
+  
+  /* Owner exited - nobody else touches biased count now. */
+  if( obj )
+    jq_object_merge( obj );
+}
+
+void jq_object_collect() {
+  jq_object_owner* owner = current_owner;
+  jq_object* queue;
+  
+  if( !owner || !owner->queue ) return;
+  
+  jq_lock( &owner->lock );
+  queue = owner->queue;
+  owner->queue = NULL;
+  jq_unlock( &owner->lock );
+  
+  jq_object_merge_all( queue );
+}
+
+static void jq_object_owner_exit( void* arg ) {
+  jq_object_owner* owner = (jq_object_owner*)arg;
+  jq_object* queue;
+  
+  current_owner = NULL;
+  
+  jq_lock( &owner->lock );
+  owner->alive = 0;
+  queue = owner->queue;
+  owner->queue = NULL;
+  jq_unlock( &owner->lock );
+  
+  jq_object_merge_all( queue );
+  jq_object_owner_release( owner );
+}
+
+static void jq_object_owner_key_init() {
+  pthread_key_create( &owner_key, jq_object_owner_exit );
+}
+
+static jq_object_owner* jq_object_owner_get() {
+  jq_object_owner* owner = current_owner;
+  
+  if( owner ) return owner;
+  
+  pthread_once( &owner_key_once, jq_object_owner_key_init );
+  
+  owner = (jq_object_owner*)malloc( sizeof(jq_object_owner) );
+  if( !owner ) return NULL;
+  
+  jq_lock_init( &owner->lock );
+  owner->alive = 1;
+  owner->queue = NULL;
+  owner->refs = 1;
+  
+  if( pthread_setspecific( owner_key, owner ) != 0 ) {
+    jq_lock_destroy( &owner->lock );
+    free( owner );
+    return NULL;
+  }
+  
+  current_owner = owner;
+  return owner;
+}
+
+/* Release by thread other than owner. */
+static void jq_object_release_shared( jq_object* obj ) {
+  jq_object_owner* owner = obj->owner;
+  size_t refs, next;
+  
+  do {
+    refs = obj->refs;
+    next = refs - 1;
+    
+    /* Dropping below bias: owner must merge. */
+    if( refs == JQ_OBJECT_BIAS )
+      next |= JQ_OBJECT_QUEUED;
+  }
+  while( jq_atomic_cas( &obj->refs, refs, next ) != refs );
+  
+  if( (next & JQ_OBJECT_QUEUED) && !(refs & JQ_OBJECT_QUEUED) ) {
+    jq_object_enqueue( owner, obj );
+  }
+  else if( next == 0 ) {
+    obj->vtable->destroy( obj );
+  }
+}
+
 void jq_object_init( jq_object* obj, jq_object_vtable* vtable ) {
   obj->magic = OBJECT_MAGIC;
   obj->refs = 1;
   obj->vtable = vtable;
+  obj->biased = 0;
+  obj->owner = NULL;
+  obj->queued_next = NULL;
+}
+
+void jq_object_bias( jq_object* obj ) {
+  jq_object_owner* owner = jq_object_owner_get();
+  
+  if( !owner ) return;
+  
+  jq_atomic_add( &owner->refs, 1 );
+  
+  obj->owner = owner;
+  obj->biased = obj->refs;
+  obj->refs = JQ_OBJECT_BIAS;
 }
 
 static inline jq_object* jq_object_get( void* ptr ) {
@@ -17,15 +229,30 @@ void jq_retain( void* ptr ) {
   jq_object* obj = jq_object_get( ptr );
   if( !obj ) return;
   
-  jq_atomic_add( &obj->refs, 1 );
+  /* Caller holds a reference, so merge can't destroy this object. */
+  jq_object_collect();
+  
+  if( obj->owner && obj->owner == current_owner ) {
+    obj->biased++;
+  }
+  else {
+    jq_atomic_add( &obj->refs, 1 );
+  }
 }
 
 void jq_release( void* ptr ) {
   jq_object* obj = jq_object_get( ptr );
   if( !obj ) return;
   
-  if( jq_atomic_sub( &obj->refs, 1 ) == 1 ) {
-    obj->vtable->destroy( ptr );
+  /* Merge first: shared part of own objects may be below bias. */
+  jq_object_collect();
+  
+  if( obj->owner && obj->owner == current_owner ) {
+    if( --obj->biased == 0 )
+      jq_object_unbias( obj );
+  }
+  else {
+    jq_object_release_shared( obj );
   }
 }
 
@@ -38,40 +265,163 @@ int jq_once( jq_once_t* once ) {
 }
 
 /*-----------------------------------------------------------------------------
-  pthread_spinlock emulation if platform don't support it.
+  Futex.
 -----------------------------------------------------------------------------*/
 
-#ifdef JQ_PTHREAD_SPINLOCK_EMULATED
+#if defined(__linux__)
 
-#include <errno.h>
-#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
 
-int pthread_spin_init( pthread_spinlock_t* lock, int pshared ) {
-  if( !lock ) return EINVAL;
-  *lock = 0;
-  return 0;
+void jq_futex_wait( volatile int* addr, int value, int timeout_ms ) {
+  struct timespec timeout;
+  
+  if( timeout_ms >= 0 ) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  }
+  
+  syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, value,
+    timeout_ms >= 0 ? &timeout : NULL, NULL, 0 );
 }
 
-int pthread_spin_destroy( pthread_spinlock_t* lock ) {
-  return 0;
+void jq_futex_wake( volatile int* addr, int count ) {
+  syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0 );
+}
+
+#else
+
+/* Emulation: addresses are hashed onto a table of condition variables. */
+
+#include <sys/time.h>
+
+#define JQ_FUTEX_BUCKETS 64
+
+typedef struct jq_futex_bucket {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} jq_futex_bucket;
+
+static jq_futex_bucket futex_buckets[JQ_FUTEX_BUCKETS];
+static pthread_once_t futex_buckets_once = PTHREAD_ONCE_INIT;
+
+static void jq_futex_init_buckets() {
+  int i;
+  
+  for( i = 0; i < JQ_FUTEX_BUCKETS; ++i ) {
+    pthread_mutex_init( &futex_buckets[i].mutex, NULL );
+    pthread_cond_init( &futex_buckets[i].cond, NULL );
+  }
 }
 
-int pthread_spin_lock( pthread_spinlock_t* lock ) {
-  while( 1 ) {
-    if( jq_atomic_cas( lock, 0, 1 ) == 0 )
-      break;
+static jq_futex_bucket* jq_futex_bucket_get( volatile int* addr ) {
+  pthread_once( &futex_buckets_once, jq_futex_init_buckets );
+  return &futex_buckets[((size_t)addr >> 4) % JQ_FUTEX_BUCKETS];
+}
+
+void jq_futex_wait( volatile int* addr, int value, int timeout_ms ) {
+  jq_futex_bucket* bucket = jq_futex_bucket_get( addr );
+  struct timeval now;
+  struct timespec deadline;
+  
+  pthread_mutex_lock( &bucket->mutex );
+  
+  if( *addr == value ) {
+    if( timeout_ms < 0 ) {
+      pthread_cond_wait( &bucket->cond, &bucket->mutex );
+    }
+    else {
+      gettimeofday( &now, NULL );
+      deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+      deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000L;
+      
+      if( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      
+      pthread_cond_timedwait( &bucket->cond, &bucket->mutex, &deadline );
+    }
+  }
+  
+  pthread_mutex_unlock( &bucket->mutex );
+}
+
+void jq_futex_wake( volatile int* addr, int count ) {
+  jq_futex_bucket* bucket = jq_futex_bucket_get( addr );
+  
+  /* Bucket is shared by several addresses - wake everybody. */
+  pthread_mutex_lock( &bucket->mutex );
+  pthread_cond_broadcast( &bucket->cond );
+  pthread_mutex_unlock( &bucket->mutex );
+}
+
+#endif
+
+/*-----------------------------------------------------------------------------
+  Lock.
+-----------------------------------------------------------------------------*/
+
+#include <sched.h>
+#include <unistd.h>
+
+/** Spinning makes sense only if holder may run meanwhile. */
+static volatile int lock_spin = -1;
+
+static inline void jq_lock_pause( unsigned count ) {
+  if( lock_spin < 0 )
+    lock_spin = sysconf( _SC_NPROCESSORS_ONLN ) > 1;
+  
+  if( !lock_spin ) {
     sched_yield();
+    return;
   }
-  return 0;
+  
+  while( count-- > 0 )
+    jq_cpu_relax();
 }
 
-int pthread_spin_trylock( pthread_spinlock_t* lock ) {
-  return (jq_atomic_cas( lock, 0, 1 ) == 0) ? 0 : EBUSY;
+#if defined(JQ_LOCK_TICKET)
+
+void jq_lock_wait( jq_lock_t* lock, unsigned ticket ) {
+  unsigned distance, tries = 0;
+  
+  while( (distance = ticket - lock->owner) != 0 ) {
+    unsigned backoff = distance * JQ_LOCK_MIN_BACKOFF;
+    
+    /* Threads far in line poll less, sparing owner's cache line. */
+    jq_lock_pause( backoff < JQ_LOCK_MAX_BACKOFF ? backoff : JQ_LOCK_MAX_BACKOFF );
+    
+    /* Line doesn't move: owner or thread before us is likely preempted. */
+    if( ++tries == JQ_LOCK_MAX_TRIES * 4 ) {
+      sched_yield();
+      tries = 0;
+    }
+  }
+  
+  jq_atomic_barrier();
 }
 
-int pthread_spin_unlock( pthread_spinlock_t* lock ) {
-  jq_atomic_cas( lock, 1, 0 );
-  return 0;
+#else
+
+void jq_lock_wait( jq_lock_t* lock, unsigned ticket ) {
+  unsigned backoff = JQ_LOCK_MIN_BACKOFF, tries = 0;
+  
+  (void)ticket;
+  
+  while( !jq_trylock( lock ) ) {
+    jq_lock_pause( backoff );
+    
+    if( backoff < JQ_LOCK_MAX_BACKOFF ) {
+      backoff *= 2;
+    }
+    else if( ++tries == JQ_LOCK_MAX_TRIES ) {
+      sched_yield();
+      tries = 0;
+    }
+  }
 }
 
 #endif
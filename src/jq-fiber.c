@@ -0,0 +1,252 @@
+#if defined(__APPLE__)
+#define _XOPEN_SOURCE 600
+#endif
+
+#include "jq-private.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*-----------------------------------------------------------------------------
+  Internals.
+-----------------------------------------------------------------------------*/
+
+/** Usable stack size of each fiber. */
+#define JQ_FIBER_STACK_SIZE (64 * 1024)
+
+/** Maximum number of idle fibers kept for reuse. */
+#define JQ_FIBER_POOL_SIZE 1024
+
+enum {
+  JQ_FIBER_RUNNING,
+  JQ_FIBER_PARKING,
+  JQ_FIBER_FINISHED
+};
+
+struct jq_fiber {
+  /** Saved fiber context. */
+  ucontext_t context;
+  
+  /** Context to return to when fiber yields. */
+  ucontext_t* caller;
+  
+  /** Stack memory including guard page. */
+  void* stack;
+  
+  /** Size of stack memory. */
+  size_t stack_size;
+  
+  /** Queue to resume fiber on. */
+  jq_queue_t queue;
+  
+  /** Request executing on fiber. */
+  jq_req* req;
+  
+  /** One of JQ_FIBER_* states. */
+  int state;
+  
+  /** Park callback and its object, valid in JQ_FIBER_PARKING state. */
+  jq_park_t park;
+  void* park_object;
+  
+  /** Wait list node. */
+  jq_waiter waiter;
+  
+  /** Next fiber in pool. */
+  jq_fiber* next;
+};
+
+/** Fiber running on current thread. */
+static JQ_THREAD_LOCAL jq_fiber* current_fiber = NULL;
+
+/** Pool of idle fibers. */
+static jq_lock_t pool_lock = JQ_LOCK_INITIALIZER;
+static jq_fiber* pool_first = NULL;
+static size_t pool_size = 0;
+
+static void jq_fiber_yield( jq_fiber* fiber, int state ) {
+  fiber->state = state;
+  swapcontext( &fiber->context, fiber->caller );
+}
+
+/* Fiber entry point. Pooled fiber stays inside this loop forever. */
+static void jq_fiber_main( void ) {
+  jq_fiber* fiber = current_fiber;
+  
+  while( 1 ) {
+    jq_req* req = fiber->req;
+    
+    if( req->handler )
+      req->handler( req->context );
+    
+    jq_req_destroy( req );
+    fiber->req = NULL;
+    
+    jq_fiber_yield( fiber, JQ_FIBER_FINISHED );
+  }
+}
+
+static void jq_fiber_destroy( jq_fiber* fiber ) {
+  munmap( fiber->stack, fiber->stack_size );
+  free( fiber );
+}
+
+/*
+  Kept apart from jq_fiber_create: getcontext returns twice as setjmp does,
+  so no local of caller is live across it.
+*/
+static int jq_fiber_make_context( ucontext_t* context, char* stack ) {
+  if( getcontext( context ) != 0 ) return 0;
+  
+  context->uc_stack.ss_sp = stack;
+  context->uc_stack.ss_size = JQ_FIBER_STACK_SIZE;
+  context->uc_link = NULL;
+  makecontext( context, (void (*)())jq_fiber_main, 0 );
+  
+  return 1;
+}
+
+static jq_fiber* jq_fiber_create() {
+  size_t page = (size_t)sysconf( _SC_PAGESIZE );
+  jq_fiber* fiber = (jq_fiber*)malloc( sizeof(jq_fiber) );
+  
+  if( !fiber ) return NULL;
+  
+  fiber->stack_size = JQ_FIBER_STACK_SIZE + page;
+  fiber->stack = mmap( NULL, fiber->stack_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  
+  if( fiber->stack == MAP_FAILED )
+    goto fail;
+  
+  /* Guard page at the bottom of stack. */
+  mprotect( fiber->stack, page, PROT_NONE );
+  
+  if( !jq_fiber_make_context( &fiber->context, (char*)fiber->stack + page ) ) {
+    munmap( fiber->stack, fiber->stack_size );
+    goto fail;
+  }
+  
+  fiber->req = NULL;
+  fiber->next = NULL;
+  fiber->waiter.next = NULL;
+  fiber->waiter.fiber = fiber;
+  
+  return fiber;
+  
+fail:
+  free( fiber );
+  return NULL;
+}
+
+static jq_fiber* jq_fiber_acquire() {
+  jq_fiber* fiber;
+  
+  jq_lock( &pool_lock );
+  
+  if( (fiber = pool_first) ) {
+    pool_first = fiber->next;
+    pool_size--;
+  }
+  
+  jq_unlock( &pool_lock );
+  
+  return fiber ? fiber : jq_fiber_create();
+}
+
+static void jq_fiber_recycle( jq_fiber* fiber ) {
+  jq_lock( &pool_lock );
+  
+  if( pool_size < JQ_FIBER_POOL_SIZE ) {
+    fiber->next = pool_first;
+    pool_first = fiber;
+    pool_size++;
+    fiber = NULL;
+  }
+  
+  jq_unlock( &pool_lock );
+  
+  if( fiber )
+    jq_fiber_destroy( fiber );
+}
+
+/*
+  Switch to fiber and run it until it finishes or parks.
+  Parking is completed here, on caller side, so fiber can't be woken up
+  while its context is not saved yet.
+*/
+static void jq_fiber_switch( jq_fiber* fiber ) {
+  ucontext_t caller;
+  jq_fiber* prev = current_fiber;
+  
+  do {
+    fiber->caller = &caller;
+    fiber->state = JQ_FIBER_RUNNING;
+    
+    current_fiber = fiber;
+    swapcontext( &caller, &fiber->context );
+    current_fiber = prev;
+  }
+  while( fiber->state == JQ_FIBER_PARKING
+    && !fiber->park( fiber->park_object, &fiber->waiter ) );
+  
+  if( fiber->state == JQ_FIBER_FINISHED )
+    jq_fiber_recycle( fiber );
+}
+
+/*-----------------------------------------------------------------------------
+  Private.
+-----------------------------------------------------------------------------*/
+
+void jq_fiber_execute( jq_queue_t queue, jq_req* req ) {
+  jq_fiber* fiber = NULL;
+  
+  /*
+    Dispatched by req running on fiber (keyed lane): run on that fiber, so
+    waits suspend it and reqs after this one wait too. No memory for fiber
+    - run on thread stack.
+  */
+  if( current_fiber || !(fiber = jq_fiber_acquire()) ) {
+    if( req->handler )
+      req->handler( req->context );
+    
+    jq_req_destroy( req );
+    return;
+  }
+  
+  fiber->queue = queue;
+  fiber->req = req;
+  
+  jq_fiber_switch( fiber );
+}
+
+void jq_fiber_resume_proc( void* fiber ) {
+  jq_fiber_switch( (jq_fiber*)fiber );
+}
+
+void jq_fiber_wake( jq_fiber* fiber ) {
+  jq_queue_submit( fiber->queue, NULL, jq_fiber_resume_proc, fiber );
+}
+
+int jq_fiber_wait( jq_park_t park, void* object ) {
+  jq_fiber* fiber = current_fiber;
+  jq_queue_t queue;
+  
+  if( !fiber ) return 0;
+  
+  /* Queue must outlive suspended fiber. */
+  queue = fiber->queue;
+  jq_retain( queue );
+  
+  fiber->park = park;
+  fiber->park_object = object;
+  jq_fiber_yield( fiber, JQ_FIBER_PARKING );
+  
+  jq_release( queue );
+  return 1;
+}
@@ -1,98 +1,358 @@
 #include "jq-private.h"
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
 
 /*-----------------------------------------------------------------------------
   Internals.
+  Chunk starts with header followed by blocks. Each block is preceded by
+  pointer to its chunk. Blocks are carved lazily, so untouched part of big
+  chunk doesn't become resident.
 -----------------------------------------------------------------------------*/
 
 typedef unsigned char byte_t;
 #define next(p) (*(void**)(p))
+#define chunk_of(p) (((jq_fsa_chunk**)(p))[-1])
+
+/** Default limit of chunk growth. */
+#define JQ_FSA_MAX_BLOCKS 4096
+
+/** Huge page size assumed for JQ_FSA_HUGE. */
+#define JQ_FSA_HUGE_PAGE (2 * 1024 * 1024)
 
-static void jq_fsa_alloc_chunk( jq_fsa* fsa ) {
-  byte_t* p;
-  byte_t* last;
-  byte_t *chunk = (byte_t*)malloc( sizeof(void*) + fsa->blocks_per_chunk * fsa->size );
+struct jq_fsa_chunk {
+  /** Links in partial or full list. */
+  jq_fsa_chunk* prev;
+  jq_fsa_chunk* next;
   
-  next( chunk ) = fsa->first_chunk;
-  fsa->first_chunk = chunk;
+  /** Single linked list of freed blocks. */
+  void* first_free;
   
-  p = chunk + sizeof(void*);
-  last = p + fsa->size * (fsa->blocks_per_chunk - 1);
+  /** Next never used block. */
+  byte_t* fresh;
+  
+  /** Number of allocated and total blocks. */
+  size_t used;
+  size_t blocks;
+  
+  /** Memory taken from system. */
+  void* base;
+  size_t size;
+  int mapped;
+};
+
+static inline size_t jq_fsa_round( size_t size, size_t align ) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+/* Offset of the first block from chunk start. */
+static inline size_t jq_fsa_blocks_offset( jq_fsa* fsa ) {
+  return jq_fsa_round( sizeof(jq_fsa_chunk) + sizeof(void*), fsa->align );
+}
+
+static void jq_fsa_setup( jq_fsa* fsa ) {
+  if( !fsa->align ) fsa->align = JQ_CACHE_LINE;
+  if( fsa->align < sizeof(void*) ) fsa->align = sizeof(void*);
   
-  for( ; p < last; p += fsa->size )
-    next( p ) = p + fsa->size;
+  if( !fsa->max_blocks ) fsa->max_blocks = JQ_FSA_MAX_BLOCKS;
+  if( fsa->max_blocks < fsa->blocks_per_chunk ) fsa->max_blocks = fsa->blocks_per_chunk;
   
-  next( last ) = NULL;
+  if( fsa->flags & JQ_FSA_HUGE ) fsa->flags |= JQ_FSA_MMAP;
   
-  fsa->first_free = chunk + sizeof(void*);
+  fsa->stride = jq_fsa_round( fsa->size + sizeof(void*), fsa->align );
 }
 
-static void jq_fsa_dealloc_chunks( jq_fsa* fsa ) {
-  void* chunk = fsa->first_chunk;
+static void* jq_fsa_map( size_t size, int huge ) {
+  void* p;
+
+#if defined(MAP_HUGETLB)
+  if( huge ) {
+    p = mmap( NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    
+    if( p != MAP_FAILED ) return p;
+  }
+#endif
+
+  if( huge ) {
+    /* Transparent huge pages need aligned mapping: map more and trim. */
+    byte_t* raw = (byte_t*)mmap( NULL, size + JQ_FSA_HUGE_PAGE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    byte_t* aligned;
+    
+    if( raw == MAP_FAILED ) return NULL;
+    
+    aligned = (byte_t*)jq_fsa_round( (size_t)raw, JQ_FSA_HUGE_PAGE );
+    
+    if( aligned > raw )
+      munmap( raw, aligned - raw );
+    
+    munmap( aligned + size, raw + JQ_FSA_HUGE_PAGE - aligned );
+
+#if defined(MADV_HUGEPAGE)
+    madvise( aligned, size, MADV_HUGEPAGE );
+#endif
+
+    return aligned;
+  }
+  
+  p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static jq_fsa_chunk* jq_fsa_chunk_create( jq_fsa* fsa ) {
+  size_t shift = fsa->chunks < 20 ? fsa->chunks : 20;
+  size_t blocks = fsa->blocks_per_chunk << shift;
+  size_t offset = jq_fsa_blocks_offset( fsa );
+  size_t size;
+  jq_fsa_chunk* chunk;
+  void* base;
+  
+  if( blocks > fsa->max_blocks ) blocks = fsa->max_blocks;
+  
+  size = offset + blocks * fsa->stride;
+  
+  if( fsa->flags & JQ_FSA_MMAP ) {
+    size = jq_fsa_round( size, (fsa->flags & JQ_FSA_HUGE)
+      ? JQ_FSA_HUGE_PAGE : (size_t)sysconf( _SC_PAGESIZE ) );
+    
+    if( !(base = jq_fsa_map( size, fsa->flags & JQ_FSA_HUGE )) )
+      return NULL;
+    
+    /* Rounded up part holds more blocks. */
+    blocks = (size - offset) / fsa->stride;
+  }
+  else if( posix_memalign( &base, fsa->align, size ) != 0 ) {
+    return NULL;
+  }
+  
+  chunk = (jq_fsa_chunk*)base;
+  chunk->prev = NULL;
+  chunk->next = NULL;
+  chunk->first_free = NULL;
+  chunk->fresh = (byte_t*)base + offset;
+  chunk->used = 0;
+  chunk->blocks = blocks;
+  chunk->base = base;
+  chunk->size = size;
+  chunk->mapped = (fsa->flags & JQ_FSA_MMAP) != 0;
+  
+  fsa->chunks++;
+  fsa->empty_chunks++;
+  fsa->resident += size;
+  
+  if( fsa->resident > fsa->peak_resident )
+    fsa->peak_resident = fsa->resident;
+  
+  return chunk;
+}
+
+static void jq_fsa_chunk_dealloc( jq_fsa_chunk* chunk ) {
+  if( chunk->mapped ) {
+    munmap( chunk->base, chunk->size );
+  }
+  else {
+    free( chunk->base );
+  }
+}
+
+static inline void jq_fsa_link( jq_fsa_chunk** list, jq_fsa_chunk* chunk ) {
+  chunk->prev = NULL;
+  chunk->next = *list;
+  
+  if( *list )
+    (*list)->prev = chunk;
+  
+  *list = chunk;
+}
+
+static inline void jq_fsa_unlink( jq_fsa_chunk** list, jq_fsa_chunk* chunk ) {
+  if( chunk->prev ) {
+    chunk->prev->next = chunk->next;
+  }
+  else {
+    *list = chunk->next;
+  }
+  
+  if( chunk->next )
+    chunk->next->prev = chunk->prev;
+}
+
+/* Forget chunk which is completely free. Called with lock held. */
+static void jq_fsa_detach_empty( jq_fsa* fsa, jq_fsa_chunk* chunk ) {
+  jq_fsa_unlink( &fsa->partial, chunk );
   
+  fsa->chunks--;
+  fsa->empty_chunks--;
+  fsa->resident -= chunk->size;
+  fsa->released_chunks++;
+}
+
+static void jq_fsa_dealloc_list( jq_fsa_chunk* chunk ) {
   while( chunk ) {
-    void* next_chunk = next( chunk );
-    free( chunk );
+    jq_fsa_chunk* next_chunk = chunk->next;
+    jq_fsa_chunk_dealloc( chunk );
     chunk = next_chunk;
   }
 }
 
+static void jq_fsa_dealloc_chunks( jq_fsa* fsa ) {
+  jq_fsa_dealloc_list( fsa->partial );
+  jq_fsa_dealloc_list( fsa->full );
+  
+  fsa->partial = NULL;
+  fsa->full = NULL;
+  fsa->chunks = 0;
+  fsa->empty_chunks = 0;
+  fsa->resident = 0;
+  fsa->live = 0;
+}
+
 /*-----------------------------------------------------------------------------
   Public.
 -----------------------------------------------------------------------------*/
 
 void jq_fsa_init( jq_fsa* fsa, size_t size, size_t blocks_per_chunk ) {
+  jq_fsa_init_ex( fsa, size, blocks_per_chunk, 0, 0, 0 );
+}
+
+void jq_fsa_init_ex( jq_fsa* fsa, size_t size, size_t blocks_per_chunk, size_t max_blocks, size_t align, int flags ) {
   memset( fsa, 0, sizeof(jq_fsa) );
   
   fsa->size = size < sizeof(void*) ? sizeof(void*) : size;
   fsa->blocks_per_chunk = blocks_per_chunk < 8 ? 8 : blocks_per_chunk;
+  fsa->max_blocks = max_blocks;
+  fsa->align = align;
+  fsa->flags = flags;
   
-  pthread_spin_init( &fsa->lock, 0 );
+  jq_lock_init( &fsa->lock );
 }
 
 void jq_fsa_destroy( jq_fsa* fsa ) {
   jq_fsa_dealloc_chunks( fsa );
-  pthread_spin_destroy( &fsa->lock );
+  jq_lock_destroy( &fsa->lock );
 }
 
 void* jq_fsa_alloc( jq_fsa* fsa ) {
+  jq_fsa_chunk* chunk;
   void* ptr;
   
-  pthread_spin_lock( &fsa->lock );
+  jq_lock( &fsa->lock );
   
-  if( !(ptr = fsa->first_free) ) {
-    jq_fsa_alloc_chunk( fsa );
-    
-    if( !(ptr = fsa->first_free) ) {
+  if( !fsa->stride )
+    jq_fsa_setup( fsa );
+  
+  if( !(chunk = fsa->partial) ) {
+    if( !(chunk = jq_fsa_chunk_create( fsa )) ) {
+      jq_unlock( &fsa->lock );
       return NULL;
     }
+    
+    jq_fsa_link( &fsa->partial, chunk );
+  }
+  
+  if( (ptr = chunk->first_free) ) {
+    chunk->first_free = next( ptr );
+  }
+  else {
+    ptr = chunk->fresh;
+    chunk->fresh += fsa->stride;
+    chunk_of( ptr ) = chunk;
+  }
+  
+  if( chunk->used++ == 0 )
+    fsa->empty_chunks--;
+  
+  if( chunk->used == chunk->blocks ) {
+    jq_fsa_unlink( &fsa->partial, chunk );
+    jq_fsa_link( &fsa->full, chunk );
   }
   
-  fsa->first_free = next( fsa->first_free );
+  fsa->live++;
   
-  pthread_spin_unlock( &fsa->lock );
+  jq_unlock( &fsa->lock );
   
   return ptr;
 }
 
 void jq_fsa_free( jq_fsa* fsa, void* ptr ) {
+  jq_fsa_chunk* chunk;
+  jq_fsa_chunk* release = NULL;
+  
   if( !ptr ) return;
   
-  pthread_spin_lock( &fsa->lock );
+  chunk = chunk_of( ptr );
+  
+  jq_lock( &fsa->lock );
   
-  next( ptr ) = fsa->first_free;
-  fsa->first_free = ptr;
+  next( ptr ) = chunk->first_free;
+  chunk->first_free = ptr;
   
-  pthread_spin_unlock( &fsa->lock );
+  if( chunk->used == chunk->blocks ) {
+    jq_fsa_unlink( &fsa->full, chunk );
+    jq_fsa_link( &fsa->partial, chunk );
+  }
+  
+  fsa->live--;
+  
+  /* Keep one free chunk to avoid thrashing, release others. */
+  if( --chunk->used == 0 && ++fsa->empty_chunks > 1 ) {
+    jq_fsa_detach_empty( fsa, chunk );
+    release = chunk;
+  }
+  
+  jq_unlock( &fsa->lock );
+  
+  if( release )
+    jq_fsa_chunk_dealloc( release );
 }
 
 void jq_fsa_free_all( jq_fsa* fsa ) {
-  pthread_spin_lock( &fsa->lock );
-  
+  jq_lock( &fsa->lock );
   jq_fsa_dealloc_chunks( fsa );
-  fsa->first_free = NULL;
-  fsa->first_chunk = NULL;
+  jq_unlock( &fsa->lock );
+}
+
+void jq_fsa_trim( jq_fsa* fsa ) {
+  jq_fsa_chunk* chunk;
+  jq_fsa_chunk* release = NULL;
+  
+  jq_lock( &fsa->lock );
+  
+  chunk = fsa->partial;
+  
+  while( chunk ) {
+    jq_fsa_chunk* next_chunk = chunk->next;
+    
+    if( chunk->used == 0 ) {
+      jq_fsa_detach_empty( fsa, chunk );
+      chunk->next = release;
+      release = chunk;
+    }
+    
+    chunk = next_chunk;
+  }
+  
+  jq_unlock( &fsa->lock );
+  
+  jq_fsa_dealloc_list( release );
+}
+
+void jq_fsa_get_stats( jq_fsa* fsa, jq_fsa_stats* stats ) {
+  jq_lock( &fsa->lock );
+  
+  stats->chunks = fsa->chunks;
+  stats->empty_chunks = fsa->empty_chunks;
+  stats->resident = fsa->resident;
+  stats->peak_resident = fsa->peak_resident;
+  stats->live = fsa->live;
+  stats->live_bytes = fsa->live * fsa->size;
+  stats->released_chunks = fsa->released_chunks;
   
-  pthread_spin_unlock( &fsa->lock );
+  jq_unlock( &fsa->lock );
 }
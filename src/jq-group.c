@@ -1,31 +1,90 @@
 #include "jq-private.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/** Size of the first arena chunk, next ones double up to the max. */
+#define JQ_ARENA_CHUNK_SIZE (16 * 1024)
+#define JQ_ARENA_MAX_CHUNK_SIZE (1024 * 1024)
+
+/** Piece of chunk taken by thread to allocate from without locking. */
+#define JQ_ARENA_SLAB_SIZE 2048
+
+#define JQ_ARENA_ALIGN 16
 
 typedef struct jq_group jq_group;
+typedef struct jq_arena_chunk jq_arena_chunk;
+
+struct jq_arena_chunk {
+  jq_arena_chunk* next;
+  
+  /** Free part of chunk. */
+  char* pos;
+  char* end;
+};
 
 struct jq_group {
   jq_object object;
   
-  /** Mutex for condition variable. */
+  /** Mutex for condition variable and waiters. */
   pthread_mutex_t mutex;
   
-  /** Condition to signal when new req was added to queue. */
+  /** Condition to signal when the last member left. */
   pthread_cond_t cond;
   
-  /** Number of group members. */
-  size_t members;
+  /** Number of group members, counted without mutex. */
+  volatile size_t members;
+  
+  /**
+    Threads checking members under mutex or sleeping on cond, and parked
+    fibers. Member leaving last takes mutex only if there are any: each
+    side updates its counter atomically, then reads the other's.
+  */
+  volatile size_t sleepers;
+  
+  /** Fibers suspended in jq_group_wait. */
+  jq_waiter* waiters;
+  
+  /** Unique id, tells thread slab of destroyed group from this one's. */
+  uint64_t id;
+  
+  /** Arena chunks, the newest first. */
+  jq_arena_chunk* arena;
+  size_t arena_next_size;
+  jq_lock_t arena_lock;
 };
 
+/** Slab of current thread. */
+static JQ_THREAD_LOCAL struct {
+  uint64_t group_id;
+  char* pos;
+  char* end;
+} arena_slab;
+
+static volatile uint64_t last_group_id = 0;
+
+static jq_fsa group_allocator = JQ_FSA_INITIALIZER( sizeof(jq_group), 0 );
+
 static void jq_group_vtable_destroy( void* object ) {
   jq_group* group = (jq_group*)object;
+  
+  /* Members are gone, so is everything allocated for them. */
+  while( group->arena ) {
+    jq_arena_chunk* next = group->arena->next;
+    free( group->arena );
+    group->arena = next;
+  }
+  
+  jq_lock_destroy( &group->arena_lock );
   pthread_cond_destroy( &group->cond );
   pthread_mutex_destroy( &group->mutex );
+  jq_fsa_free( &group_allocator, group );
   //printf( "%p group destroyed!\n", group );
 }
 
-static jq_fsa group_allocator = JQ_FSA_INITIALIZER( sizeof(jq_group), 0 );
-
 static jq_object_vtable group_vtable = {
   jq_group_vtable_destroy
 };
@@ -43,6 +102,13 @@ jq_group_t jq_group_create() {
     
     if( pthread_cond_init( &group->cond, NULL ) != 0 )
       goto fail;
+    
+    group->id = jq_atomic_add( &last_group_id, 1 ) + 1;
+    group->arena_next_size = JQ_ARENA_CHUNK_SIZE;
+    jq_lock_init( &group->arena_lock );
+    
+    /* Creator usually submits all grouped requests, retaining group for each. */
+    jq_object_bias( &group->object );
   }
   
   //printf( "%p group created!\n", group );
@@ -58,25 +124,116 @@ void jq_group_enter( jq_group_t group ) {
   if( !group ) return;
   
   //printf( "%p group entered!\n", group );
-  pthread_mutex_lock( &group->mutex );
-  group->members++;
-  pthread_mutex_unlock( &group->mutex );
+  jq_atomic_add( &group->members, 1 );
 }
 
 void jq_group_leave( jq_group_t group ) {
+  jq_waiter* waiters = NULL;
+  
   if( !group ) return;
   
   //printf( "%p group leaved!\n", group );
+  if( jq_atomic_sub( &group->members, 1 ) != 1 || !group->sleepers )
+    return;
+  
   pthread_mutex_lock( &group->mutex );
-  if( group->members-- == 1 ) {
-    pthread_cond_signal( &group->cond );
+  
+  /* Woken fibers are not sleepers anymore. */
+  for( waiters = group->waiters; waiters; waiters = waiters->next )
+    jq_atomic_sub( &group->sleepers, 1 );
+  
+  waiters = group->waiters;
+  group->waiters = NULL;
+  pthread_cond_broadcast( &group->cond );
+  pthread_mutex_unlock( &group->mutex );
+  
+  while( waiters ) {
+    jq_waiter* next = waiters->next;
+    jq_fiber_wake( waiters->fiber );
+    waiters = next;
   }
+}
+
+int jq_group_park( void* object, jq_waiter* waiter ) {
+  jq_group* group = (jq_group*)object;
+  int parked = 0;
+  
+  jq_atomic_add( &group->sleepers, 1 );
+  pthread_mutex_lock( &group->mutex );
+  
+  if( group->members != 0 ) {
+    waiter->next = group->waiters;
+    group->waiters = waiter;
+    parked = 1;
+  }
+  
   pthread_mutex_unlock( &group->mutex );
+  
+  /* Parked fiber is counted until member leaving last takes it. */
+  if( !parked )
+    jq_atomic_sub( &group->sleepers, 1 );
+  
+  return parked;
 }
 
-void jq_group_wait( jq_group_t group ) {
-  if( !group ) return;
+static int jq_group_wait_for( void* object, int timeout_ms ) {
+  jq_group* group = (jq_group*)object;
+  struct timeval now;
+  struct timespec deadline;
+  int done;
+  
+  if( timeout_ms == 0 || group->members == 0 )
+    return group->members == 0;
+  
+  jq_atomic_add( &group->sleepers, 1 );
+  pthread_mutex_lock( &group->mutex );
+  
+  if( group->members != 0 && timeout_ms > 0 ) {
+    gettimeofday( &now, NULL );
+    deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+    
+    if( deadline.tv_nsec >= 1000000000 ) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    
+    /* Single wait: jq_group_wake ends it for helper to pick new reqs. */
+    pthread_cond_timedwait( &group->cond, &group->mutex, &deadline );
+  }
+  else if( timeout_ms < 0 ) {
+    while( group->members != 0 )
+      pthread_cond_wait( &group->cond, &group->mutex );
+  }
+  
+  done = group->members == 0;
+  pthread_mutex_unlock( &group->mutex );
+  jq_atomic_sub( &group->sleepers, 1 );
+  
+  return done;
+}
+
+static void jq_group_wake( void* object ) {
+  jq_group* group = (jq_group*)object;
+  
+  pthread_mutex_lock( &group->mutex );
+  pthread_cond_broadcast( &group->cond );
+  pthread_mutex_unlock( &group->mutex );
+}
+
+static void jq_group_wait_members( jq_group* group ) {
+  /* Suspend fiber instead of blocking thread. */
+  if( jq_fiber_wait( jq_group_park, group ) )
+    return;
   
+  /* Worker thread executes requests from its queue while waiting. */
+  if( jq_worker_help( jq_group_wait_for, jq_group_wake, group ) )
+    return;
+  
+  if( group->members == 0 )
+    return;
+  
+  jq_atomic_add( &group->sleepers, 1 );
   pthread_mutex_lock( &group->mutex );
   
   while( group->members != 0 ) {
@@ -85,4 +242,88 @@ void jq_group_wait( jq_group_t group ) {
   }
   
   pthread_mutex_unlock( &group->mutex );
+  jq_atomic_sub( &group->sleepers, 1 );
+}
+
+void jq_group_wait( jq_group_t group ) {
+  if( !group ) return;
+  
+  jq_group_wait_members( group );
+  
+  /*
+    Members released groups of this thread meanwhile: destroy those which
+    are gone now rather than keep their arenas till next jq_release.
+  */
+  jq_object_collect();
+}
+
+/*-----------------------------------------------------------------------------
+  Arena.
+  Threads take slabs from shared chunk under lock and allocate from their
+  slab without synchronization. Big blocks are taken from chunk directly.
+-----------------------------------------------------------------------------*/
+
+static void* jq_group_arena_take( jq_group* group, size_t size ) {
+  jq_arena_chunk* chunk;
+  char* ptr = NULL;
+  
+  jq_lock( &group->arena_lock );
+  
+  chunk = group->arena;
+  
+  if( !chunk || (size_t)(chunk->end - chunk->pos) < size ) {
+    size_t chunk_size = group->arena_next_size;
+    size_t header = (sizeof(jq_arena_chunk) + JQ_ARENA_ALIGN - 1) & ~(size_t)(JQ_ARENA_ALIGN - 1);
+    
+    if( size > SIZE_MAX - header )
+      goto done;
+    
+    if( chunk_size < header + size )
+      chunk_size = header + size;
+    
+    if( group->arena_next_size < JQ_ARENA_MAX_CHUNK_SIZE )
+      group->arena_next_size *= 2;
+    
+    if( !(chunk = (jq_arena_chunk*)malloc( chunk_size )) )
+      goto done;
+    
+    chunk->pos = (char*)chunk + header;
+    chunk->end = (char*)chunk + chunk_size;
+    chunk->next = group->arena;
+    group->arena = chunk;
+  }
+  
+  ptr = chunk->pos;
+  chunk->pos += size;
+  
+done:
+  jq_unlock( &group->arena_lock );
+  return ptr;
+}
+
+void* jq_group_alloc( jq_group_t group, size_t size ) {
+  char* ptr;
+  
+  if( !group || size > SIZE_MAX - JQ_ARENA_ALIGN ) return NULL;
+  
+  size = (size + JQ_ARENA_ALIGN - 1) & ~(size_t)(JQ_ARENA_ALIGN - 1);
+  
+  if( arena_slab.group_id == group->id && (size_t)(arena_slab.end - arena_slab.pos) >= size ) {
+    ptr = arena_slab.pos;
+    arena_slab.pos += size;
+    return ptr;
+  }
+  
+  if( size > JQ_ARENA_SLAB_SIZE / 4 )
+    return jq_group_arena_take( group, size );
+  
+  /* Rest of old slab is left unused. */
+  if( !(ptr = (char*)jq_group_arena_take( group, JQ_ARENA_SLAB_SIZE )) )
+    return NULL;
+  
+  arena_slab.group_id = group->id;
+  arena_slab.pos = ptr + size;
+  arena_slab.end = ptr + JQ_ARENA_SLAB_SIZE;
+  
+  return ptr;
 }
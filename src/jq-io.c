@@ -0,0 +1,651 @@
+#include "jq-private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define JQ_IO_HAS_URING 1
+#endif
+#endif
+
+/*-----------------------------------------------------------------------------
+  Internals.
+-----------------------------------------------------------------------------*/
+
+/** Default number of outstanding operations. */
+#define JQ_IO_DEPTH 256
+
+/** Number of threads of fallback pool. */
+#define JQ_IO_THREADS_COUNT 4
+
+enum {
+  JQ_IO_OP_READ,
+  JQ_IO_OP_WRITE,
+  JQ_IO_OP_FSYNC
+};
+
+typedef struct jq_io jq_io;
+typedef struct jq_io_completion jq_io_completion;
+typedef struct jq_io_op jq_io_op;
+
+/** Kept in inline storage of request submitted on completion. */
+struct jq_io_completion {
+  jq_io_handler_t handler;
+  void* context;
+  jq_queue_t queue;
+  ssize_t result;
+};
+
+typedef char jq_io_completion_fits[sizeof(jq_io_completion) <= JQ_REQ_INLINE_SIZE ? 1 : -1];
+
+/** Operation performed by fallback thread pool. */
+struct jq_io_op {
+  jq_io* io;
+  jq_req_t req;
+  int opcode;
+  int fd;
+  void* buf;
+  size_t size;
+  off_t offset;
+};
+
+struct jq_io {
+  jq_object object;
+  
+  /** JQ_IO_URING or JQ_IO_THREADS. */
+  int backend;
+  
+  /** Maximum number of outstanding operations. */
+  int depth;
+  
+  /** Number of outstanding operations. Used as futex word. */
+  volatile int inflight;
+  
+  /** Number of threads blocked on inflight. */
+  volatile int waiting;
+  
+  /** Fallback thread pool. */
+  jq_worker_t pool;
+
+#if defined(JQ_IO_HAS_URING)
+  int ring_fd;
+  
+  /** Submission ring. */
+  void* sq_ring;
+  size_t sq_ring_size;
+  volatile unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  
+  /** Completion ring, may share mapping with submission one. */
+  void* cq_ring;
+  size_t cq_ring_size;
+  volatile unsigned* cq_head;
+  volatile unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  
+  /** Protects fields below and submission ring tail. */
+  jq_lock_t lock;
+  
+  /** Entries put to submission ring but not passed to kernel yet. */
+  unsigned unsubmitted;
+  
+  /** Some thread is passing entries to kernel. */
+  int submitting;
+  
+  /** Nesting count of jq_io_plug. */
+  int plugged;
+  
+  /** Set when object is destroyed. */
+  volatile int stopping;
+  
+  /** Thread reaping completions. */
+  pthread_t reaper;
+#endif
+};
+
+static jq_fsa op_allocator = JQ_FSA_INITIALIZER( sizeof(jq_io_op), 0 );
+
+static void jq_io_complete_proc( void* storage ) {
+  jq_io_completion* completion = (jq_io_completion*)storage;
+  completion->handler( completion->context, completion->result );
+}
+
+static void jq_io_flush( jq_io* io );
+
+/* Reserve slot for operation, waiting while depth is reached. */
+static void jq_io_reserve( jq_io* io ) {
+  while( 1 ) {
+    int inflight = io->inflight;
+    
+    if( inflight < io->depth ) {
+      if( jq_atomic_cas( &io->inflight, inflight, inflight + 1 ) == inflight )
+        return;
+      
+      continue;
+    }
+    
+    /* Plugged entries must reach kernel or nothing will complete. */
+    jq_io_flush( io );
+    
+    jq_atomic_add( &io->waiting, 1 );
+    jq_futex_wait( &io->inflight, inflight, -1 );
+    jq_atomic_sub( &io->waiting, 1 );
+  }
+}
+
+static void jq_io_release_slots( jq_io* io, int count ) {
+  jq_atomic_sub( &io->inflight, count );
+  
+  if( io->waiting )
+    jq_futex_wake( &io->inflight, INT_MAX );
+}
+
+static void jq_io_wait_idle( jq_io* io ) {
+  int inflight;
+  
+  while( (inflight = io->inflight) != 0 ) {
+    jq_atomic_add( &io->waiting, 1 );
+    jq_futex_wait( &io->inflight, inflight, -1 );
+    jq_atomic_sub( &io->waiting, 1 );
+  }
+}
+
+/* Submit completion request to its queue. */
+static void jq_io_complete( jq_req_t req, ssize_t result ) {
+  jq_io_completion* completion = (jq_io_completion*)jq_req_get_storage( req );
+  jq_queue_t queue = completion->queue;
+  
+  completion->result = result;
+  jq_queue_submit_req( queue, req );
+  jq_release( queue );
+}
+
+/*-----------------------------------------------------------------------------
+  Thread pool backend.
+-----------------------------------------------------------------------------*/
+
+static void jq_io_op_proc( void* context ) {
+  jq_io_op* op = (jq_io_op*)context;
+  jq_io* io = op->io;
+  ssize_t result;
+  
+  do {
+    switch( op->opcode ) {
+      case JQ_IO_OP_READ:
+        result = pread( op->fd, op->buf, op->size, op->offset );
+        break;
+      
+      case JQ_IO_OP_WRITE:
+        result = pwrite( op->fd, op->buf, op->size, op->offset );
+        break;
+      
+      default:
+        result = fsync( op->fd );
+        break;
+    }
+  }
+  while( result < 0 && errno == EINTR );
+  
+  jq_io_complete( op->req, result < 0 ? -errno : result );
+  jq_fsa_free( &op_allocator, op );
+  jq_io_release_slots( io, 1 );
+}
+
+static int jq_io_threads_submit( jq_io* io, int opcode, int fd, void* buf, size_t size, off_t offset, jq_req_t req ) {
+  jq_io_op* op = (jq_io_op*)jq_fsa_alloc( &op_allocator );
+  if( !op ) return 0;
+  
+  op->io = io;
+  op->req = req;
+  op->opcode = opcode;
+  op->fd = fd;
+  op->buf = buf;
+  op->size = size;
+  op->offset = offset;
+  
+  jq_worker_async( io->pool, jq_io_op_proc, op );
+  return 1;
+}
+
+/*-----------------------------------------------------------------------------
+  io_uring backend.
+  Submitters put entries to submission ring under lock; whoever finds no
+  other thread inside io_uring_enter passes all accumulated entries to
+  kernel at once. Reaper thread drains all available completions on each
+  wake up and submits them to their queues.
+-----------------------------------------------------------------------------*/
+
+#if defined(JQ_IO_HAS_URING)
+
+static int jq_io_uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags ) {
+  return (int)syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+/*
+  Called with lock held. Releases it. Entries kernel doesn't take now (out
+  of resources or busy with completions) are left in ring for the next
+  submit or for reaper, which flushes after completions free resources.
+*/
+static void jq_io_uring_submit_pending( jq_io* io ) {
+  int submitted;
+  
+  io->submitting = 1;
+  
+  while( io->unsubmitted ) {
+    unsigned count = io->unsubmitted;
+    
+    jq_unlock( &io->lock );
+    submitted = jq_io_uring_enter( io->ring_fd, count, 0, 0 );
+    jq_lock( &io->lock );
+    
+    if( submitted > 0 )
+      io->unsubmitted -= (unsigned)submitted;
+    else if( submitted == 0 || errno != EINTR )
+      break;
+  }
+  
+  io->submitting = 0;
+  jq_unlock( &io->lock );
+}
+
+static void jq_io_uring_flush( jq_io* io ) {
+  jq_lock( &io->lock );
+  
+  if( io->unsubmitted && !io->submitting ) {
+    jq_io_uring_submit_pending( io );
+  }
+  else {
+    jq_unlock( &io->lock );
+  }
+}
+
+static void jq_io_uring_submit( jq_io* io, int opcode, int fd, void* buf, size_t size, off_t offset, jq_req_t req ) {
+  struct io_uring_sqe* sqe;
+  unsigned tail, index;
+  
+  jq_lock( &io->lock );
+  
+  tail = *io->sq_tail;
+  index = tail & io->sq_mask;
+  sqe = &io->sqes[index];
+  
+  memset( sqe, 0, sizeof(*sqe) );
+  sqe->fd = fd;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  
+  switch( opcode ) {
+    case JQ_IO_OP_READ:
+      sqe->opcode = IORING_OP_READ;
+      break;
+    
+    case JQ_IO_OP_WRITE:
+      sqe->opcode = IORING_OP_WRITE;
+      break;
+    
+    case JQ_IO_OP_FSYNC:
+      sqe->opcode = IORING_OP_FSYNC;
+      break;
+    
+    default:
+      sqe->opcode = IORING_OP_NOP;
+      sqe->fd = -1;
+      break;
+  }
+  
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  /* Size fits, see jq_io_submit. */
+  sqe->len = (unsigned)size;
+  sqe->off = (uint64_t)offset;
+  
+  io->sq_array[index] = index;
+  
+  /* Entry must be visible before tail. */
+  jq_atomic_barrier();
+  *io->sq_tail = tail + 1;
+  io->unsubmitted++;
+  
+  if( !io->plugged && !io->submitting ) {
+    jq_io_uring_submit_pending( io );
+  }
+  else {
+    jq_unlock( &io->lock );
+  }
+}
+
+static void* jq_io_reaper_main( void* arg ) {
+  jq_io* io = (jq_io*)arg;
+  
+  while( 1 ) {
+    unsigned head = *io->cq_head;
+    unsigned tail;
+    int count = 0;
+    
+    jq_atomic_barrier();
+    tail = *io->cq_tail;
+    jq_atomic_barrier();
+    
+    if( head == tail ) {
+      if( io->stopping && io->inflight == 0 )
+        break;
+      
+      jq_io_uring_enter( io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS );
+      continue;
+    }
+    
+    while( head != tail ) {
+      struct io_uring_cqe* cqe = &io->cqes[head & io->cq_mask];
+      jq_req_t req = (jq_req_t)(uintptr_t)cqe->user_data;
+      
+      /* Stop request carries no completion. */
+      if( req )
+        jq_io_complete( req, cqe->res );
+      
+      head++;
+      count++;
+    }
+    
+    jq_atomic_barrier();
+    *io->cq_head = head;
+    
+    jq_io_release_slots( io, count );
+    
+    /* Entries kernel refused may fit now. Plugged ones wait for unplug. */
+    if( io->unsubmitted && !io->plugged )
+      jq_io_uring_flush( io );
+  }
+  
+  return NULL;
+}
+
+static void jq_io_uring_unmap( jq_io* io ) {
+  if( io->sqes != MAP_FAILED )
+    munmap( io->sqes, io->sqes_size );
+  
+  if( io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring )
+    munmap( io->cq_ring, io->cq_ring_size );
+  
+  if( io->sq_ring != MAP_FAILED )
+    munmap( io->sq_ring, io->sq_ring_size );
+  
+  close( io->ring_fd );
+}
+
+static int jq_io_uring_init( jq_io* io, size_t depth ) {
+  struct io_uring_params params;
+  char* sq;
+  char* cq;
+  
+  memset( &params, 0, sizeof(params) );
+  
+  io->ring_fd = (int)syscall( __NR_io_uring_setup, (unsigned)depth, &params );
+  if( io->ring_fd < 0 ) return 0;
+  
+  /* READ and WRITE opcodes came with the same kernel as this feature. */
+  if( !(params.features & IORING_FEAT_RW_CUR_POS) ) {
+    close( io->ring_fd );
+    return 0;
+  }
+  
+  io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  
+  if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+    if( io->cq_ring_size > io->sq_ring_size )
+      io->sq_ring_size = io->cq_ring_size;
+    
+    io->cq_ring_size = io->sq_ring_size;
+  }
+  
+  io->sq_ring = mmap( NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING );
+  
+  io->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? io->sq_ring
+    : mmap( NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING );
+  
+  io->sqes = (struct io_uring_sqe*)mmap( NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES );
+  
+  if( io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED ) {
+    jq_io_uring_unmap( io );
+    return 0;
+  }
+  
+  sq = (char*)io->sq_ring;
+  cq = (char*)io->cq_ring;
+  
+  io->sq_tail = (volatile unsigned*)(sq + params.sq_off.tail);
+  io->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  io->sq_array = (unsigned*)(sq + params.sq_off.array);
+  
+  io->cq_head = (volatile unsigned*)(cq + params.cq_off.head);
+  io->cq_tail = (volatile unsigned*)(cq + params.cq_off.tail);
+  io->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  
+  /* Completion ring is at least as big, so it never overflows. */
+  io->depth = (int)params.sq_entries;
+  
+  jq_lock_init( &io->lock );
+  
+  if( pthread_create( &io->reaper, NULL, jq_io_reaper_main, io ) != 0 ) {
+    jq_lock_destroy( &io->lock );
+    jq_io_uring_unmap( io );
+    return 0;
+  }
+  
+  return 1;
+}
+
+static void jq_io_uring_destroy( jq_io* io ) {
+  io->stopping = 1;
+  
+  /* Wake reaper with no-op. */
+  jq_io_reserve( io );
+  jq_io_uring_submit( io, -1, -1, NULL, 0, 0, NULL );
+  jq_io_uring_flush( io );
+  
+  pthread_join( io->reaper, NULL );
+  jq_lock_destroy( &io->lock );
+  jq_io_uring_unmap( io );
+}
+
+#endif
+
+static void jq_io_flush( jq_io* io ) {
+#if defined(JQ_IO_HAS_URING)
+  if( io->backend == JQ_IO_URING )
+    jq_io_uring_flush( io );
+#endif
+}
+
+/*-----------------------------------------------------------------------------
+  Object.
+-----------------------------------------------------------------------------*/
+
+static void jq_io_vtable_destroy( void* object ) {
+  jq_io* io = (jq_io*)object;
+
+#if defined(JQ_IO_HAS_URING)
+  if( io->backend == JQ_IO_URING )
+    jq_io_uring_destroy( io );
+#endif
+
+  if( io->pool ) {
+    jq_io_wait_idle( io );
+    jq_release( io->pool );
+  }
+  
+  free( io );
+}
+
+static jq_object_vtable io_vtable = {
+  jq_io_vtable_destroy
+};
+
+static int jq_io_submit(
+  jq_io* io,
+  int opcode,
+  int fd,
+  void* buf,
+  size_t size,
+  off_t offset,
+  jq_queue_t queue,
+  jq_group_t group,
+  jq_io_handler_t handler,
+  void* context )
+{
+  jq_io_completion* completion;
+  jq_req_t req;
+  
+  /* Length of io_uring entry is 32 bit: larger one would be truncated. */
+  if( size > UINT_MAX ) return 0;
+  
+  if( !(req = jq_req_alloc( group, jq_io_complete_proc, NULL )) )
+    return 0;
+  
+  completion = (jq_io_completion*)jq_req_get_storage( req );
+  completion->handler = handler;
+  completion->context = context;
+  completion->queue = queue;
+  completion->result = 0;
+  
+  jq_io_reserve( io );
+  jq_retain( queue );
+
+#if defined(JQ_IO_HAS_URING)
+  if( io->backend == JQ_IO_URING ) {
+    jq_io_uring_submit( io, opcode, fd, buf, size, offset, req );
+    return 1;
+  }
+#endif
+
+  if( !jq_io_threads_submit( io, opcode, fd, buf, size, offset, req ) ) {
+    jq_release( queue );
+    jq_io_release_slots( io, 1 );
+    jq_req_free( req );
+    return 0;
+  }
+  
+  return 1;
+}
+
+/*-----------------------------------------------------------------------------
+  Public.
+-----------------------------------------------------------------------------*/
+
+jq_io_t jq_io_create( size_t depth, int backend ) {
+  jq_io* io = (jq_io*)malloc( sizeof(jq_io) );
+  
+  if( !io ) return NULL;
+  
+  memset( io, 0, sizeof(jq_io) );
+  jq_object_init( &io->object, &io_vtable );
+  
+  if( !depth ) depth = JQ_IO_DEPTH;
+  if( depth > INT_MAX ) depth = INT_MAX;
+
+#if defined(JQ_IO_HAS_URING)
+  if( backend != JQ_IO_THREADS && jq_io_uring_init( io, depth ) ) {
+    io->backend = JQ_IO_URING;
+    return io;
+  }
+#endif
+
+  if( backend == JQ_IO_URING )
+    goto fail;
+  
+  io->backend = JQ_IO_THREADS;
+  io->depth = (int)depth;
+  io->pool = jq_worker_create( NULL, JQ_IO_THREADS_COUNT );
+  
+  if( !io->pool )
+    goto fail;
+  
+  return io;
+  
+fail:
+  free( io );
+  return NULL;
+}
+
+int jq_io_get_backend( jq_io_t io ) {
+  return io->backend;
+}
+
+int jq_io_read(
+  jq_io_t io,
+  int fd,
+  void* buf,
+  size_t size,
+  off_t offset,
+  jq_queue_t queue,
+  jq_group_t group,
+  jq_io_handler_t handler,
+  void* context )
+{
+  return jq_io_submit( io, JQ_IO_OP_READ, fd, buf, size, offset, queue, group, handler, context );
+}
+
+int jq_io_write(
+  jq_io_t io,
+  int fd,
+  const void* buf,
+  size_t size,
+  off_t offset,
+  jq_queue_t queue,
+  jq_group_t group,
+  jq_io_handler_t handler,
+  void* context )
+{
+  return jq_io_submit( io, JQ_IO_OP_WRITE, fd, (void*)buf, size, offset, queue, group, handler, context );
+}
+
+int jq_io_fsync(
+  jq_io_t io,
+  int fd,
+  jq_queue_t queue,
+  jq_group_t group,
+  jq_io_handler_t handler,
+  void* context )
+{
+  return jq_io_submit( io, JQ_IO_OP_FSYNC, fd, NULL, 0, 0, queue, group, handler, context );
+}
+
+void jq_io_plug( jq_io_t io ) {
+#if defined(JQ_IO_HAS_URING)
+  if( io->backend == JQ_IO_URING ) {
+    jq_lock( &io->lock );
+    io->plugged++;
+    jq_unlock( &io->lock );
+  }
+#endif
+}
+
+void jq_io_unplug( jq_io_t io ) {
+#if defined(JQ_IO_HAS_URING)
+  if( io->backend == JQ_IO_URING ) {
+    jq_lock( &io->lock );
+    
+    if( --io->plugged == 0 && io->unsubmitted && !io->submitting ) {
+      jq_io_uring_submit_pending( io );
+    }
+    else {
+      jq_unlock( &io->lock );
+    }
+  }
+#endif
+}
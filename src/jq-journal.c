@@ -0,0 +1,744 @@
+#include "jq-private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/*-----------------------------------------------------------------------------
+  On-disk format.
+  
+  Journal directory holds segment files named by their base offset and
+  an "ack" index file with acknowledged offset (low watermark): every record
+  below it was handled, so segments below it can be removed.
+  
+  Segment is a sequence of records, each 8 byte aligned. Record is published
+  by writing its flags last with JQ_JOURNAL_RECORD_WRITTEN set; zero flags
+  mark the end of segment, so payload may be empty. Payload is checksummed
+  to detect records torn by crash.
+-----------------------------------------------------------------------------*/
+
+#define JQ_JOURNAL_SEGMENT_SIZE (4 * 1024 * 1024)
+#define JQ_JOURNAL_SYNC_MS 10
+#define JQ_JOURNAL_ALIGN 8
+
+#define JQ_JOURNAL_RECORD_WRITTEN 1
+#define JQ_JOURNAL_RECORD_ACKED 2
+
+typedef struct jq_journal_record jq_journal_record;
+
+struct jq_journal_record {
+  /** Payload size. */
+  uint32_t size;
+  
+  /** Payload checksum. */
+  uint32_t checksum;
+  
+  /** JQ_JOURNAL_RECORD_* flags, zero for end of segment. */
+  volatile uint32_t flags;
+  
+  uint32_t reserved;
+};
+
+#define JQ_JOURNAL_ROUND( size ) \
+  (((size) + JQ_JOURNAL_ALIGN - 1) & ~(uint64_t)(JQ_JOURNAL_ALIGN - 1))
+
+#define JQ_JOURNAL_RECORD_SIZE( size ) \
+  (sizeof(jq_journal_record) + JQ_JOURNAL_ROUND( size ))
+
+/*-----------------------------------------------------------------------------
+  Internals.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_journal jq_journal;
+typedef struct jq_journal_segment jq_journal_segment;
+typedef struct jq_journal_entry jq_journal_entry;
+
+/** Mapped segment file. */
+struct jq_journal_segment {
+  /** Offset of the first byte of segment in journal. */
+  uint64_t base;
+  
+  /** Mapping and its size. */
+  char* data;
+  size_t size;
+  
+  /** Number of records submitted but not acknowledged yet. */
+  volatile size_t pending;
+  
+  /** Next (newer) segment. */
+  jq_journal_segment* next;
+};
+
+struct jq_journal {
+  jq_object object;
+  
+  /** Directory path. */
+  char* dir;
+  
+  /** Queue requests are submitted to and their handler. */
+  jq_queue_t queue;
+  jq_journal_handler_t handler;
+  
+  /** Capacity of new segments. */
+  size_t segment_size;
+  
+  /** Protects everything below. */
+  pthread_mutex_t mutex;
+  
+  /** Wakes flusher thread. */
+  pthread_cond_t flush_cond;
+  
+  /** Signaled after each sync. */
+  pthread_cond_t synced_cond;
+  
+  /** Segments from oldest to active (last). */
+  jq_journal_segment* first;
+  jq_journal_segment* last;
+  
+  /** Append position in active segment. */
+  size_t pos;
+  
+  /** Flusher cycles started and finished. */
+  uint64_t cycles_started;
+  uint64_t cycles_done;
+  
+  /** Acknowledged offset stored in index. */
+  uint64_t acked;
+  
+  /** Flush requested by jq_journal_flush. */
+  int flush_requested;
+  
+  /** Journal end and acks synced by the last cycle. */
+  uint64_t synced_end;
+  size_t synced_acks;
+  
+  /** Records acknowledged so far, counted without lock. */
+  volatile size_t acks;
+  
+  /**
+    Flusher sleeps until something is appended or acknowledged. Set under
+    mutex, read by acknowledging threads without it.
+  */
+  volatile int idle;
+  
+  /** Set to stop flusher thread. */
+  int stopping;
+  
+  pthread_t flusher;
+};
+
+/** Request context. */
+struct jq_journal_entry {
+  jq_journal* journal;
+  jq_journal_segment* segment;
+  jq_journal_record* record;
+};
+
+static jq_fsa entry_allocator = JQ_FSA_INITIALIZER( sizeof(jq_journal_entry), 0 );
+
+/* FNV-1a. */
+static uint32_t jq_journal_checksum( const void* data, size_t size ) {
+  const unsigned char* p = (const unsigned char*)data;
+  uint32_t hash = 2166136261u;
+  
+  while( size-- ) {
+    hash ^= *p++;
+    hash *= 16777619u;
+  }
+  
+  return hash;
+}
+
+/* Position in segment acknowledged offset points to. */
+static inline size_t jq_journal_acked_pos( uint64_t acked, jq_journal_segment* segment ) {
+  return acked > segment->base ? acked - segment->base : 0;
+}
+
+static inline uint64_t jq_journal_end( jq_journal* journal ) {
+  return journal->last ? journal->last->base + journal->pos : journal->acked;
+}
+
+static void jq_journal_path( jq_journal* journal, char* path, size_t size, uint64_t base ) {
+  snprintf( path, size, "%s/%016llx.jql", journal->dir, (unsigned long long)base );
+}
+
+/* Map segment file, creating it if size is not zero. */
+static jq_journal_segment* jq_journal_segment_map( jq_journal* journal, uint64_t base, size_t size ) {
+  char path[4096];
+  struct stat st;
+  jq_journal_segment* segment;
+  int fd;
+  
+  jq_journal_path( journal, path, sizeof(path), base );
+  
+  if( (fd = open( path, size ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600 )) < 0 )
+    return NULL;
+  
+  if( size ) {
+    if( ftruncate( fd, size ) != 0 )
+      goto fail;
+  }
+  else {
+    if( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof(jq_journal_record) )
+      goto fail;
+    
+    size = st.st_size;
+  }
+  
+  if( !(segment = (jq_journal_segment*)malloc( sizeof(jq_journal_segment) )) )
+    goto fail;
+  
+  segment->data = (char*)mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  
+  if( segment->data == MAP_FAILED ) {
+    free( segment );
+    return NULL;
+  }
+  
+  segment->base = base;
+  segment->size = size;
+  segment->pending = 0;
+  segment->next = NULL;
+  
+  return segment;
+  
+fail:
+  close( fd );
+  return NULL;
+}
+
+static void jq_journal_segment_unmap( jq_journal_segment* segment ) {
+  munmap( segment->data, segment->size );
+  free( segment );
+}
+
+static void jq_journal_segment_remove( jq_journal* journal, jq_journal_segment* segment ) {
+  char path[4096];
+  
+  jq_journal_path( journal, path, sizeof(path), segment->base );
+  jq_journal_segment_unmap( segment );
+  unlink( path );
+}
+
+/* Sync bytes [from, to) of segment. */
+static void jq_journal_segment_sync( jq_journal_segment* segment, size_t from, size_t to ) {
+  size_t page = (size_t)sysconf( _SC_PAGESIZE );
+  
+  from = from / page * page;
+  
+  if( to > from )
+    msync( segment->data + from, to - from, MS_SYNC );
+}
+
+static void jq_journal_store_acked( jq_journal* journal, uint64_t acked ) {
+  char path[4096];
+  int fd;
+  
+  snprintf( path, sizeof(path), "%s/ack", journal->dir );
+  
+  if( (fd = open( path, O_WRONLY | O_CREAT, 0600 )) < 0 )
+    return;
+  
+  if( pwrite( fd, &acked, sizeof(acked), 0 ) == sizeof(acked) )
+    fsync( fd );
+  
+  close( fd );
+}
+
+static uint64_t jq_journal_load_acked( jq_journal* journal ) {
+  char path[4096];
+  uint64_t acked = 0;
+  int fd;
+  
+  snprintf( path, sizeof(path), "%s/ack", journal->dir );
+  
+  if( (fd = open( path, O_RDONLY )) >= 0 ) {
+    if( pread( fd, &acked, sizeof(acked), 0 ) != sizeof(acked) )
+      acked = 0;
+    
+    close( fd );
+  }
+  
+  return acked;
+}
+
+/* Record visitor. Returns zero to stop scan. */
+typedef int (*jq_journal_visit_t)( jq_journal_segment*, jq_journal_record*, void* );
+
+/* Walk segment records. Returns position after the last valid record. */
+static size_t jq_journal_segment_scan(
+  jq_journal_segment* segment,
+  size_t pos,
+  jq_journal_visit_t proc,
+  void* arg )
+{
+  while( pos + sizeof(jq_journal_record) <= segment->size ) {
+    jq_journal_record* record = (jq_journal_record*)(segment->data + pos);
+    size_t next;
+    
+    if( !(record->flags & JQ_JOURNAL_RECORD_WRITTEN) )
+      break;
+    
+    next = pos + JQ_JOURNAL_RECORD_SIZE( record->size );
+    
+    if( next > segment->size )
+      break;
+    
+    if( record->checksum != jq_journal_checksum( record + 1, record->size ) )
+      break;
+    
+    if( proc && !proc( segment, record, arg ) )
+      break;
+    
+    pos = next;
+  }
+  
+  return pos;
+}
+
+static void jq_journal_proc( void* context ) {
+  jq_journal_entry* entry = (jq_journal_entry*)context;
+  jq_journal* journal = entry->journal;
+  
+  journal->handler( entry->record + 1, entry->record->size );
+  
+  /* Acknowledge. Flag reaches disk with the next sync. */
+  entry->record->flags |= JQ_JOURNAL_RECORD_ACKED;
+  jq_atomic_sub( &entry->segment->pending, 1 );
+  
+  /* Full barrier: either flusher sees the ack or idle flag is seen here. */
+  jq_atomic_add( &journal->acks, 1 );
+  
+  if( journal->idle ) {
+    pthread_mutex_lock( &journal->mutex );
+    pthread_cond_signal( &journal->flush_cond );
+    pthread_mutex_unlock( &journal->mutex );
+  }
+  
+  jq_fsa_free( &entry_allocator, entry );
+  jq_release( journal );
+}
+
+static int jq_journal_submit_record( jq_journal* journal, jq_journal_segment* segment, jq_journal_record* record ) {
+  jq_journal_entry* entry = (jq_journal_entry*)jq_fsa_alloc( &entry_allocator );
+  
+  if( !entry ) return 0;
+  
+  entry->journal = journal;
+  entry->segment = segment;
+  entry->record = record;
+  
+  jq_retain( journal );
+  jq_atomic_add( &segment->pending, 1 );
+  
+  if( !jq_queue_submit( journal->queue, NULL, jq_journal_proc, entry ) ) {
+    jq_atomic_sub( &segment->pending, 1 );
+    jq_release( journal );
+    jq_fsa_free( &entry_allocator, entry );
+    return 0;
+  }
+  
+  return 1;
+}
+
+static int jq_journal_replay_record( jq_journal_segment* segment, jq_journal_record* record, void* arg ) {
+  if( !(record->flags & JQ_JOURNAL_RECORD_ACKED) )
+    jq_journal_submit_record( (jq_journal*)arg, segment, record );
+  
+  return 1;
+}
+
+static int jq_journal_is_acked( jq_journal_segment* segment, jq_journal_record* record, void* arg ) {
+  (void)segment;
+  (void)arg;
+  return (record->flags & JQ_JOURNAL_RECORD_ACKED) != 0;
+}
+
+/* Start new active segment. Called with mutex locked. */
+static int jq_journal_rotate( jq_journal* journal ) {
+  jq_journal_segment* segment;
+  uint64_t base = jq_journal_end( journal );
+  
+  if( !(segment = jq_journal_segment_map( journal, base, journal->segment_size )) )
+    return 0;
+  
+  /* Sealed segment is synced entirely, so only active one is synced later. */
+  if( journal->last ) {
+    jq_journal_segment_sync( journal->last, 0, journal->pos );
+    journal->last->next = segment;
+  }
+  else {
+    journal->first = segment;
+  }
+  
+  journal->last = segment;
+  journal->pos = 0;
+  
+  return 1;
+}
+
+/*
+  Advance acknowledged offset and remove fully acknowledged sealed segments.
+  Called with mutex locked.
+*/
+static void jq_journal_collect( jq_journal* journal ) {
+  uint64_t acked = journal->acked;
+  jq_journal_segment* segment;
+  
+  while( (segment = journal->first) && segment != journal->last && segment->pending == 0 ) {
+    size_t end = jq_journal_segment_scan( segment,
+      jq_journal_acked_pos( acked, segment ), jq_journal_is_acked, NULL );
+    
+    /* Unacknowledged record not submitted (failed to allocate entry). */
+    if( jq_journal_segment_scan( segment, end, NULL, NULL ) != end )
+      break;
+    
+    acked = segment->next->base;
+    journal->first = segment->next;
+    jq_journal_store_acked( journal, acked );
+    jq_journal_segment_remove( journal, segment );
+  }
+  
+  if( segment ) {
+    acked = segment->base + jq_journal_segment_scan( segment,
+      jq_journal_acked_pos( acked, segment ), jq_journal_is_acked, NULL );
+  }
+  
+  if( acked != journal->acked ) {
+    journal->acked = acked;
+    jq_journal_store_acked( journal, acked );
+  }
+}
+
+/*
+  Nothing appended or acknowledged since the last sync. Called with mutex
+  locked; sets idle flag before checking acks, so acknowledging thread
+  either is counted or wakes flusher.
+*/
+static int jq_journal_is_idle( jq_journal* journal ) {
+  if( journal->flush_requested || journal->stopping || jq_journal_end( journal ) != journal->synced_end )
+    return 0;
+  
+  journal->idle = 1;
+  jq_atomic_barrier();
+  
+  if( journal->acks != journal->synced_acks ) {
+    journal->idle = 0;
+    return 0;
+  }
+  
+  return 1;
+}
+
+/* Group commit thread. */
+static void* jq_journal_flusher_main( void* arg ) {
+  jq_journal* journal = (jq_journal*)arg;
+  jq_journal_segment* segment;
+  struct timeval now;
+  struct timespec deadline;
+  uint64_t cycle;
+  size_t pos;
+  
+  pthread_mutex_lock( &journal->mutex );
+  
+  while( 1 ) {
+    if( jq_journal_is_idle( journal ) ) {
+      pthread_cond_wait( &journal->flush_cond, &journal->mutex );
+      journal->idle = 0;
+      continue;
+    }
+    
+    if( !journal->flush_requested && !journal->stopping ) {
+      gettimeofday( &now, NULL );
+      deadline.tv_sec = now.tv_sec;
+      deadline.tv_nsec = now.tv_usec * 1000 + JQ_JOURNAL_SYNC_MS * 1000000L;
+      
+      if( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      
+      pthread_cond_timedwait( &journal->flush_cond, &journal->mutex, &deadline );
+    }
+    
+    journal->flush_requested = 0;
+    cycle = ++journal->cycles_started;
+    
+    segment = journal->last;
+    pos = journal->pos;
+    
+    /* Acks counted by now have their flags set. */
+    journal->synced_end = jq_journal_end( journal );
+    journal->synced_acks = journal->acks;
+    
+    /*
+      Sync without lock so appends go on meanwhile. Only flusher removes
+      segments, so this one stays mapped. Whole written part is synced as
+      it also holds acknowledgment flags of older records.
+    */
+    pthread_mutex_unlock( &journal->mutex );
+    jq_journal_segment_sync( segment, 0, pos );
+    pthread_mutex_lock( &journal->mutex );
+    
+    jq_journal_collect( journal );
+    journal->cycles_done = cycle;
+    pthread_cond_broadcast( &journal->synced_cond );
+    
+    if( journal->stopping )
+      break;
+  }
+  
+  pthread_mutex_unlock( &journal->mutex );
+  
+  return NULL;
+}
+
+static void jq_journal_dealloc( jq_journal* journal ) {
+  while( journal->first ) {
+    jq_journal_segment* next = journal->first->next;
+    jq_journal_segment_unmap( journal->first );
+    journal->first = next;
+  }
+  
+  jq_release( journal->queue );
+  pthread_cond_destroy( &journal->synced_cond );
+  pthread_cond_destroy( &journal->flush_cond );
+  pthread_mutex_destroy( &journal->mutex );
+  free( journal->dir );
+  free( journal );
+}
+
+static void jq_journal_vtable_destroy( void* object ) {
+  jq_journal* journal = (jq_journal*)object;
+  
+  pthread_mutex_lock( &journal->mutex );
+  journal->stopping = 1;
+  pthread_cond_signal( &journal->flush_cond );
+  pthread_mutex_unlock( &journal->mutex );
+  
+  pthread_join( journal->flusher, NULL );
+  jq_journal_dealloc( journal );
+}
+
+static jq_object_vtable journal_vtable = {
+  jq_journal_vtable_destroy
+};
+
+static int jq_journal_compare_bases( const void* a, const void* b ) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Map existing segments and find append position. */
+static int jq_journal_recover( jq_journal* journal ) {
+  DIR* dir;
+  struct dirent* ent;
+  uint64_t* bases = NULL;
+  size_t count = 0, capacity = 0, i;
+  int res = 1;
+  
+  if( !(dir = opendir( journal->dir )) )
+    return 0;
+  
+  while( (ent = readdir( dir )) ) {
+    unsigned long long base;
+    char tail;
+    
+    if( sscanf( ent->d_name, "%16llx.jq%c", &base, &tail ) != 2 || tail != 'l' )
+      continue;
+    
+    if( count == capacity ) {
+      uint64_t* p = (uint64_t*)realloc( bases, (capacity = capacity ? capacity * 2 : 16) * sizeof(uint64_t) );
+      
+      if( !p ) {
+        res = 0;
+        break;
+      }
+      
+      bases = p;
+    }
+    
+    bases[count++] = base;
+  }
+  
+  closedir( dir );
+  
+  if( res && count )
+    qsort( bases, count, sizeof(uint64_t), jq_journal_compare_bases );
+  
+  for( i = 0; res && i < count; ++i ) {
+    jq_journal_segment* segment = jq_journal_segment_map( journal, bases[i], 0 );
+    
+    if( !segment ) {
+      res = 0;
+      break;
+    }
+    
+    /* Leftover of segment removal interrupted by crash. */
+    if( i + 1 < count && bases[i + 1] <= journal->acked ) {
+      jq_journal_segment_remove( journal, segment );
+      continue;
+    }
+    
+    if( journal->last )
+      journal->last->next = segment;
+    else
+      journal->first = segment;
+    
+    journal->last = segment;
+  }
+  
+  if( res && journal->last ) {
+    journal->pos = jq_journal_segment_scan( journal->last,
+      jq_journal_acked_pos( journal->acked, journal->last ), NULL, NULL );
+    
+    /* Clear torn record and garbage after it, so it isn't taken for a record. */
+    memset( journal->last->data + journal->pos, 0, journal->last->size - journal->pos );
+  }
+  
+  free( bases );
+  
+  return res;
+}
+
+/*
+  Submit unacknowledged records. Done once nothing can fail anymore:
+  replayed requests hold references to journal.
+*/
+static void jq_journal_replay( jq_journal* journal ) {
+  jq_journal_segment* segment;
+  
+  pthread_mutex_lock( &journal->mutex );
+  
+  for( segment = journal->first; segment; segment = segment->next ) {
+    jq_journal_segment_scan( segment,
+      jq_journal_acked_pos( journal->acked, segment ),
+      jq_journal_replay_record, journal );
+  }
+  
+  pthread_mutex_unlock( &journal->mutex );
+}
+
+/*-----------------------------------------------------------------------------
+  Public.
+-----------------------------------------------------------------------------*/
+
+jq_journal_t jq_journal_open(
+  const char* dir,
+  size_t segment_size,
+  jq_queue_t queue,
+  jq_journal_handler_t handler )
+{
+  jq_journal* journal = (jq_journal*)malloc( sizeof(jq_journal) );
+  
+  if( !journal ) return NULL;
+  
+  memset( journal, 0, sizeof(jq_journal) );
+  jq_object_init( &journal->object, &journal_vtable );
+  
+  if( mkdir( dir, 0700 ) != 0 && errno != EEXIST )
+    goto fail_alloc;
+  
+  if( !(journal->dir = strdup( dir )) )
+    goto fail_alloc;
+  
+  journal->segment_size = segment_size ? segment_size : JQ_JOURNAL_SEGMENT_SIZE;
+  journal->queue = queue;
+  journal->handler = handler;
+  jq_retain( queue );
+  
+  pthread_mutex_init( &journal->mutex, NULL );
+  pthread_cond_init( &journal->flush_cond, NULL );
+  pthread_cond_init( &journal->synced_cond, NULL );
+  
+  journal->acked = jq_journal_load_acked( journal );
+  
+  if( !jq_journal_recover( journal ) )
+    goto fail;
+  
+  if( !journal->last && !jq_journal_rotate( journal ) )
+    goto fail;
+  
+  if( pthread_create( &journal->flusher, NULL, jq_journal_flusher_main, journal ) != 0 )
+    goto fail;
+  
+  jq_journal_replay( journal );
+  
+  return journal;
+  
+fail:
+  jq_journal_dealloc( journal );
+  return NULL;
+  
+fail_alloc:
+  free( journal );
+  return NULL;
+}
+
+int jq_journal_submit( jq_journal_t journal, const void* data, size_t size ) {
+  jq_journal_segment* segment;
+  jq_journal_record* record;
+  size_t record_size = JQ_JOURNAL_RECORD_SIZE( size );
+  
+  /* Size is stored in 32 bits whatever segment size is. */
+  if( size > UINT32_MAX )
+    return 0;
+  
+  /* Record must fit into segment with room for end marker. */
+  if( record_size + sizeof(jq_journal_record) > journal->segment_size )
+    return 0;
+  
+  pthread_mutex_lock( &journal->mutex );
+  
+  if( journal->pos + record_size + sizeof(jq_journal_record) > journal->last->size ) {
+    if( !jq_journal_rotate( journal ) ) {
+      pthread_mutex_unlock( &journal->mutex );
+      return 0;
+    }
+  }
+  
+  segment = journal->last;
+  record = (jq_journal_record*)(segment->data + journal->pos);
+  
+  if( size )
+    memcpy( record + 1, data, size );
+  
+  record->size = (uint32_t)size;
+  record->checksum = jq_journal_checksum( data, size );
+  jq_atomic_barrier();
+  record->flags = JQ_JOURNAL_RECORD_WRITTEN;
+  
+  journal->pos += record_size;
+  
+  if( journal->idle )
+    pthread_cond_signal( &journal->flush_cond );
+  
+  pthread_mutex_unlock( &journal->mutex );
+  
+  return jq_journal_submit_record( journal, segment, record );
+}
+
+void jq_journal_flush( jq_journal_t journal ) {
+  uint64_t cycle;
+  
+  pthread_mutex_lock( &journal->mutex );
+  
+  /* Cycle started after this point syncs everything submitted before. */
+  cycle = journal->cycles_started + 1;
+  journal->flush_requested = 1;
+  pthread_cond_signal( &journal->flush_cond );
+  
+  while( journal->cycles_done < cycle )
+    pthread_cond_wait( &journal->synced_cond, &journal->mutex );
+  
+  pthread_mutex_unlock( &journal->mutex );
+}
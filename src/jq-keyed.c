@@ -0,0 +1,215 @@
+#include "jq-private.h"
+#include <stdlib.h>
+
+/*-----------------------------------------------------------------------------
+  Internals.
+  Keys are hashed onto fixed set of lanes, each one FIFO list of reqs. Lane
+  with reqs has exactly one runner req in worker's queue (or running), so
+  reqs of a lane run one at a time in submit order. Runner dispatches them
+  as worker does its own reqs: on runner's fiber, batched with following
+  reqs of lane, watched and counted in stats. It gives its thread back
+  after JQ_LANE_QUANTUM dispatches if any queue of worker has other work,
+  putting itself at the end of queue. Scheduled lane holds reference to
+  worker.
+-----------------------------------------------------------------------------*/
+
+#define JQ_LANE_QUANTUM 16
+
+typedef struct jq_lane jq_lane;
+
+struct jq_lane {
+  jq_lanes* lanes;
+  
+  /** Protects fields below. */
+  jq_lock_t lock;
+  
+  /** Pending reqs. */
+  jq_req* first;
+  jq_req* last;
+  
+  /** Runner req is queued or running. */
+  int scheduled;
+} __attribute__((aligned(JQ_CACHE_LINE)));
+
+struct jq_lanes {
+  jq_worker_t worker;
+  
+  jq_lane* lane;
+  
+  /** Number of lanes is 2^bits. */
+  unsigned bits;
+};
+
+static void jq_lane_dispose( void* storage );
+
+/* Queue runner of lane, which is scheduled already. */
+static void jq_lane_submit_runner( jq_lane* lane ) {
+  jq_req* req = jq_req_alloc( NULL, jq_lane_run, jq_lane_dispose );
+  
+  if( !req ) {
+    /* Run lane right here rather than leave it stuck. */
+    jq_lane_run( &lane );
+    return;
+  }
+  
+  *(jq_lane**)jq_req_get_storage( req ) = lane;
+  jq_queue_submit_req( jq_worker_get_queue( lane->lanes->worker ), req );
+}
+
+static jq_req* jq_lane_lockless_get( jq_lane* lane ) {
+  jq_req* req = lane->first;
+  
+  if( !(lane->first = req->next) )
+    lane->last = NULL;
+  
+  return req;
+}
+
+/* Take next req of lane, or unschedule it if there is none. */
+static jq_req* jq_lane_take( jq_lane* lane ) {
+  jq_req* req = NULL;
+  
+  jq_lock( &lane->lock );
+  
+  if( lane->first )
+    req = jq_lane_lockless_get( lane );
+  else
+    lane->scheduled = 0;
+  
+  jq_unlock( &lane->lock );
+  
+  return req;
+}
+
+/* Batch source: next req of lane if it has the same handler. */
+static jq_req* jq_lane_take_same( void* arg, jq_handler_t handler ) {
+  jq_lane* lane = (jq_lane*)arg;
+  jq_req* req = NULL;
+  
+  jq_lock( &lane->lock );
+  
+  if( lane->first && lane->first->handler == handler )
+    req = jq_lane_lockless_get( lane );
+  
+  jq_unlock( &lane->lock );
+  
+  return req;
+}
+
+/* Runner is discarded with worker's queue: so are reqs of its lane. */
+static void jq_lane_dispose( void* storage ) {
+  jq_lane* lane = *(jq_lane**)storage;
+  jq_req* req;
+  
+  while( (req = jq_lane_take( lane )) )
+    jq_req_discard( req );
+  
+  jq_release( lane->lanes->worker );
+}
+
+/*-----------------------------------------------------------------------------
+  Private.
+-----------------------------------------------------------------------------*/
+
+void jq_lane_run( void* storage ) {
+  jq_lane* lane = *(jq_lane**)storage;
+  jq_worker_t worker = lane->lanes->worker;
+  jq_queue_t queue = jq_worker_get_queue( worker );
+  jq_req_source source = { jq_lane_take_same, lane };
+  jq_req* req;
+  size_t done = 0;
+  
+  while( (req = jq_lane_take( lane )) ) {
+    jq_worker_execute( worker, queue, req, &source );
+    
+    /* Others have work: continue after them. */
+    if( ++done % JQ_LANE_QUANTUM == 0 && jq_worker_get_queued( worker ) > 0 ) {
+      jq_lock( &lane->lock );
+      
+      if( lane->first ) {
+        jq_unlock( &lane->lock );
+        jq_lane_submit_runner( lane );
+        return;
+      }
+      
+      lane->scheduled = 0;
+      jq_unlock( &lane->lock );
+      break;
+    }
+  }
+  
+  jq_release( worker );
+}
+
+jq_lanes* jq_lanes_create( jq_worker_t worker, size_t count ) {
+  jq_lanes* lanes = (jq_lanes*)malloc( sizeof(jq_lanes) );
+  size_t i;
+  
+  if( !lanes ) return NULL;
+  
+  lanes->worker = worker;
+  
+  for( lanes->bits = 0; ((size_t)1 << lanes->bits) < count; lanes->bits++ );
+  
+  if( posix_memalign( (void**)&lanes->lane, JQ_CACHE_LINE, sizeof(jq_lane) << lanes->bits ) != 0 ) {
+    free( lanes );
+    return NULL;
+  }
+  
+  for( i = 0; i < ((size_t)1 << lanes->bits); ++i ) {
+    jq_lane* lane = &lanes->lane[i];
+    
+    lane->lanes = lanes;
+    jq_lock_init( &lane->lock );
+    lane->first = NULL;
+    lane->last = NULL;
+    lane->scheduled = 0;
+  }
+  
+  return lanes;
+}
+
+/* Called when worker is deallocated: all lanes are idle by then. */
+void jq_lanes_destroy( jq_lanes* lanes ) {
+  size_t i;
+  
+  for( i = 0; i < ((size_t)1 << lanes->bits); ++i )
+    jq_lock_destroy( &lanes->lane[i].lock );
+  
+  free( lanes->lane );
+  free( lanes );
+}
+
+int jq_lanes_submit( jq_lanes* lanes, size_t key, jq_group_t group, jq_handler_t handler, void* context ) {
+  /* Fibonacci hashing spreads sequential keys over all lanes. */
+  uint64_t hash = (uint64_t)key * 11400714819323198485ULL;
+  jq_lane* lane = &lanes->lane[lanes->bits ? hash >> (64 - lanes->bits) : 0];
+  jq_req* req = jq_req_create( group, handler, context );
+  int schedule;
+  
+  if( !req ) return 0;
+  
+  req->next = NULL;
+  req->enqueued = jq_stats_enabled || jq_watchdog_enabled ? jq_stats_now() : 0;
+  
+  jq_lock( &lane->lock );
+  
+  if( lane->last )
+    lane->last->next = req;
+  else
+    lane->first = req;
+  
+  lane->last = req;
+  
+  schedule = !lane->scheduled;
+  lane->scheduled = 1;
+  
+  jq_unlock( &lane->lock );
+  
+  if( schedule ) {
+    jq_retain( lanes->worker );
+    jq_lane_submit_runner( lane );
+  }
+  
+  return 1;
+}
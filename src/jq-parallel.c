@@ -0,0 +1,543 @@
+#include "jq-private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/*-----------------------------------------------------------------------------
+  Internals.
+  Algorithms split arrays into chunks of about JQ_PARALLEL_CHUNK_BYTES, so
+  chunk being worked on stays in per-core cache. Chunks are claimed one by
+  one from shared counter by calling thread and by helper requests submitted
+  to worker, so idle threads pick up more chunks and calling thread doesn't
+  wait for busy ones to start. Job state lives on caller's stack; helper
+  starting after all chunks are claimed only touches heap allocated
+  counters.
+-----------------------------------------------------------------------------*/
+
+#define JQ_PARALLEL_CHUNK_BYTES (256 * 1024)
+#define JQ_PARALLEL_MAX_CHUNKS 4096
+
+typedef void (*jq_chunk_t)( void* job, size_t chunk );
+
+typedef struct jq_par jq_par;
+
+struct jq_par {
+  jq_chunk_t body;
+  void* job;
+  size_t chunks;
+  
+  /** Next chunk to claim. */
+  volatile size_t next;
+  
+  /** Chunks done. Futex word. */
+  volatile int done;
+  
+  /** Caller and helpers not yet finished. */
+  volatile size_t refs;
+};
+
+static void jq_par_release( jq_par* par ) {
+  if( jq_atomic_sub( &par->refs, 1 ) == 1 )
+    free( par );
+}
+
+static void jq_par_work( jq_par* par ) {
+  size_t chunk;
+  
+  while( (chunk = jq_atomic_add( &par->next, 1 )) < par->chunks ) {
+    par->body( par->job, chunk );
+    
+    if( (size_t)jq_atomic_add( &par->done, 1 ) + 1 == par->chunks )
+      jq_futex_wake( &par->done, 1 );
+  }
+}
+
+static void jq_par_helper( void* context ) {
+  jq_par* par = (jq_par*)context;
+  
+  jq_par_work( par );
+  jq_par_release( par );
+}
+
+static int jq_par_wait( void* object, int timeout_ms ) {
+  jq_par* par = (jq_par*)object;
+  int done = par->done;
+  
+  if( (size_t)done == par->chunks ) return 1;
+  
+  if( timeout_ms != 0 )
+    jq_futex_wait( &par->done, done, timeout_ms );
+  
+  return (size_t)par->done == par->chunks;
+}
+
+static void jq_par_wake( void* object ) {
+  jq_futex_wake( &((jq_par*)object)->done, INT_MAX );
+}
+
+/* Run body for every chunk on worker threads and calling thread. */
+static void jq_par_run( jq_worker_t worker, jq_chunk_t body, void* job, size_t chunks ) {
+  jq_queue_t queue = jq_worker_get_queue( worker );
+  size_t helpers = jq_worker_get_threads( worker ), i;
+  jq_par* par;
+  
+  if( helpers > chunks - 1 )
+    helpers = chunks - 1;
+  
+  if( !helpers || !(par = (jq_par*)malloc( sizeof(jq_par) )) ) {
+    for( i = 0; i < chunks; ++i )
+      body( job, i );
+    
+    return;
+  }
+  
+  par->body = body;
+  par->job = job;
+  par->chunks = chunks;
+  par->next = 0;
+  par->done = 0;
+  par->refs = helpers + 1;
+  
+  for( i = 0; i < helpers; ++i ) {
+    if( !jq_queue_submit( queue, NULL, jq_par_helper, par ) )
+      jq_par_release( par );
+  }
+  
+  jq_par_work( par );
+  
+  /* Worker thread runs other reqs meanwhile, others sleep. */
+  if( !jq_worker_help( jq_par_wait, jq_par_wake, par ) ) {
+    while( !jq_par_wait( par, -1 ) );
+  }
+  
+  jq_par_release( par );
+}
+
+/* Array of count items of size bytes can be addressed. */
+static int jq_par_valid( size_t count, size_t size ) {
+  return size > 0 && count <= SIZE_MAX / size;
+}
+
+/* Items per chunk: about cache sized, but not too many chunks. */
+static size_t jq_par_chunk_items( size_t count, size_t size ) {
+  size_t items = JQ_PARALLEL_CHUNK_BYTES / size;
+  
+  if( items < 1 ) items = 1;
+  
+  if( items < (count + JQ_PARALLEL_MAX_CHUNKS - 1) / JQ_PARALLEL_MAX_CHUNKS )
+    items = (count + JQ_PARALLEL_MAX_CHUNKS - 1) / JQ_PARALLEL_MAX_CHUNKS;
+  
+  return items;
+}
+
+#define ITEM( base, i, size ) ((char*)(base) + (i) * (size))
+
+/*-----------------------------------------------------------------------------
+  Sort.
+  Chunks are sorted by qsort, then sorted runs are merged pairwise in
+  rounds, ping-ponging between array and buffer. Every output chunk of
+  round is merged independently: its start in both runs is found by binary
+  search along merge path, so the last rounds are as parallel as the first.
+-----------------------------------------------------------------------------*/
+
+typedef struct {
+  char* src;
+  char* dst;
+  size_t count;
+  size_t size;
+  size_t chunk;
+  size_t width;
+  jq_compare_t compare;
+} jq_sort_job;
+
+static void jq_sort_chunk( void* ptr, size_t chunk ) {
+  jq_sort_job* job = (jq_sort_job*)ptr;
+  size_t start = chunk * job->chunk;
+  size_t count = job->count - start < job->chunk ? job->count - start : job->chunk;
+  
+  qsort( ITEM( job->src, start, job->size ), count, job->size, job->compare );
+}
+
+/*
+  Number of items taken from a when k items of stable merge of a and b
+  are output: equal items of a go first.
+*/
+static size_t jq_sort_corank( jq_sort_job* job, size_t k, const char* a, size_t m, const char* b, size_t n ) {
+  size_t lo = k > n ? k - n : 0;
+  size_t hi = k < m ? k : m;
+  
+  while( lo < hi ) {
+    size_t i = lo + (hi - lo) / 2;
+    size_t j = k - i;
+    
+    if( j > 0 && job->compare( ITEM( a, i, job->size ), ITEM( b, j - 1, job->size ) ) <= 0 )
+      lo = i + 1;
+    else
+      hi = i;
+  }
+  
+  return lo;
+}
+
+static void jq_sort_merge_chunk( void* ptr, size_t chunk ) {
+  jq_sort_job* job = (jq_sort_job*)ptr;
+  size_t size = job->size;
+  size_t start = chunk * job->chunk;
+  size_t end = job->count - start < job->chunk ? job->count : start + job->chunk;
+  size_t pair = start / (2 * job->width) * (2 * job->width);
+  const char* a = ITEM( job->src, pair, size );
+  size_t m = job->count - pair < job->width ? job->count - pair : job->width;
+  const char* b = a + m * size;
+  size_t n = job->count - pair - m < job->width ? job->count - pair - m : job->width;
+  size_t i = jq_sort_corank( job, start - pair, a, m, b, n );
+  size_t j = start - pair - i;
+  size_t i_end = jq_sort_corank( job, end - pair, a, m, b, n );
+  size_t j_end = end - pair - i_end;
+  char* out = ITEM( job->dst, start, size );
+  
+  while( i < i_end && j < j_end ) {
+    if( job->compare( ITEM( a, i, size ), ITEM( b, j, size ) ) <= 0 )
+      memcpy( out, ITEM( a, i++, size ), size );
+    else
+      memcpy( out, ITEM( b, j++, size ), size );
+    
+    out += size;
+  }
+  
+  memcpy( out, ITEM( a, i, size ), (i_end - i) * size );
+  out += (i_end - i) * size;
+  memcpy( out, ITEM( b, j, size ), (j_end - j) * size );
+}
+
+static void jq_sort_copy_chunk( void* ptr, size_t chunk ) {
+  jq_sort_job* job = (jq_sort_job*)ptr;
+  size_t start = chunk * job->chunk;
+  size_t count = job->count - start < job->chunk ? job->count - start : job->chunk;
+  
+  memcpy( ITEM( job->dst, start, job->size ), ITEM( job->src, start, job->size ), count * job->size );
+}
+
+/*-----------------------------------------------------------------------------
+  Scan.
+  Each chunk is reduced to its total, totals are scanned serially, then
+  each chunk is scanned starting with total of chunks before it.
+-----------------------------------------------------------------------------*/
+
+typedef struct {
+  const char* in;
+  char* out;
+  size_t count;
+  size_t size;
+  size_t chunk;
+  jq_combine_t combine;
+  void* arg;
+  
+  /** Initial value of exclusive scan, NULL for inclusive one. */
+  const void* init;
+  
+  /** Per chunk: total, then offset; accumulator; copy of input item. */
+  char* totals;
+  char* acc;
+  char* item;
+} jq_scan_job;
+
+static void jq_scan_reduce_chunk( void* ptr, size_t chunk ) {
+  jq_scan_job* job = (jq_scan_job*)ptr;
+  size_t start = chunk * job->chunk;
+  size_t end = job->count - start < job->chunk ? job->count : start + job->chunk;
+  char* total = ITEM( job->totals, chunk, job->size );
+  size_t i;
+  
+  memcpy( total, ITEM( job->in, start, job->size ), job->size );
+  
+  for( i = start + 1; i < end; ++i )
+    job->combine( job->arg, total, total, ITEM( job->in, i, job->size ) );
+}
+
+/* Scan chunk, starting from offset if not NULL. */
+static void jq_scan_chunk_from( jq_scan_job* job, size_t chunk, const void* offset ) {
+  size_t size = job->size;
+  size_t start = chunk * job->chunk;
+  size_t end = job->count - start < job->chunk ? job->count : start + job->chunk;
+  char* acc = ITEM( job->acc, chunk, size );
+  char* item = ITEM( job->item, chunk, size );
+  size_t i = start;
+  
+  if( offset ) {
+    memcpy( acc, offset, size );
+  }
+  else {
+    memcpy( acc, ITEM( job->in, i, size ), size );
+    memcpy( ITEM( job->out, i, size ), acc, size );
+    i++;
+  }
+  
+  for( ; i < end; ++i ) {
+    /* Output may be the input. */
+    memcpy( item, ITEM( job->in, i, size ), size );
+    
+    if( job->init ) {
+      memcpy( ITEM( job->out, i, size ), acc, size );
+      job->combine( job->arg, acc, acc, item );
+    }
+    else {
+      job->combine( job->arg, acc, acc, item );
+      memcpy( ITEM( job->out, i, size ), acc, size );
+    }
+  }
+}
+
+static void jq_scan_chunk( void* ptr, size_t chunk ) {
+  jq_scan_job* job = (jq_scan_job*)ptr;
+  
+  jq_scan_chunk_from( job, chunk, chunk || job->init ? ITEM( job->totals, chunk, job->size ) : NULL );
+}
+
+static int jq_scan( jq_worker_t worker, const void* in, void* out, size_t count, size_t size,
+  jq_combine_t combine, void* arg, const void* init )
+{
+  jq_scan_job job;
+  size_t chunks, i;
+  char* prev;
+  
+  if( !jq_par_valid( count, size ) ) return 0;
+  if( !count ) return 1;
+  
+  job.in = (const char*)in;
+  job.out = (char*)out;
+  job.count = count;
+  job.size = size;
+  job.chunk = jq_par_chunk_items( count, size );
+  job.combine = combine;
+  job.arg = arg;
+  job.init = init;
+  
+  chunks = (count + job.chunk - 1) / job.chunk;
+  
+  if( chunks > SIZE_MAX / 3 / size ) return 0;
+  
+  if( !(job.totals = (char*)malloc( 3 * chunks * size )) )
+    return 0;
+  
+  job.acc = job.totals + chunks * size;
+  job.item = job.acc + chunks * size;
+  
+  /* Single chunk needs no total. */
+  if( chunks == 1 ) {
+    if( init )
+      memcpy( job.totals, init, size );
+    
+    jq_scan_chunk( &job, 0 );
+    free( job.totals );
+    return 1;
+  }
+  
+  jq_par_run( worker, jq_scan_reduce_chunk, &job, chunks );
+  
+  /* Turn totals into offsets: offset of chunk is total of ones before. */
+  prev = job.item;
+  
+  if( init )
+    memcpy( prev, init, size );
+  
+  for( i = 0; i < chunks; ++i ) {
+    char* total = ITEM( job.totals, i, size );
+    
+    memcpy( job.acc, total, size );
+    
+    if( init || i > 0 )
+      memcpy( total, prev, size );
+    
+    if( i == 0 && !init )
+      memcpy( prev, job.acc, size );
+    else
+      combine( arg, prev, prev, job.acc );
+  }
+  
+  jq_par_run( worker, jq_scan_chunk, &job, chunks );
+  
+  free( job.totals );
+  return 1;
+}
+
+/*-----------------------------------------------------------------------------
+  Partition.
+  Each chunk marks and counts its selected items, counts are scanned
+  serially into chunk's destinations, then each chunk moves its items to
+  buffer and back.
+-----------------------------------------------------------------------------*/
+
+typedef struct {
+  char* base;
+  char* buffer;
+  unsigned char* flags;
+  size_t count;
+  size_t size;
+  size_t chunk;
+  jq_predicate_t predicate;
+  void* arg;
+  
+  /** Per chunk: selected items, then destinations of selected and other ones. */
+  size_t* selected;
+  size_t* first_selected;
+  size_t* first_other;
+} jq_partition_job;
+
+static void jq_partition_mark_chunk( void* ptr, size_t chunk ) {
+  jq_partition_job* job = (jq_partition_job*)ptr;
+  size_t start = chunk * job->chunk;
+  size_t end = job->count - start < job->chunk ? job->count : start + job->chunk;
+  size_t i, selected = 0;
+  
+  for( i = start; i < end; ++i ) {
+    job->flags[i] = job->predicate( job->arg, ITEM( job->base, i, job->size ) ) != 0;
+    selected += job->flags[i];
+  }
+  
+  job->selected[chunk] = selected;
+}
+
+static void jq_partition_move_chunk( void* ptr, size_t chunk ) {
+  jq_partition_job* job = (jq_partition_job*)ptr;
+  size_t start = chunk * job->chunk;
+  size_t end = job->count - start < job->chunk ? job->count : start + job->chunk;
+  size_t selected = job->first_selected[chunk];
+  size_t other = job->first_other[chunk];
+  size_t i;
+  
+  for( i = start; i < end; ++i ) {
+    memcpy( ITEM( job->buffer, job->flags[i] ? selected++ : other++, job->size ),
+      ITEM( job->base, i, job->size ), job->size );
+  }
+}
+
+static void jq_partition_copy_chunk( void* ptr, size_t chunk ) {
+  jq_partition_job* job = (jq_partition_job*)ptr;
+  size_t start = chunk * job->chunk;
+  size_t count = job->count - start < job->chunk ? job->count - start : job->chunk;
+  
+  memcpy( ITEM( job->base, start, job->size ), ITEM( job->buffer, start, job->size ), count * job->size );
+}
+
+/*-----------------------------------------------------------------------------
+  Public.
+-----------------------------------------------------------------------------*/
+
+int jq_parallel_sort( jq_worker_t worker, void* base, size_t count, size_t size, jq_compare_t compare ) {
+  jq_sort_job job;
+  char* buffer;
+  char* tmp;
+  size_t chunks;
+  
+  if( !jq_par_valid( count, size ) ) return 0;
+  
+  job.src = (char*)base;
+  job.count = count;
+  job.size = size;
+  job.chunk = jq_par_chunk_items( count, size );
+  job.compare = compare;
+  
+  if( count <= job.chunk ) {
+    qsort( base, count, size, compare );
+    return 1;
+  }
+  
+  if( !(buffer = (char*)malloc( count * size )) )
+    return 0;
+  
+  chunks = (count + job.chunk - 1) / job.chunk;
+  jq_par_run( worker, jq_sort_chunk, &job, chunks );
+  
+  job.dst = buffer;
+  
+  for( job.width = job.chunk; job.width < count; job.width *= 2 ) {
+    jq_par_run( worker, jq_sort_merge_chunk, &job, chunks );
+    
+    tmp = job.src;
+    job.src = job.dst;
+    job.dst = tmp;
+  }
+  
+  if( job.src != (char*)base ) {
+    job.dst = (char*)base;
+    jq_par_run( worker, jq_sort_copy_chunk, &job, chunks );
+  }
+  
+  free( buffer );
+  return 1;
+}
+
+int jq_parallel_inclusive_scan( jq_worker_t worker, const void* in, void* out, size_t count, size_t size,
+  jq_combine_t combine, void* arg )
+{
+  return jq_scan( worker, in, out, count, size, combine, arg, NULL );
+}
+
+int jq_parallel_exclusive_scan( jq_worker_t worker, const void* in, void* out, size_t count, size_t size,
+  jq_combine_t combine, void* arg, const void* init )
+{
+  /* It would be inclusive one. */
+  if( !init ) return 0;
+  
+  return jq_scan( worker, in, out, count, size, combine, arg, init );
+}
+
+int jq_parallel_partition( jq_worker_t worker, void* base, size_t count, size_t size,
+  jq_predicate_t predicate, void* arg, size_t* selected )
+{
+  jq_partition_job job;
+  size_t chunks, i, total = 0, first = 0, other;
+  
+  *selected = 0;
+  
+  if( !jq_par_valid( count, size ) ) return 0;
+  if( !count ) return 1;
+  
+  job.base = (char*)base;
+  job.count = count;
+  job.size = size;
+  job.chunk = jq_par_chunk_items( count, size );
+  job.predicate = predicate;
+  job.arg = arg;
+  
+  chunks = (count + job.chunk - 1) / job.chunk;
+  
+  job.buffer = (char*)malloc( count * size );
+  job.flags = (unsigned char*)malloc( count );
+  job.selected = (size_t*)malloc( 3 * chunks * sizeof(size_t) );
+  
+  if( !job.buffer || !job.flags || !job.selected ) {
+    free( job.buffer );
+    free( job.flags );
+    free( job.selected );
+    return 0;
+  }
+  
+  job.first_selected = job.selected + chunks;
+  job.first_other = job.first_selected + chunks;
+  
+  jq_par_run( worker, jq_partition_mark_chunk, &job, chunks );
+  
+  for( i = 0; i < chunks; ++i )
+    total += job.selected[i];
+  
+  /* Selected items go first, others after them, both in original order. */
+  for( i = 0, other = total; i < chunks; ++i ) {
+    size_t items = i + 1 < chunks ? job.chunk : count - i * job.chunk;
+    
+    job.first_selected[i] = first;
+    job.first_other[i] = other;
+    first += job.selected[i];
+    other += items - job.selected[i];
+  }
+  
+  jq_par_run( worker, jq_partition_move_chunk, &job, chunks );
+  jq_par_run( worker, jq_partition_copy_chunk, &job, chunks );
+  
+  free( job.buffer );
+  free( job.flags );
+  free( job.selected );
+  
+  *selected = total;
+  return 1;
+}
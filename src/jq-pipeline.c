@@ -0,0 +1,297 @@
+#include "jq-private.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*-----------------------------------------------------------------------------
+  Internals.
+  Each pushed item is carried by token through all stages by one request,
+  so item stays on the same thread while it can. Token which finds serial
+  stage busy (or not its turn, for in-order stage) is parked in stage's
+  pending list; thread leaving stage hands it over to next ready token and
+  submits that token to worker, then goes on with its own.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_pipeline jq_pipeline;
+typedef struct jq_stage jq_stage;
+typedef struct jq_token jq_token;
+
+struct jq_token {
+  jq_pipeline* pipeline;
+  
+  /** Next token in stage's pending list. */
+  jq_token* next;
+  
+  /** Item, NULL once some stage dropped it. */
+  void* item;
+  
+  /** Order of push, for in-order stages. */
+  size_t seq;
+  
+  /** Index of stage to run. */
+  size_t stage;
+  
+  /** Serial stage was handed over to this token. */
+  int owns_stage;
+};
+
+struct jq_stage {
+  int mode;
+  jq_stage_t handler;
+  void* arg;
+  
+  /** Protects fields below. */
+  jq_lock_t lock;
+  
+  /** Some token runs serial stage. */
+  int busy;
+  
+  /** Seq of next token to run in-order stage. */
+  size_t next_seq;
+  
+  /** Tokens waiting for serial stage, sorted by seq for in-order one. */
+  jq_token* pending;
+};
+
+struct jq_pipeline {
+  jq_object object;
+  
+  jq_worker_t worker;
+  
+  jq_stage* stages;
+  size_t count;
+  
+  /** Free tokens, limits items in flight. */
+  jq_semaphore_t tokens;
+  
+  /** Tokens in flight. */
+  jq_group_t group;
+  
+  volatile size_t last_seq;
+};
+
+static jq_fsa token_allocator = JQ_FSA_INITIALIZER( sizeof(jq_token), 64 );
+
+static void jq_pipeline_run( void* context );
+
+/* Put token to pending list of serial stage. Called with stage lock held. */
+static void jq_stage_lockless_park( jq_stage* stage, jq_token* token ) {
+  jq_token** p = &stage->pending;
+  
+  if( stage->mode == JQ_STAGE_SERIAL_IN_ORDER ) {
+    while( *p && (*p)->seq < token->seq )
+      p = &(*p)->next;
+  }
+  else {
+    while( *p )
+      p = &(*p)->next;
+  }
+  
+  token->next = *p;
+  *p = token;
+}
+
+/* Take token which may run stage next. Called with stage lock held. */
+static jq_token* jq_stage_lockless_next( jq_stage* stage ) {
+  jq_token* token = stage->pending;
+  
+  if( !token ) return NULL;
+  
+  if( stage->mode == JQ_STAGE_SERIAL_IN_ORDER && token->seq != stage->next_seq )
+    return NULL;
+  
+  stage->pending = token->next;
+  return token;
+}
+
+/* Enter serial stage. Returns 0 if token was parked. */
+static int jq_stage_enter( jq_stage* stage, jq_token* token ) {
+  int entered = 0;
+  
+  if( token->owns_stage ) {
+    token->owns_stage = 0;
+    return 1;
+  }
+  
+  jq_lock( &stage->lock );
+  
+  if( stage->busy
+    || (stage->mode == JQ_STAGE_SERIAL_IN_ORDER && token->seq != stage->next_seq) )
+  {
+    jq_stage_lockless_park( stage, token );
+  }
+  else {
+    stage->busy = 1;
+    entered = 1;
+  }
+  
+  jq_unlock( &stage->lock );
+  
+  return entered;
+}
+
+/* Leave serial stage and hand it over to the next ready token if any. */
+static void jq_stage_leave( jq_pipeline* pipeline, jq_stage* stage ) {
+  jq_token* next;
+  
+  jq_lock( &stage->lock );
+  
+  if( stage->mode == JQ_STAGE_SERIAL_IN_ORDER )
+    stage->next_seq++;
+  
+  if( !(next = jq_stage_lockless_next( stage )) )
+    stage->busy = 0;
+  
+  jq_unlock( &stage->lock );
+  
+  if( next ) {
+    next->owns_stage = 1;
+    
+    if( !jq_queue_submit( jq_worker_get_queue( pipeline->worker ), NULL, jq_pipeline_run, next ) )
+      jq_pipeline_run( next );
+  }
+}
+
+static void jq_token_finish( jq_token* token ) {
+  jq_pipeline* pipeline = token->pipeline;
+  
+  jq_fsa_free( &token_allocator, token );
+  
+  jq_semaphore_post( pipeline->tokens, 1 );
+  jq_group_leave( pipeline->group );
+  jq_release( pipeline );
+}
+
+/* Carry token through stages until it is parked or done. */
+static void jq_pipeline_run( void* context ) {
+  jq_token* token = (jq_token*)context;
+  jq_pipeline* pipeline = token->pipeline;
+  
+  while( token->stage < pipeline->count ) {
+    jq_stage* stage = &pipeline->stages[token->stage];
+    
+    /* Dropped item still passes in-order stages to keep their turn. */
+    if( stage->mode == JQ_STAGE_PARALLEL
+      || (!token->item && stage->mode == JQ_STAGE_SERIAL_OUT_OF_ORDER) )
+    {
+      if( token->item )
+        token->item = stage->handler( stage->arg, token->item );
+    }
+    else {
+      if( !jq_stage_enter( stage, token ) )
+        return;
+      
+      if( token->item )
+        token->item = stage->handler( stage->arg, token->item );
+      
+      jq_stage_leave( pipeline, stage );
+    }
+    
+    token->stage++;
+  }
+  
+  jq_token_finish( token );
+}
+
+static void jq_pipeline_vtable_destroy( void* object ) {
+  jq_pipeline* pipeline = (jq_pipeline*)object;
+  size_t i;
+  
+  for( i = 0; i < pipeline->count; ++i )
+    jq_lock_destroy( &pipeline->stages[i].lock );
+  
+  free( pipeline->stages );
+  jq_release( pipeline->tokens );
+  jq_release( pipeline->group );
+  jq_release( pipeline->worker );
+  free( pipeline );
+}
+
+static jq_object_vtable pipeline_vtable = {
+  jq_pipeline_vtable_destroy
+};
+
+/*-----------------------------------------------------------------------------
+  Public.
+-----------------------------------------------------------------------------*/
+
+jq_pipeline_t jq_pipeline_create( jq_worker_t worker, size_t max_tokens ) {
+  jq_pipeline* pipeline;
+  
+  if( !worker || max_tokens < 1 ) return NULL;
+  
+  if( !(pipeline = (jq_pipeline*)calloc( 1, sizeof(jq_pipeline) )) )
+    return NULL;
+  
+  jq_object_init( &pipeline->object, &pipeline_vtable );
+  
+  pipeline->tokens = jq_semaphore_create( (int)max_tokens );
+  pipeline->group = jq_group_create();
+  
+  if( !pipeline->tokens || !pipeline->group ) {
+    jq_release( pipeline->tokens );
+    jq_release( pipeline->group );
+    free( pipeline );
+    return NULL;
+  }
+  
+  jq_retain( worker );
+  pipeline->worker = worker;
+  
+  return pipeline;
+}
+
+int jq_pipeline_add_stage( jq_pipeline_t pipeline, int mode, jq_stage_t handler, void* arg ) {
+  jq_stage* stages;
+  jq_stage* stage;
+  
+  /* Stages are read without lock by running tokens. */
+  if( pipeline->last_seq ) return 0;
+  
+  if( !(stages = (jq_stage*)realloc( pipeline->stages, (pipeline->count + 1) * sizeof(jq_stage) )) )
+    return 0;
+  
+  pipeline->stages = stages;
+  
+  stage = &stages[pipeline->count++];
+  memset( stage, 0, sizeof(*stage) );
+  stage->mode = mode;
+  stage->handler = handler;
+  stage->arg = arg;
+  jq_lock_init( &stage->lock );
+  
+  return 1;
+}
+
+int jq_pipeline_push( jq_pipeline_t pipeline, void* item ) {
+  jq_token* token;
+  
+  jq_semaphore_wait( pipeline->tokens );
+  
+  if( !(token = (jq_token*)jq_fsa_alloc( &token_allocator )) ) {
+    jq_semaphore_post( pipeline->tokens, 1 );
+    return 0;
+  }
+  
+  jq_retain( pipeline );
+  jq_group_enter( pipeline->group );
+  
+  token->pipeline = pipeline;
+  token->next = NULL;
+  token->item = item;
+  token->seq = jq_atomic_add( &pipeline->last_seq, 1 );
+  token->stage = 0;
+  token->owns_stage = 0;
+  
+  if( !jq_queue_submit( jq_worker_get_queue( pipeline->worker ), NULL, jq_pipeline_run, token ) ) {
+    /* Token still holds its turn in in-order stages. */
+    token->item = NULL;
+    jq_pipeline_run( token );
+    return 0;
+  }
+  
+  return 1;
+}
+
+void jq_pipeline_wait( jq_pipeline_t pipeline ) {
+  jq_group_wait( pipeline->group );
+}
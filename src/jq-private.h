@@ -3,23 +3,132 @@
 
 #include "jq.h"
 #include <pthread.h>
+#include <stdint.h>
+#include <string.h>
 
 /*-----------------------------------------------------------------------------
-  pthread_spinlock emulation if platform don't support it.
+  Atomic.
 -----------------------------------------------------------------------------*/
 
-#if !defined(PTHREAD_SPINLOCK_INITIALIZER)
-#define JQ_PTHREAD_SPINLOCK_EMULATED
+#if defined(__GNUC__) && (__GNUC__ >= 4)
 
-typedef volatile int pthread_spinlock_t;
+  #define jq_atomic_cas( v, old, new ) \
+    __sync_val_compare_and_swap( (v), (old), (new) )
+  
+  #define jq_atomic_add( v, value ) \
+    __sync_fetch_and_add( (v), (value) )
+  
+  #define jq_atomic_sub( v, value ) \
+    __sync_fetch_and_sub( (v), (value) )
+  
+  #define jq_atomic_barrier() \
+    __sync_synchronize()
+  
+  #if defined(__i386__) || defined(__x86_64__)
+    #define jq_cpu_relax() __builtin_ia32_pause()
+  #elif defined(__aarch64__) || defined(__arm__)
+    #define jq_cpu_relax() __asm__ __volatile__( "yield" ::: "memory" )
+  #else
+    #define jq_cpu_relax() __asm__ __volatile__( "" ::: "memory" )
+  #endif
+  
+  #define JQ_THREAD_LOCAL __thread
 
-int pthread_spin_init( pthread_spinlock_t* lock, int pshared );
-int pthread_spin_destroy( pthread_spinlock_t* lock );
-int pthread_spin_lock( pthread_spinlock_t* lock );
-int pthread_spin_trylock( pthread_spinlock_t* lock );
-int pthread_spin_unlock( pthread_spinlock_t* lock );
+/*
+#elif defined(_MSC_VER)
 
-#define PTHREAD_SPINLOCK_INITIALIZER 0
+#include <intrin.h>
+#define jq_atomic_cas( v, old, new ) \
+  _InterlockedCompareExchange( (v), (new), (old) )
+*/
+
+#else
+
+#error "Unsupported compiler"
+
+#endif
+
+/*-----------------------------------------------------------------------------
+  Lock.
+  Spin lock for short internal critical sections. By default it's
+  test-and-test-and-set lock: waiters spin reading the lock word, so it
+  stays shared in their caches, and try to take it only when it looks
+  free, backing off exponentially after each failed try. Waiter yields CPU
+  when backoff is at its maximum, as holder is then likely preempted.
+  Built with JQ_LOCK_TICKET it's ticket lock instead: threads get lock in
+  arrival order, but each hand-off waits for the next thread in line to
+  run, which is slow when there are more threads than cores.
+-----------------------------------------------------------------------------*/
+
+#if defined(JQ_LOCK_TICKET)
+
+typedef struct jq_lock {
+  volatile unsigned next;
+  volatile unsigned owner;
+} jq_lock_t;
+
+#else
+
+typedef struct jq_lock {
+  volatile int locked;
+} jq_lock_t;
+
+#endif
+
+#define JQ_LOCK_INITIALIZER { 0 }
+
+/** Pauses between tries (per waiter ahead for ticket lock), initial and max. */
+#define JQ_LOCK_MIN_BACKOFF 4
+#define JQ_LOCK_MAX_BACKOFF 1024
+
+/** Tries at max backoff before yielding CPU. */
+#define JQ_LOCK_MAX_TRIES 4
+
+void jq_lock_wait( jq_lock_t* lock, unsigned ticket );
+
+static inline void jq_lock_init( jq_lock_t* lock ) {
+  memset( lock, 0, sizeof(*lock) );
+}
+
+static inline void jq_lock_destroy( jq_lock_t* lock ) {
+  (void)lock;
+}
+
+#if defined(JQ_LOCK_TICKET)
+
+static inline void jq_lock( jq_lock_t* lock ) {
+  unsigned ticket = jq_atomic_add( &lock->next, 1 );
+  
+  if( lock->owner != ticket )
+    jq_lock_wait( lock, ticket );
+}
+
+/** Returns non-zero if lock was taken. */
+static inline int jq_trylock( jq_lock_t* lock ) {
+  unsigned owner = lock->owner;
+  return lock->next == owner && jq_atomic_cas( &lock->next, owner, owner + 1 ) == owner;
+}
+
+static inline void jq_unlock( jq_lock_t* lock ) {
+  jq_atomic_barrier();
+  lock->owner = lock->owner + 1;
+}
+
+#else
+
+static inline int jq_trylock( jq_lock_t* lock ) {
+  return !lock->locked && jq_atomic_cas( &lock->locked, 0, 1 ) == 0;
+}
+
+static inline void jq_lock( jq_lock_t* lock ) {
+  if( !jq_trylock( lock ) )
+    jq_lock_wait( lock, 0 );
+}
+
+static inline void jq_unlock( jq_lock_t* lock ) {
+  jq_atomic_barrier();
+  lock->locked = 0;
+}
 
 #endif
 
@@ -29,6 +138,7 @@ int pthread_spin_unlock( pthread_spinlock_t* lock );
 
 typedef struct jq_object_vtable jq_object_vtable;
 typedef struct jq_object jq_object;
+typedef struct jq_object_owner jq_object_owner;
 
 struct jq_object_vtable {
   void (*destroy)( void* );
@@ -37,81 +147,438 @@ struct jq_object_vtable {
 struct jq_object {
   int magic;
   jq_object_vtable* vtable;
-  size_t refs;
+  
+  /**
+    Shared reference count. While object is biased it holds
+    JQ_OBJECT_BIAS plus count of references taken by other threads
+    minus released by them (may go below the bias).
+  */
+  volatile size_t refs;
+  
+  /** References counted by owner thread without atomics. */
+  size_t biased;
+  
+  /** Owner thread of biased object, NULL if object isn't biased. */
+  jq_object_owner* owner;
+  
+  /** Next object in owner's merge queue. */
+  jq_object* queued_next;
 };
 
 void jq_object_init( jq_object* obj, jq_object_vtable* table );
 
+/**
+  Bias just initialized object to current thread: its jq_retain and
+  jq_release of object don't use atomics. Other threads update shared
+  count; when it drops below bias object is queued to owner, which merges
+  it into own count on its next jq_retain/jq_release, jq_object_collect
+  or exit. So if owner thread idles, destroy of object released last by
+  other thread is deferred: use it for objects without side effects on
+  destroy.
+*/
+void jq_object_bias( jq_object* obj );
+
+/** Merge objects queued to current thread, destroying unreferenced ones. */
+void jq_object_collect();
+
+/*-----------------------------------------------------------------------------
+  Request.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_req jq_req;
+typedef struct jq_req_inline jq_req_inline;
+typedef struct jq_sync jq_sync;
+
+/** How request is allocated. */
+enum {
+  JQ_REQ_HEAP,
+  JQ_REQ_INLINE,
+  JQ_REQ_SYNC
+};
+
+/** Request. */
+struct jq_req {
+  /** Next req in queue. */
+  jq_req* next;
+  
+  /** Group this request assigned to. */
+  jq_group_t group;
+  
+  /** Pointer to function that do the work. */
+  jq_handler_t handler;
+  
+  /** */
+  void* context;
+  
+  /** One of JQ_REQ_* kinds. */
+  int kind;
+  
+  /** Time request was put to queue, 0 unless stats or watchdog are on. */
+  uint64_t enqueued;
+};
+
+/**
+  Request with inline context storage, see jq_req_alloc. Has its own
+  allocator, so plain requests don't pay for the storage.
+*/
+struct jq_req_inline {
+  jq_req req;
+  
+  /** Called with context instead of handler if request is discarded. */
+  jq_handler_t dispose;
+  
+  union {
+    void* words[JQ_REQ_INLINE_SIZE / sizeof(void*)];
+    double align;
+  } storage;
+};
+
+jq_req* jq_req_create( jq_group_t group, jq_handler_t handler, void* context );
+void jq_req_destroy( jq_req* req );
+void jq_req_discard( jq_req* req );
+
+/*-----------------------------------------------------------------------------
+  Fibers.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_fiber jq_fiber;
+typedef struct jq_waiter jq_waiter;
+
+/**
+  Wait list node.
+  Suspended fiber links itself into wait list of object it waits for.
+*/
+struct jq_waiter {
+  /** Next waiter in list. */
+  jq_waiter* next;
+  
+  /** Fiber to resume. */
+  jq_fiber* fiber;
+};
+
+/**
+  Park callback. Called on scheduler side after fiber switched out.
+  Should link waiter into wait list and return 1, or return 0 if condition
+  is already satisfied and fiber must be resumed right away.
+*/
+typedef int (*jq_park_t)( void* object, jq_waiter* waiter );
+
+void jq_fiber_execute( jq_queue_t queue, jq_req* req );
+void jq_fiber_resume_proc( void* fiber );
+void jq_fiber_wake( jq_fiber* fiber );
+int jq_fiber_wait( jq_park_t park, void* object );
+
+int jq_group_park( void* group, jq_waiter* waiter );
+
+/*-----------------------------------------------------------------------------
+  Synchronous dispatch.
+-----------------------------------------------------------------------------*/
+
+/**
+  Synchronous request waiter. Lives on the stack of waiting thread together
+  with its request, so sync round-trip needs no allocations.
+*/
+struct jq_sync {
+  /** Embedded request, of JQ_REQ_SYNC kind. */
+  jq_req req;
+  
+  /** One of JQ_SYNC_* states. Used as futex word. */
+  volatile int state;
+  
+  /** Wait list node of suspended fiber. */
+  jq_waiter* waiter;
+};
+
+void jq_queue_sync( jq_queue_t queue, jq_handler_t handler, void* context );
+
+/*-----------------------------------------------------------------------------
+  Help while waiting.
+-----------------------------------------------------------------------------*/
+
+/**
+  Wait callback. Returns non-zero if condition is satisfied.
+  Blocks for at most timeout_ms milliseconds (forever if negative).
+*/
+typedef int (*jq_wait_t)( void* object, int timeout_ms );
+
+/** Wake threads blocked in wait callback on object, so they re-check. */
+typedef void (*jq_wake_t)( void* object );
+
+/**
+  How long helping thread sleeps on empty queue before re-checking it.
+  Reqs put meanwhile wake it, this only bounds a missed wake up.
+*/
+#define JQ_HELP_WAIT_MS 1
+
+/** Helping nested deeper blocks instead: handlers may run on small stacks. */
+#define JQ_HELP_MAX_DEPTH 4
+
+int jq_worker_help( jq_wait_t wait, jq_wake_t wake, void* object );
+
+/** Number of threads worker is asked to run. */
+size_t jq_worker_get_threads( jq_worker_t worker );
+
+/*-----------------------------------------------------------------------------
+  Queue internals used by worker.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_watcher jq_watcher;
+typedef struct jq_deferred jq_deferred;
+
+/** Call made by queue after its lock is released. */
+struct jq_deferred {
+  jq_deferred* next;
+  void (*call)( void* );
+  void* arg;
+};
+
+/** Queue watcher. Notified under queue lock each time req is put. */
+struct jq_watcher {
+  /** Next watcher of the same queue. */
+  jq_watcher* next;
+  
+  /**
+    Callback and its argument. Returns call to make once queue is unlocked
+    or NULL. Returned call and its argument must stay valid until made.
+    Several calls may be returned linked by next.
+  */
+  jq_deferred* (*notify)( void* );
+  void* arg;
+};
+
+void jq_queue_watch( jq_queue_t queue, jq_watcher* watcher );
+void jq_queue_unwatch( jq_queue_t queue, jq_watcher* watcher );
+
+/** Reqs following dispatched one outside of queue, see jq_queue_dispatch. */
+typedef struct jq_req_source {
+  /** Take next req if it has given handler, NULL otherwise. */
+  jq_req* (*take)( void* arg, jq_handler_t handler );
+  void* arg;
+} jq_req_source;
+
+jq_req* jq_queue_take( jq_queue_t queue, int take_quit );
+
+/**
+  Execute req the way queue runs its reqs (on fiber, in batch, watched)
+  and destroy it. Batch is completed from source, from queue if NULL.
+*/
+void jq_queue_dispatch( jq_queue_t queue, jq_req* req, jq_req_source* source );
+int jq_req_is_quit( jq_req* req );
+
+/*-----------------------------------------------------------------------------
+  Futex.
+-----------------------------------------------------------------------------*/
+
+/**
+  Block while *addr == value, at most timeout_ms milliseconds
+  (forever if negative). May return spuriously.
+*/
+void jq_futex_wait( volatile int* addr, int value, int timeout_ms );
+
+/** Wake up to count threads blocked on addr. */
+void jq_futex_wake( volatile int* addr, int count );
+
+/*-----------------------------------------------------------------------------
+  Stats.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_stats_worker jq_stats_worker;
+typedef struct jq_stats_gauges jq_stats_gauges;
+
+/** Worker state sampled when its slot is updated. */
+struct jq_stats_gauges {
+  size_t queue_length;
+  size_t queues;
+  size_t requested_threads;
+  size_t launched_threads;
+  size_t working_threads;
+  size_t sleeping_threads;
+};
+
+/** Set while segment is published. */
+extern volatile int jq_stats_enabled;
+
+/** Changes each time segment is published or unpublished. */
+extern volatile unsigned jq_stats_generation;
+
+/** Monotonic time in nanoseconds. */
+uint64_t jq_stats_now();
+
+/** Take free slot of segment of given generation, NULL if none. */
+jq_stats_worker* jq_stats_claim( const char* name, unsigned generation );
+void jq_stats_release( jq_stats_worker* slot, unsigned generation );
+
+/**
+  Count request executed by current thread for slot. Returns non-zero when
+  it's time to jq_stats_flush.
+*/
+int jq_stats_record( jq_stats_worker* slot, uint64_t enqueued );
+
+/** Does current thread have counts not yet flushed to slot. */
+int jq_stats_pending( jq_stats_worker* slot );
+
+/** Add counts of current thread to slot and update its gauges. */
+void jq_stats_flush( jq_stats_worker* slot, const jq_stats_gauges* gauges );
+
+/*-----------------------------------------------------------------------------
+  Watchdog.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_watchdog_slot jq_watchdog_slot;
+typedef struct jq_watchdog_state jq_watchdog_state;
+
+/** What thread runs, saved by nested dispatch. */
+struct jq_watchdog_state {
+  jq_handler_t handler;
+  uint64_t started;
+  uint64_t enqueued;
+  unsigned execution;
+};
+
+/** Set while watchdog runs. */
+extern volatile int jq_watchdog_enabled;
+
+/**
+  Mark current thread as running handler from now on, saving what it ran
+  before. Returns NULL if thread can't be watched.
+*/
+jq_watchdog_slot* jq_watchdog_enter( jq_handler_t handler, uint64_t enqueued, jq_watchdog_state* saved );
+void jq_watchdog_leave( jq_watchdog_slot* slot, const jq_watchdog_state* saved );
+
+/** Called by worker thread before it quits. */
+void jq_watchdog_thread_exit();
+
+/** Worker owning current thread, NULL for other threads. */
+jq_worker_t jq_worker_current();
+
+/** Dispatch req of worker's queue, counting it in stats. */
+void jq_worker_execute( jq_worker_t worker, jq_queue_t queue, jq_req* req, jq_req_source* source );
+
+/** Number of reqs in all queues of worker. */
+size_t jq_worker_get_queued( jq_worker_t worker );
+
+/**
+  Run one more (delta 1) or one less (delta -1) extra thread instead of
+  stalled one. Returns 0 if worker may not run more.
+*/
+int jq_worker_compensate( jq_worker_t worker, int delta );
+
+/*-----------------------------------------------------------------------------
+  Keyed lanes.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_lanes jq_lanes;
+
+jq_lanes* jq_lanes_create( jq_worker_t worker, size_t count );
+void jq_lanes_destroy( jq_lanes* lanes );
+
+/** Runner of lane, dispatches reqs of lane itself. */
+void jq_lane_run( void* storage );
+int jq_lanes_submit( jq_lanes* lanes, size_t key, jq_group_t group, jq_handler_t handler, void* context );
+
 /*-----------------------------------------------------------------------------
   Fixed size allocator.
 -----------------------------------------------------------------------------*/
 
 typedef struct jq_fsa jq_fsa;
+typedef struct jq_fsa_chunk jq_fsa_chunk;
+typedef struct jq_fsa_stats jq_fsa_stats;
+
+/** Cache line size assumed for alignment and padding. */
+#define JQ_CACHE_LINE 64
+
+/** Back chunks by anonymous mmap instead of malloc. */
+#define JQ_FSA_MMAP 1
+
+/** Back chunks by huge pages when possible, implies JQ_FSA_MMAP. */
+#define JQ_FSA_HUGE 2
 
 /**
   Fixed size allocator (FSA).
-  Allocates blocks of fixed size using one malloc for multiple blocks.
+  Allocates blocks of fixed size from chunks holding multiple blocks.
+  Each chunk is twice as big as previous one, up to max_blocks blocks.
+  Blocks are aligned (to cache line by default) and remember their chunk,
+  so chunk which got completely free can be returned to system: all but
+  one free chunks are released right away.
 */
 struct jq_fsa {
   /** Size of each allocated memory block */
   size_t size;
   
-  /** Number of blocks per malloc */
+  /** Number of blocks in the first chunk */
   size_t blocks_per_chunk;
   
-  /** Single linked list of allocated chunks */
-  void *first_chunk;
+  /** Maximum number of blocks per chunk, 0 for default */
+  size_t max_blocks;
+  
+  /** Alignment of blocks, 0 for cache line */
+  size_t align;
+  
+  /** JQ_FSA_* flags */
+  int flags;
+  
+  /** Distance between blocks, computed on first allocation */
+  size_t stride;
+  
+  /** Chunks having free blocks, and full ones. Double linked lists. */
+  jq_fsa_chunk* partial;
+  jq_fsa_chunk* full;
   
-  /** Single linked list of free blocks */
-  void *first_free;
+  /** Number of chunks and of completely free ones */
+  size_t chunks;
+  size_t empty_chunks;
+  
+  /** Bytes taken from system and number of allocated blocks */
+  size_t resident;
+  size_t live;
+  
+  /** Highest resident value and number of chunks returned to system */
+  size_t peak_resident;
+  size_t released_chunks;
   
   /** Spinlock for concurrency. */
-  pthread_spinlock_t lock;
+  jq_lock_t lock;
+};
+
+struct jq_fsa_stats {
+  size_t chunks;
+  size_t empty_chunks;
+  
+  /** Bytes taken from system */
+  size_t resident;
+  size_t peak_resident;
+  
+  /** Number of allocated blocks and bytes requested by them */
+  size_t live;
+  size_t live_bytes;
+  
+  size_t released_chunks;
 };
 
 /**
   Fixed size allocator static initializer.
 */
-#define JQ_FSA_INITIALIZER( size, blocks_per_chunk ) { \
+#define JQ_FSA_INITIALIZER( size, blocks_per_chunk ) \
+  JQ_FSA_INITIALIZER_EX( size, blocks_per_chunk, 0, 0, 0 )
+
+#define JQ_FSA_INITIALIZER_EX( size, blocks_per_chunk, max_blocks, align, flags ) { \
   size < sizeof(void*) ? sizeof(void*) : size, \
   blocks_per_chunk < 8 ? 8 : blocks_per_chunk, \
-  NULL, NULL, \
-  PTHREAD_SPINLOCK_INITIALIZER \
+  max_blocks, align, flags, \
+  0, NULL, NULL, 0, 0, 0, 0, 0, 0, \
+  JQ_LOCK_INITIALIZER \
 }
 
 void jq_fsa_init( jq_fsa* fsa, size_t size, size_t blocks_per_chunk );
+void jq_fsa_init_ex( jq_fsa* fsa, size_t size, size_t blocks_per_chunk, size_t max_blocks, size_t align, int flags );
 void jq_fsa_destroy( jq_fsa* fsa );
 void* jq_fsa_alloc( jq_fsa* fsa );
 void jq_fsa_free( jq_fsa* fsa, void* ptr );
 void jq_fsa_free_all( jq_fsa* fsa );
 
-/*-----------------------------------------------------------------------------
-  Atomic.
------------------------------------------------------------------------------*/
-
-#if defined(__GNUC__) && (__GNUC__ >= 4)
-
-  #define jq_atomic_cas( v, old, new ) \
-    __sync_val_compare_and_swap( (v), (old), (new) )
-  
-  #define jq_atomic_add( v, value ) \
-    __sync_fetch_and_add( (v), (value) )
-  
-  #define jq_atomic_sub( v, value ) \
-    __sync_fetch_and_sub( (v), (value) )
-
-/*
-#elif defined(_MSC_VER)
-
-#include <intrin.h>
-#define jq_atomic_cas( v, old, new ) \
-  _InterlockedCompareExchange( (v), (new), (old) )
-*/
-
-#else
+/** Return all completely free chunks to system. */
+void jq_fsa_trim( jq_fsa* fsa );
 
-#error "Unsupported compiler"
-
-#endif
+void jq_fsa_get_stats( jq_fsa* fsa, jq_fsa_stats* stats );
 
 #endif /* ndef _JQ_ATOMIC_H_ */
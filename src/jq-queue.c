@@ -1,52 +1,207 @@
 #include "jq-private.h"
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 
 /*-----------------------------------------------------------------------------
   Request object.
 -----------------------------------------------------------------------------*/
 
-typedef struct jq_req jq_req;
+static jq_fsa req_allocator = JQ_FSA_INITIALIZER( sizeof(jq_req), 64 );
+static jq_fsa inline_allocator = JQ_FSA_INITIALIZER( sizeof(jq_req_inline), 64 );
 
-/** Request. */
-struct jq_req {
-  /** Next req in queue. */
-  jq_req* next;
+static void jq_req_init( jq_req* req, jq_group_t group, jq_handler_t handler, void* context, int kind ) {
+  jq_retain( group );
+  jq_group_enter( group );
   
-  /** Group this request assigned to. */
-  jq_group_t group;
-  
-  /** Pointer to function that do the work. */
-  jq_handler_t handler;
-  
-  /** */
-  void* context;
-};
-
-static jq_fsa req_allocator = JQ_FSA_INITIALIZER( sizeof(jq_req), 0 );
+  req->group = group;
+  req->handler = handler;
+  req->context = context;
+  req->kind = kind;
+}
 
 jq_req* jq_req_create( jq_group_t group, jq_handler_t handler, void* context ) {
   jq_req* req = jq_fsa_alloc( &req_allocator );
   
-  if( req ) {
-    jq_retain( group );
-    jq_group_enter( group );
-    
-    req->group = group;
-    req->handler = handler;
-    req->context = context;
-  }
+  if( req )
+    jq_req_init( req, group, handler, context, JQ_REQ_HEAP );
   
   return req;
 }
 
+static void jq_sync_done( jq_sync* sync );
+
 void jq_req_destroy( jq_req* req ) {
   if( req->group ) {
     jq_group_leave( req->group );
     jq_release( req->group );
   }
   
-  jq_fsa_free( &req_allocator, req );
+  switch( req->kind ) {
+    case JQ_REQ_HEAP: jq_fsa_free( &req_allocator, req ); break;
+    case JQ_REQ_INLINE: jq_fsa_free( &inline_allocator, req ); break;
+    case JQ_REQ_SYNC: jq_sync_done( (jq_sync*)req ); break;
+  }
+}
+
+/* Destroy request which won't be run. */
+void jq_req_discard( jq_req* req ) {
+  if( req->kind == JQ_REQ_INLINE && ((jq_req_inline*)req)->dispose )
+    ((jq_req_inline*)req)->dispose( req->context );
+  
+  jq_req_destroy( req );
+}
+
+jq_req_t jq_req_alloc( jq_group_t group, jq_handler_t handler, jq_handler_t dispose ) {
+  jq_req_inline* req = jq_fsa_alloc( &inline_allocator );
+  
+  if( !req ) return NULL;
+  
+  jq_req_init( &req->req, group, handler, &req->storage, JQ_REQ_INLINE );
+  req->dispose = dispose;
+  
+  return &req->req;
+}
+
+void* jq_req_get_storage( jq_req_t req ) {
+  return &((jq_req_inline*)req)->storage;
+}
+
+void jq_req_free( jq_req_t req ) {
+  ((jq_req_inline*)req)->dispose = NULL;
+  jq_req_destroy( req );
+}
+
+/*-----------------------------------------------------------------------------
+  Synchronous waiter.
+-----------------------------------------------------------------------------*/
+
+enum {
+  JQ_SYNC_PENDING,
+  JQ_SYNC_SLEEPING,
+  JQ_SYNC_PARKED,
+  JQ_SYNC_DONE
+};
+
+/* Mark request done and wake its waiter. */
+static void jq_sync_done( jq_sync* sync ) {
+  int state = sync->state;
+  int prev;
+  
+  while( (prev = jq_atomic_cas( &sync->state, state, JQ_SYNC_DONE )) != state )
+    state = prev;
+  
+  /*
+    Sleeping thread may have already returned and its stack is gone here,
+    but waking futex on stale address is harmless.
+  */
+  if( state == JQ_SYNC_PARKED )
+    jq_fiber_wake( sync->waiter->fiber );
+  else if( state == JQ_SYNC_SLEEPING )
+    jq_futex_wake( &sync->state, 1 );
+}
+
+static int jq_sync_park( void* object, jq_waiter* waiter ) {
+  jq_sync* sync = (jq_sync*)object;
+  
+  sync->waiter = waiter;
+  return jq_atomic_cas( &sync->state, JQ_SYNC_PENDING, JQ_SYNC_PARKED ) == JQ_SYNC_PENDING;
+}
+
+static int jq_sync_wait_for( void* object, int timeout_ms ) {
+  jq_sync* sync = (jq_sync*)object;
+  
+  if( timeout_ms != 0 ) {
+    jq_atomic_cas( &sync->state, JQ_SYNC_PENDING, JQ_SYNC_SLEEPING );
+    
+    do {
+      jq_futex_wait( &sync->state, JQ_SYNC_SLEEPING, timeout_ms );
+    }
+    while( timeout_ms < 0 && sync->state != JQ_SYNC_DONE );
+  }
+  
+  if( sync->state != JQ_SYNC_DONE )
+    return 0;
+  
+  jq_atomic_barrier();
+  return 1;
+}
+
+static void jq_sync_wake( void* object ) {
+  jq_futex_wake( &((jq_sync*)object)->state, INT_MAX );
+}
+
+/*-----------------------------------------------------------------------------
+  Batch handlers.
+  Small open addressing table keyed by handler. Slots are never freed, so
+  it's read without lock; unregistered handler just has NULL batch.
+-----------------------------------------------------------------------------*/
+
+#define JQ_BATCH_SLOTS 64
+
+typedef struct {
+  jq_handler_t volatile handler;
+  jq_batch_handler_t volatile batch;
+  size_t max_count;
+} jq_batch_slot;
+
+static jq_batch_slot batch_slots[JQ_BATCH_SLOTS];
+static volatile int batch_registered = 0;
+static jq_lock_t batch_lock = JQ_LOCK_INITIALIZER;
+
+static inline size_t jq_batch_hash( jq_handler_t handler ) {
+  size_t h = (size_t)handler;
+  return (h ^ (h >> 4) ^ (h >> 12)) % JQ_BATCH_SLOTS;
+}
+
+static jq_batch_slot* jq_batch_find( jq_handler_t handler ) {
+  size_t i, h = jq_batch_hash( handler );
+  
+  for( i = 0; i < JQ_BATCH_SLOTS; ++i ) {
+    jq_batch_slot* slot = &batch_slots[(h + i) % JQ_BATCH_SLOTS];
+    
+    if( slot->handler == handler ) return slot;
+    if( !slot->handler ) break;
+  }
+  
+  return NULL;
+}
+
+int jq_handler_set_batch( jq_handler_t handler, jq_batch_handler_t batch, size_t max_count ) {
+  size_t i, h = jq_batch_hash( handler );
+  jq_batch_slot* slot = NULL;
+  
+  if( max_count < 1 || max_count > JQ_BATCH_MAX )
+    max_count = JQ_BATCH_MAX;
+  
+  jq_lock( &batch_lock );
+  
+  for( i = 0; i < JQ_BATCH_SLOTS; ++i ) {
+    slot = &batch_slots[(h + i) % JQ_BATCH_SLOTS];
+    if( !slot->handler || slot->handler == handler ) break;
+    slot = NULL;
+  }
+  
+  if( slot && slot->handler != handler ) {
+    if( batch ) {
+      slot->max_count = max_count;
+      slot->batch = batch;
+      
+      /* Publish handler last, so readers see filled slot. */
+      jq_atomic_barrier();
+      slot->handler = handler;
+      batch_registered = 1;
+    }
+  }
+  else if( slot ) {
+    /* Any limit is in bounds, so it doesn't matter which one reader gets. */
+    slot->max_count = max_count;
+    slot->batch = batch;
+  }
+  
+  jq_unlock( &batch_lock );
+  
+  return slot != NULL || !batch;
 }
 
 /*-----------------------------------------------------------------------------
@@ -66,7 +221,7 @@ struct jq_queue {
   jq_req* last;
   
   /** Concurrency spinlock. */
-  pthread_spinlock_t lock;
+  jq_lock_t lock;
   
   /** Mutex for condition variable. */
   pthread_mutex_t mutex;
@@ -76,20 +231,26 @@ struct jq_queue {
   
   /** Number of reqs in queue. */
   volatile size_t count;
+  
+  /** Number of threads blocked in jq_queue_wait. */
+  volatile size_t sleepers;
+  
+  /** Workers notified about new reqs. */
+  jq_watcher* watchers;
+  
+  /** Run handlers on fibers. */
+  int fibers;
 };
 
-static inline void jq_queue_lockless_empty( jq_queue* queue ) {
-  jq_req* next;
+/* Detach all reqs. Returns the first one. */
+static inline jq_req* jq_queue_lockless_detach( jq_queue* queue ) {
   jq_req* req = queue->first;
   
-  while( req != NULL ) {
-    next = req->next;
-    jq_req_destroy( req );
-    req = next;
-  }
-  
   queue->first = NULL;
   queue->last = NULL;
+  queue->count = 0;
+  
+  return req;
 }
 
 static inline void jq_queue_lockless_put_last( jq_queue* queue, jq_req* req ) {
@@ -132,25 +293,84 @@ static inline jq_req* jq_queue_lockless_get( jq_queue* queue ) {
   return req;
 }
 
+/*
+  Wake one sleeping thread. Mutex is taken so signal can't be sent between
+  sleeper's check of the queue and its pthread_cond_wait.
+*/
+static inline void jq_queue_signal( jq_queue* queue ) {
+  jq_atomic_barrier();
+  
+  if( queue->sleepers ) {
+    pthread_mutex_lock( &queue->mutex );
+    pthread_cond_signal( &queue->cond );
+    pthread_mutex_unlock( &queue->mutex );
+  }
+}
+
+/*
+  Notify watchers under lock, so unwatched watcher is never called.
+  Returns list of calls they deferred.
+*/
+static inline jq_deferred* jq_queue_lockless_notify( jq_queue* queue ) {
+  jq_deferred* deferred = NULL;
+  jq_deferred* call;
+  jq_watcher* watcher;
+  
+  for( watcher = queue->watchers; watcher; watcher = watcher->next ) {
+    if( (call = watcher->notify( watcher->arg )) ) {
+      jq_deferred* last = call;
+      
+      while( last->next )
+        last = last->next;
+      
+      last->next = deferred;
+      deferred = call;
+    }
+  }
+  
+  return deferred;
+}
+
+/* Make deferred calls. Call may be deferred again once made. */
+static inline void jq_queue_call_deferred( jq_deferred* deferred ) {
+  while( deferred ) {
+    jq_deferred* next = deferred->next;
+    deferred->call( deferred->arg );
+    deferred = next;
+  }
+}
+
 static void jq_queue_put_last( jq_queue* queue, jq_req* req ) {
-  pthread_spin_lock( &queue->lock );
+  jq_deferred* deferred;
+  
+  req->enqueued = jq_stats_enabled || jq_watchdog_enabled ? jq_stats_now() : 0;
+  
+  jq_lock( &queue->lock );
   jq_queue_lockless_put_last( queue, req );
-  pthread_spin_unlock( &queue->lock );
-  pthread_cond_signal( &queue->cond );
+  deferred = jq_queue_lockless_notify( queue );
+  jq_unlock( &queue->lock );
+  jq_queue_signal( queue );
+  jq_queue_call_deferred( deferred );
 }
 
 static void jq_queue_put_first( jq_queue* queue, jq_req* req ) {
-  pthread_spin_lock( &queue->lock );
+  jq_deferred* deferred;
+  
+  req->enqueued = jq_stats_enabled || jq_watchdog_enabled ? jq_stats_now() : 0;
+  
+  jq_lock( &queue->lock );
   jq_queue_lockless_put_first( queue, req );
-  pthread_spin_unlock( &queue->lock );
-  pthread_cond_signal( &queue->cond );
+  deferred = jq_queue_lockless_notify( queue );
+  jq_unlock( &queue->lock );
+  jq_queue_signal( queue );
+  jq_queue_call_deferred( deferred );
 }
 
 static jq_req* jq_queue_get( jq_queue* queue ) {
   jq_req* req;
-  pthread_spin_lock( &queue->lock );
+  jq_lock( &queue->lock );
   req = jq_queue_lockless_get( queue );
-  pthread_spin_unlock( &queue->lock );
+  jq_unlock( &queue->lock );
   return req;
 }
 
@@ -159,11 +379,13 @@ static jq_req* jq_queue_wait( jq_queue* queue ) {
   
   if( !(req = jq_queue_get( queue )) ) {
     pthread_mutex_lock( &queue->mutex );
+    jq_atomic_add( &queue->sleepers, 1 );
     
     while( !(req = jq_queue_get( queue )) ) {
       pthread_cond_wait( &queue->cond, &queue->mutex );
     }
     
+    jq_atomic_sub( &queue->sleepers, 1 );
     pthread_mutex_unlock( &queue->mutex );
   }
   
@@ -173,12 +395,163 @@ static jq_req* jq_queue_wait( jq_queue* queue ) {
 static void jq_queue_quit_proc( void* context ) {
 }
 
+/*-----------------------------------------------------------------------------
+  Private.
+-----------------------------------------------------------------------------*/
+
+/*
+  Take reqs with same handler following req from queue head (or source)
+  and run them all with single batch call.
+*/
+static void jq_queue_dispatch_batch(
+  jq_queue* queue,
+  jq_req* req,
+  jq_batch_handler_t batch,
+  size_t max_count,
+  jq_req_source* source )
+{
+  jq_req* reqs[JQ_BATCH_MAX];
+  void* contexts[JQ_BATCH_MAX];
+  size_t count = 1, i;
+  
+  reqs[0] = req;
+  contexts[0] = req->context;
+  
+  if( source ) {
+    while( count < max_count && (reqs[count] = source->take( source->arg, req->handler )) ) {
+      contexts[count] = reqs[count]->context;
+      count++;
+    }
+  }
+  else if( queue->first && max_count > 1 ) {
+    jq_lock( &queue->lock );
+    
+    while( count < max_count && queue->first && queue->first->handler == req->handler ) {
+      reqs[count] = jq_queue_lockless_get( queue );
+      contexts[count] = reqs[count]->context;
+      count++;
+    }
+    
+    jq_unlock( &queue->lock );
+  }
+  
+  batch( contexts, count );
+  
+  for( i = 0; i < count; ++i )
+    jq_req_destroy( reqs[i] );
+}
+
+static void jq_queue_execute( jq_queue* queue, jq_req* req, jq_req_source* source ) {
+  jq_batch_slot* slot;
+  jq_batch_handler_t batch;
+  
+  if( req->handler == jq_fiber_resume_proc ) {
+    void* fiber = req->context;
+    jq_req_destroy( req );
+    jq_fiber_resume_proc( fiber );
+  }
+  else if( queue->fibers ) {
+    jq_fiber_execute( queue, req );
+  }
+  else if( batch_registered && req->handler
+    && (slot = jq_batch_find( req->handler )) && (batch = slot->batch) )
+  {
+    jq_queue_dispatch_batch( queue, req, batch, slot->max_count, source );
+  }
+  else {
+    if( req->handler )
+      req->handler( req->context );
+    
+    jq_req_destroy( req );
+  }
+}
+
+/*
+  Resumed fiber isn't watched: its handler isn't known here. Nor is lane
+  runner: reqs it dispatches are.
+*/
+void jq_queue_dispatch( jq_queue_t queue, jq_req* req, jq_req_source* source ) {
+  jq_watchdog_state saved;
+  jq_watchdog_slot* slot = NULL;
+  
+  if( jq_watchdog_enabled && req->handler
+    && req->handler != jq_fiber_resume_proc && req->handler != jq_lane_run )
+  {
+    slot = jq_watchdog_enter( req->handler, req->enqueued, &saved );
+  }
+  
+  jq_queue_execute( queue, req, source );
+  
+  if( slot )
+    jq_watchdog_leave( slot, &saved );
+}
+
+int jq_req_is_quit( jq_req* req ) {
+  return req->handler == jq_queue_quit_proc;
+}
+
+/*
+  Take first req. Unless take_quit is set, quit reqs are left in queue and
+  the first req after them is taken: they are put first, so they lead.
+*/
+jq_req* jq_queue_take( jq_queue_t queue, int take_quit ) {
+  jq_req* prev = NULL;
+  jq_req* req;
+  
+  jq_lock( &queue->lock );
+  
+  req = queue->first;
+  
+  while( !take_quit && req && req->handler == jq_queue_quit_proc ) {
+    prev = req;
+    req = req->next;
+  }
+  
+  if( req ) {
+    if( prev )
+      prev->next = req->next;
+    else
+      queue->first = req->next;
+    
+    if( queue->last == req )
+      queue->last = prev;
+    
+    queue->count--;
+  }
+  
+  jq_unlock( &queue->lock );
+  
+  return req;
+}
+
+void jq_queue_watch( jq_queue_t queue, jq_watcher* watcher ) {
+  jq_lock( &queue->lock );
+  watcher->next = queue->watchers;
+  queue->watchers = watcher;
+  jq_unlock( &queue->lock );
+}
+
+void jq_queue_unwatch( jq_queue_t queue, jq_watcher* watcher ) {
+  jq_watcher** p;
+  
+  jq_lock( &queue->lock );
+  
+  for( p = &queue->watchers; *p; p = &(*p)->next ) {
+    if( *p == watcher ) {
+      *p = watcher->next;
+      break;
+    }
+  }
+  
+  jq_unlock( &queue->lock );
+}
+
 static void jq_queue_vtable_destroy( void* object ) {
   jq_queue* queue = (jq_queue*)object;
   jq_queue_empty( queue );
   pthread_cond_destroy( &queue->cond );
   pthread_mutex_destroy( &queue->mutex );
-  pthread_spin_destroy( &queue->lock );
+  jq_lock_destroy( &queue->lock );
   
   //printf( "%p queue destroyed!\n", queue );
 }
@@ -201,8 +574,7 @@ jq_queue_t jq_queue_create() {
     
     jq_object_init( &queue->object, &queue_vtable );
     
-    if( pthread_spin_init( &queue->lock, 0 ) != 0 )
-      goto fail;
+    jq_lock_init( &queue->lock );
     
     if( pthread_mutex_init( &queue->mutex, NULL ) != 0 )
       goto fail;
@@ -221,9 +593,18 @@ fail:
 }
 
 void jq_queue_empty( jq_queue_t queue ) {
-  pthread_spin_lock( &queue->lock );
-  jq_queue_lockless_empty( queue );
-  pthread_spin_unlock( &queue->lock );
+  jq_req* req;
+  
+  jq_lock( &queue->lock );
+  req = jq_queue_lockless_detach( queue );
+  jq_unlock( &queue->lock );
+  
+  /* Destroyed out of lock: leaving group may put reqs back to queue. */
+  while( req != NULL ) {
+    jq_req* next = req->next;
+    jq_req_discard( req );
+    req = next;
+  }
 }
 
 int jq_queue_submit( jq_queue_t queue, jq_group_t group, jq_handler_t handler, void* context ) {
@@ -234,6 +615,31 @@ int jq_queue_submit( jq_queue_t queue, jq_group_t group, jq_handler_t handler, v
   return 1;
 }
 
+void jq_queue_sync( jq_queue_t queue, jq_handler_t handler, void* context ) {
+  jq_sync sync;
+  
+  sync.req.group = NULL;
+  sync.req.handler = handler;
+  sync.req.context = context;
+  sync.req.kind = JQ_REQ_SYNC;
+  sync.state = JQ_SYNC_PENDING;
+  sync.waiter = NULL;
+  
+  jq_queue_put_last( queue, &sync.req );
+  
+  if( jq_fiber_wait( jq_sync_park, &sync ) )
+    return;
+  
+  if( jq_worker_help( jq_sync_wait_for, jq_sync_wake, &sync ) )
+    return;
+  
+  jq_sync_wait_for( &sync, -1 );
+}
+
+void jq_queue_submit_req( jq_queue_t queue, jq_req_t req ) {
+  jq_queue_put_last( queue, req );
+}
+
 int jq_queue_stop( jq_queue_t queue ) {
   jq_req* req = jq_req_create( NULL, jq_queue_quit_proc, NULL );
   if( !req ) return 0;
@@ -252,10 +658,7 @@ int jq_queue_poll( jq_queue_t queue ) {
       return 0;
     }
     
-    if( req->handler )
-      req->handler( req->context );
-    
-    jq_req_destroy( req );
+    jq_queue_dispatch( queue, req, NULL );
   }
 }
 
@@ -268,19 +671,20 @@ void jq_queue_loop( jq_queue_t queue ) {
       break;
     }
     
-    if( req->handler )
-      req->handler( req->context );
-    
-    jq_req_destroy( req );
+    jq_queue_dispatch( queue, req, NULL );
   }
 }
 
+void jq_queue_set_fibers( jq_queue_t queue, int enabled ) {
+  queue->fibers = enabled;
+}
+
 size_t jq_queue_get_length( jq_queue_t queue ) {
   size_t length;
   
-  pthread_spin_lock( &queue->lock );
+  jq_lock( &queue->lock );
   length = queue->count;
-  pthread_spin_unlock( &queue->lock );
+  jq_unlock( &queue->lock );
   
   return length;
 }
@@ -0,0 +1,719 @@
+#include "jq-private.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/*-----------------------------------------------------------------------------
+  Shared layout.
+  Everything below lives in shared memory mapped at different addresses in
+  different processes, so links are offsets from the start of the region.
+-----------------------------------------------------------------------------*/
+
+#define JQ_SHM_MAGIC 0x4A51534D
+#define JQ_SHM_ALIGN 16
+#define JQ_SHM_NIL 0
+
+#define JQ_SHM_NODE_QUIT 1
+
+/* Node states, kept to rebuild lists after process died holding mutex. */
+#define JQ_SHM_NODE_FREE 0
+#define JQ_SHM_NODE_QUEUED 1
+#define JQ_SHM_NODE_TAKEN 2
+#define JQ_SHM_NODE_SEEN 4
+
+/** Period of looking for slots held by dead processes while slab is empty. */
+#define JQ_SHM_RECLAIM_MS 100
+
+typedef struct jq_shm_header jq_shm_header;
+typedef struct jq_shm_node jq_shm_node;
+
+/** Region header. */
+struct jq_shm_header {
+  /** Set to JQ_SHM_MAGIC when region is initialized. */
+  volatile unsigned magic;
+  
+  /** Size of the whole region. */
+  size_t map_size;
+  
+  /** Payload capacity of each node. */
+  size_t slot_size;
+  
+  /** Distance between nodes in slab. */
+  size_t node_size;
+  
+  /** Number of nodes in slab. */
+  size_t slots;
+  
+  /** Process-shared robust mutex protecting everything below. */
+  pthread_mutex_t mutex;
+  
+  /** Signaled when node was added to queue. */
+  pthread_cond_t cond;
+  
+  /** Signaled when node was returned to slab. */
+  pthread_cond_t space;
+  
+  /** First and last node in queue. */
+  size_t first;
+  size_t last;
+  
+  /** Single linked list of free nodes. */
+  size_t free;
+  
+  /** Number of nodes in queue. */
+  size_t count;
+  
+  /** Number of processes blocked in cond and space. */
+  size_t sleepers;
+  size_t space_sleepers;
+};
+
+/** Request node with inline payload. */
+struct jq_shm_node {
+  /** Offset of next node in queue or free list. */
+  size_t next;
+  
+  /** Payload size. */
+  size_t size;
+  
+  /** JQ_SHM_NODE_* flags. */
+  size_t flags;
+  
+  /** JQ_SHM_NODE_* state and process which took node off lists. */
+  unsigned state;
+  pid_t owner;
+  
+  /** Start time of owner, tells it from process which reused its pid. */
+  uint64_t owner_start;
+};
+
+#define JQ_SHM_ROUND( size ) (((size) + JQ_SHM_ALIGN - 1) & ~(size_t)(JQ_SHM_ALIGN - 1))
+#define JQ_SHM_HEADER_SIZE JQ_SHM_ROUND( sizeof(jq_shm_header) )
+#define JQ_SHM_NODE_HEADER_SIZE JQ_SHM_ROUND( sizeof(jq_shm_node) )
+
+/*-----------------------------------------------------------------------------
+  Internals.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_shm_queue jq_shm_queue;
+
+/** Process-local handle of shared queue. */
+struct jq_shm_queue {
+  jq_object object;
+  
+  /** Mapped region. */
+  jq_shm_header* header;
+};
+
+static inline jq_shm_node* jq_shm_node_at( jq_shm_header* header, size_t offset ) {
+  return (jq_shm_node*)((char*)header + offset);
+}
+
+static inline size_t jq_shm_offset_of( jq_shm_header* header, jq_shm_node* node ) {
+  return (char*)node - (char*)header;
+}
+
+static inline void* jq_shm_node_data( jq_shm_node* node ) {
+  return (char*)node + JQ_SHM_NODE_HEADER_SIZE;
+}
+
+static inline jq_shm_node* jq_shm_slot( jq_shm_header* header, size_t index ) {
+  return jq_shm_node_at( header, JQ_SHM_HEADER_SIZE + index * header->node_size );
+}
+
+/* Offset points to node of slab. */
+static inline int jq_shm_is_node( jq_shm_header* header, size_t offset ) {
+  return offset >= JQ_SHM_HEADER_SIZE
+    && offset < JQ_SHM_HEADER_SIZE + header->slots * header->node_size
+    && (offset - JQ_SHM_HEADER_SIZE) % header->node_size == 0;
+}
+
+/* Identity of this process, stamped on nodes it takes. Reset in child. */
+static volatile pid_t self_pid = 0;
+static uint64_t self_start = 0;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+/*
+  Read /proc/<pid>/stat: start time in clock ticks since boot and state.
+  Returns 0 if it can't be read (no such process or no procfs).
+*/
+static int jq_shm_proc_stat( pid_t pid, uint64_t* start, char* state ) {
+  char path[32], buf[512];
+  char* p;
+  ssize_t len;
+  int fd, i;
+  
+  snprintf( path, sizeof(path), "/proc/%d/stat", (int)pid );
+  
+  if( (fd = open( path, O_RDONLY )) < 0 )
+    return 0;
+  
+  len = read( fd, buf, sizeof(buf) - 1 );
+  close( fd );
+  
+  if( len <= 0 ) return 0;
+  buf[len] = 0;
+  
+  /* Command name may hold spaces and parens: fields follow the last one. */
+  if( !(p = strrchr( buf, ')' )) || p[1] != ' ' )
+    return 0;
+  
+  *state = p[2];
+  
+  /* Start time is the 22nd field, 20 fields after the name. */
+  for( i = 0; i < 20 && p; ++i )
+    p = strchr( p + 1, ' ' );
+  
+  if( !p ) return 0;
+  
+  *start = strtoull( p + 1, NULL, 10 );
+  return 1;
+}
+
+static void jq_shm_self_reset() {
+  self_pid = 0;
+}
+
+static void jq_shm_self_once() {
+  pthread_atfork( NULL, NULL, jq_shm_self_reset );
+}
+
+/* Called before locking mutex, so nothing is looked up under it. */
+static void jq_shm_self_init() {
+  char state;
+  
+  pthread_once( &self_once, jq_shm_self_once );
+  
+  if( !self_pid ) {
+    if( !jq_shm_proc_stat( getpid(), &self_start, &state ) )
+      self_start = 0;
+    
+    jq_atomic_barrier();
+    self_pid = getpid();
+  }
+}
+
+static inline void jq_shm_set_owner( jq_shm_node* node ) {
+  node->state = JQ_SHM_NODE_TAKEN;
+  node->owner = self_pid;
+  node->owner_start = self_start;
+}
+
+/*
+  Node taken by process which died before returning it. Zombie owner is
+  dead too, and process which got its pid is not the owner.
+*/
+static int jq_shm_is_orphan( jq_shm_node* node ) {
+  uint64_t start;
+  char state;
+  
+  if( node->state != JQ_SHM_NODE_TAKEN )
+    return 0;
+  
+  if( kill( node->owner, 0 ) != 0 && errno == ESRCH )
+    return 1;
+  
+  if( !jq_shm_proc_stat( node->owner, &start, &state ) )
+    return 0;
+  
+  return state == 'Z' || state == 'X' || (node->owner_start && start != node->owner_start);
+}
+
+/*
+  Rebuild lists after process died holding mutex, possibly in the middle
+  of changing them. Queue keeps its order as far as its links are intact,
+  queued nodes cut off are put after. Nodes taken by dead processes are
+  returned to slab along with free ones.
+*/
+static void jq_shm_lockless_recover( jq_shm_header* header ) {
+  size_t offset = header->first, i;
+  jq_shm_node* node;
+  jq_shm_node* last = NULL;
+  
+  header->first = header->last = header->free = JQ_SHM_NIL;
+  header->count = 0;
+  
+  /* Intact part of queue. Marks stop on loops. */
+  for( i = 0; i < header->slots && jq_shm_is_node( header, offset ); ++i ) {
+    node = jq_shm_node_at( header, offset );
+    
+    if( node->state != JQ_SHM_NODE_QUEUED )
+      break;
+    
+    node->state |= JQ_SHM_NODE_SEEN;
+    offset = node->next;
+    
+    if( last )
+      last->next = jq_shm_offset_of( header, node );
+    else
+      header->first = jq_shm_offset_of( header, node );
+    
+    last = node;
+    header->count++;
+  }
+  
+  if( last ) {
+    last->next = JQ_SHM_NIL;
+    header->last = jq_shm_offset_of( header, last );
+  }
+  
+  for( i = 0; i < header->slots; ++i ) {
+    node = jq_shm_slot( header, i );
+    
+    if( node->state & JQ_SHM_NODE_SEEN ) {
+      node->state &= ~JQ_SHM_NODE_SEEN;
+    }
+    else if( node->state == JQ_SHM_NODE_QUEUED ) {
+      node->next = JQ_SHM_NIL;
+      
+      if( header->last != JQ_SHM_NIL )
+        jq_shm_node_at( header, header->last )->next = jq_shm_offset_of( header, node );
+      else
+        header->first = jq_shm_offset_of( header, node );
+      
+      header->last = jq_shm_offset_of( header, node );
+      header->count++;
+    }
+    else if( node->state == JQ_SHM_NODE_FREE || jq_shm_is_orphan( node ) ) {
+      node->state = JQ_SHM_NODE_FREE;
+      node->next = header->free;
+      header->free = jq_shm_offset_of( header, node );
+    }
+  }
+  
+  /* Wakeups may have been lost with the owner. */
+  if( header->first != JQ_SHM_NIL && header->sleepers )
+    pthread_cond_broadcast( &header->cond );
+  
+  if( header->free != JQ_SHM_NIL && header->space_sleepers )
+    pthread_cond_broadcast( &header->space );
+}
+
+/* Lock mutex, recovering state left by its dead owner. */
+static int jq_shm_lock( jq_shm_header* header ) {
+  int res = pthread_mutex_lock( &header->mutex );
+  
+  if( res == EOWNERDEAD ) {
+    jq_shm_lockless_recover( header );
+    res = pthread_mutex_consistent( &header->mutex );
+  }
+  
+  return res == 0;
+}
+
+/*
+  Wait on condition with mutex locked, at most timeout_ms milliseconds
+  (forever if negative). Returns 0 on timeout.
+*/
+static int jq_shm_wait( jq_shm_header* header, pthread_cond_t* cond, int timeout_ms ) {
+  struct timeval now;
+  struct timespec deadline;
+  int res;
+  
+  if( timeout_ms < 0 ) {
+    res = pthread_cond_wait( cond, &header->mutex );
+  }
+  else {
+    gettimeofday( &now, NULL );
+    deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+    
+    if( deadline.tv_nsec >= 1000000000 ) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    
+    res = pthread_cond_timedwait( cond, &header->mutex, &deadline );
+  }
+  
+  if( res == EOWNERDEAD ) {
+    jq_shm_lockless_recover( header );
+    pthread_mutex_consistent( &header->mutex );
+  }
+  
+  return res != ETIMEDOUT;
+}
+
+static void jq_shm_lockless_free( jq_shm_header* header, jq_shm_node* node );
+
+/* Return nodes taken by dead processes to slab. */
+static void jq_shm_lockless_reclaim( jq_shm_header* header ) {
+  size_t i;
+  
+  for( i = 0; i < header->slots; ++i ) {
+    jq_shm_node* node = jq_shm_slot( header, i );
+    
+    if( jq_shm_is_orphan( node ) )
+      jq_shm_lockless_free( header, node );
+  }
+}
+
+/* Take free node from slab, waiting if none. Called with mutex locked. */
+static jq_shm_node* jq_shm_lockless_alloc( jq_shm_header* header ) {
+  jq_shm_node* node;
+  
+  while( header->free == JQ_SHM_NIL ) {
+    header->space_sleepers++;
+    
+    /* Consumer may have died holding nodes: look for them from time to time. */
+    if( !jq_shm_wait( header, &header->space, JQ_SHM_RECLAIM_MS ) )
+      jq_shm_lockless_reclaim( header );
+    
+    header->space_sleepers--;
+  }
+  
+  node = jq_shm_node_at( header, header->free );
+  header->free = node->next;
+  jq_shm_set_owner( node );
+  
+  return node;
+}
+
+static void jq_shm_lockless_free( jq_shm_header* header, jq_shm_node* node ) {
+  node->state = JQ_SHM_NODE_FREE;
+  node->next = header->free;
+  header->free = jq_shm_offset_of( header, node );
+  
+  if( header->space_sleepers )
+    pthread_cond_signal( &header->space );
+}
+
+static void jq_shm_lockless_put_last( jq_shm_header* header, jq_shm_node* node ) {
+  size_t offset = jq_shm_offset_of( header, node );
+  
+  node->state = JQ_SHM_NODE_QUEUED;
+  node->next = JQ_SHM_NIL;
+  
+  if( header->last != JQ_SHM_NIL )
+    jq_shm_node_at( header, header->last )->next = offset;
+  else
+    header->first = offset;
+  
+  header->last = offset;
+  header->count++;
+  
+  if( header->sleepers )
+    pthread_cond_signal( &header->cond );
+}
+
+static void jq_shm_lockless_put_first( jq_shm_header* header, jq_shm_node* node ) {
+  size_t offset = jq_shm_offset_of( header, node );
+  
+  node->state = JQ_SHM_NODE_QUEUED;
+  node->next = header->first;
+  
+  if( header->first == JQ_SHM_NIL )
+    header->last = offset;
+  
+  header->first = offset;
+  header->count++;
+  
+  if( header->sleepers )
+    pthread_cond_signal( &header->cond );
+}
+
+static jq_shm_node* jq_shm_lockless_get( jq_shm_header* header ) {
+  jq_shm_node* node;
+  
+  if( header->first == JQ_SHM_NIL )
+    return NULL;
+  
+  node = jq_shm_node_at( header, header->first );
+  
+  if( (header->first = node->next) == JQ_SHM_NIL )
+    header->last = JQ_SHM_NIL;
+  
+  header->count--;
+  jq_shm_set_owner( node );
+  
+  return node;
+}
+
+/*
+  Take node from queue, blocking if wait is set and queue is empty.
+  Returns NULL if queue is empty or quit node was taken.
+*/
+static jq_shm_node* jq_shm_take( jq_shm_header* header, int wait, int* quit ) {
+  jq_shm_node* node;
+  
+  jq_shm_self_init();
+  
+  if( !jq_shm_lock( header ) ) {
+    *quit = 1;
+    return NULL;
+  }
+  
+  while( !(node = jq_shm_lockless_get( header )) && wait ) {
+    header->sleepers++;
+    jq_shm_wait( header, &header->cond, -1 );
+    header->sleepers--;
+  }
+  
+  if( node && (node->flags & JQ_SHM_NODE_QUIT) ) {
+    jq_shm_lockless_free( header, node );
+    node = NULL;
+    *quit = 1;
+  }
+  
+  pthread_mutex_unlock( &header->mutex );
+  
+  return node;
+}
+
+static void jq_shm_release_node( jq_shm_header* header, jq_shm_node* node ) {
+  if( jq_shm_lock( header ) ) {
+    jq_shm_lockless_free( header, node );
+    pthread_mutex_unlock( &header->mutex );
+  }
+}
+
+static void jq_shm_queue_vtable_destroy( void* object ) {
+  jq_shm_queue* queue = (jq_shm_queue*)object;
+  munmap( queue->header, queue->header->map_size );
+  free( queue );
+}
+
+static jq_object_vtable shm_queue_vtable = {
+  jq_shm_queue_vtable_destroy
+};
+
+static jq_shm_queue_t jq_shm_queue_wrap( jq_shm_header* header ) {
+  jq_shm_queue* queue = (jq_shm_queue*)malloc( sizeof(jq_shm_queue) );
+  
+  if( queue ) {
+    jq_object_init( &queue->object, &shm_queue_vtable );
+    queue->header = header;
+  }
+  
+  return queue;
+}
+
+static int jq_shm_init_sync( jq_shm_header* header ) {
+  pthread_mutexattr_t mutex_attr;
+  pthread_condattr_t cond_attr;
+  int res = 0;
+  
+  pthread_mutexattr_init( &mutex_attr );
+  pthread_condattr_init( &cond_attr );
+  pthread_mutexattr_setpshared( &mutex_attr, PTHREAD_PROCESS_SHARED );
+  pthread_mutexattr_setrobust( &mutex_attr, PTHREAD_MUTEX_ROBUST );
+  pthread_condattr_setpshared( &cond_attr, PTHREAD_PROCESS_SHARED );
+  
+  if( pthread_mutex_init( &header->mutex, &mutex_attr ) == 0 ) {
+    if( pthread_cond_init( &header->cond, &cond_attr ) == 0 ) {
+      if( pthread_cond_init( &header->space, &cond_attr ) == 0 )
+        res = 1;
+      else
+        pthread_cond_destroy( &header->cond );
+    }
+    
+    if( !res )
+      pthread_mutex_destroy( &header->mutex );
+  }
+  
+  pthread_condattr_destroy( &cond_attr );
+  pthread_mutexattr_destroy( &mutex_attr );
+  
+  return res;
+}
+
+/*-----------------------------------------------------------------------------
+  Public.
+-----------------------------------------------------------------------------*/
+
+jq_shm_queue_t jq_shm_queue_create( const char* name, size_t slots, size_t slot_size ) {
+  jq_shm_header* header;
+  jq_shm_queue_t queue;
+  size_t node_size, map_size, i;
+  int fd;
+  
+  if( slots < 1 ) slots = 1;
+  
+  if( slot_size > SIZE_MAX - JQ_SHM_NODE_HEADER_SIZE - JQ_SHM_ALIGN )
+    return NULL;
+  
+  node_size = JQ_SHM_NODE_HEADER_SIZE + JQ_SHM_ROUND( slot_size );
+  
+  if( slots > (SIZE_MAX - JQ_SHM_HEADER_SIZE) / node_size )
+    return NULL;
+  
+  map_size = JQ_SHM_HEADER_SIZE + slots * node_size;
+  
+  if( (fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0600 )) < 0 )
+    return NULL;
+  
+  if( ftruncate( fd, map_size ) != 0 )
+    goto fail_fd;
+  
+  header = (jq_shm_header*)mmap( NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  
+  if( header == MAP_FAILED )
+    goto fail;
+  
+  memset( header, 0, JQ_SHM_HEADER_SIZE );
+  header->map_size = map_size;
+  header->slot_size = slot_size;
+  header->node_size = node_size;
+  header->slots = slots;
+  
+  if( !jq_shm_init_sync( header ) )
+    goto fail_map;
+  
+  /* Build slab free list. */
+  for( i = slots; i > 0; --i ) {
+    jq_shm_node* node = jq_shm_slot( header, i - 1 );
+    node->state = JQ_SHM_NODE_FREE;
+    node->next = header->free;
+    header->free = jq_shm_offset_of( header, node );
+  }
+  
+  if( !(queue = jq_shm_queue_wrap( header )) )
+    goto fail_map;
+  
+  jq_atomic_barrier();
+  header->magic = JQ_SHM_MAGIC;
+  
+  return queue;
+  
+fail_map:
+  munmap( header, map_size );
+  goto fail;
+  
+fail_fd:
+  close( fd );
+  
+fail:
+  shm_unlink( name );
+  return NULL;
+}
+
+jq_shm_queue_t jq_shm_queue_open( const char* name ) {
+  jq_shm_header* header;
+  jq_shm_queue_t queue;
+  struct stat st;
+  int fd;
+  
+  if( (fd = shm_open( name, O_RDWR, 0 )) < 0 )
+    return NULL;
+  
+  if( fstat( fd, &st ) != 0 || (size_t)st.st_size < JQ_SHM_HEADER_SIZE ) {
+    close( fd );
+    return NULL;
+  }
+  
+  header = (jq_shm_header*)mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  
+  if( header == MAP_FAILED )
+    return NULL;
+  
+  /* Not initialized yet or not a queue at all. */
+  if( header->magic != JQ_SHM_MAGIC || header->map_size != (size_t)st.st_size ) {
+    munmap( header, st.st_size );
+    return NULL;
+  }
+  
+  jq_atomic_barrier();
+  
+  if( !(queue = jq_shm_queue_wrap( header )) )
+    munmap( header, st.st_size );
+  
+  return queue;
+}
+
+int jq_shm_queue_unlink( const char* name ) {
+  return shm_unlink( name ) == 0;
+}
+
+int jq_shm_queue_submit( jq_shm_queue_t queue, const void* data, size_t size ) {
+  jq_shm_header* header = queue->header;
+  jq_shm_node* node;
+  
+  if( size > header->slot_size )
+    return 0;
+  
+  jq_shm_self_init();
+  
+  if( !jq_shm_lock( header ) )
+    return 0;
+  
+  node = jq_shm_lockless_alloc( header );
+  node->size = size;
+  node->flags = 0;
+  memcpy( jq_shm_node_data( node ), data, size );
+  
+  jq_shm_lockless_put_last( header, node );
+  
+  pthread_mutex_unlock( &header->mutex );
+  
+  return 1;
+}
+
+int jq_shm_queue_stop( jq_shm_queue_t queue ) {
+  jq_shm_header* header = queue->header;
+  jq_shm_node* node;
+  
+  jq_shm_self_init();
+  
+  if( !jq_shm_lock( header ) )
+    return 0;
+  
+  node = jq_shm_lockless_alloc( header );
+  node->size = 0;
+  node->flags = JQ_SHM_NODE_QUIT;
+  
+  jq_shm_lockless_put_first( header, node );
+  
+  pthread_mutex_unlock( &header->mutex );
+  
+  return 1;
+}
+
+int jq_shm_queue_poll( jq_shm_queue_t queue, jq_shm_handler_t handler ) {
+  jq_shm_header* header = queue->header;
+  
+  while( 1 ) {
+    int quit = 0;
+    jq_shm_node* node = jq_shm_take( header, 0, &quit );
+    
+    if( !node ) return !quit;
+    
+    /* Payload is handled in place and node is returned to slab after. */
+    handler( jq_shm_node_data( node ), node->size );
+    jq_shm_release_node( header, node );
+  }
+}
+
+void jq_shm_queue_loop( jq_shm_queue_t queue, jq_shm_handler_t handler ) {
+  jq_shm_header* header = queue->header;
+  
+  while( 1 ) {
+    int quit = 0;
+    jq_shm_node* node = jq_shm_take( header, 1, &quit );
+    
+    if( !node ) break;
+    
+    handler( jq_shm_node_data( node ), node->size );
+    jq_shm_release_node( header, node );
+  }
+}
+
+size_t jq_shm_queue_get_length( jq_shm_queue_t queue ) {
+  size_t length = 0;
+  
+  if( jq_shm_lock( queue->header ) ) {
+    length = queue->header->count;
+    pthread_mutex_unlock( &queue->header->mutex );
+  }
+  
+  return length;
+}
@@ -0,0 +1,251 @@
+#include "jq-private.h"
+#include "jq-stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*-----------------------------------------------------------------------------
+  Internals.
+  Worker threads count executed requests and their queue waits in thread
+  local counters and add them to worker's slot every JQ_STATS_FLUSH_TASKS
+  requests, JQ_STATS_FLUSH_NS nanoseconds or before going to sleep.
+  Segment is never unmapped: workers may still hold slots of unpublished
+  one, they just stop updating it.
+-----------------------------------------------------------------------------*/
+
+#define JQ_STATS_FLUSH_TASKS 256
+#define JQ_STATS_FLUSH_NS (10 * 1000000ULL)
+
+volatile int jq_stats_enabled = 0;
+volatile unsigned jq_stats_generation = 0;
+
+static jq_stats_segment* segment = NULL;
+static char* segment_name = NULL;
+static jq_lock_t segment_lock = JQ_LOCK_INITIALIZER;
+
+/** Counts of current thread not yet added to slot. */
+static JQ_THREAD_LOCAL struct {
+  jq_stats_worker* slot;
+  uint64_t tasks;
+  uint64_t histogram[JQ_STATS_BUCKETS];
+  uint64_t flushed;
+} pending;
+
+static inline void jq_stats_lock_slot( jq_stats_worker* slot ) {
+  while( jq_atomic_cas( &slot->writer, 0, 1 ) != 0 );
+}
+
+static inline int jq_stats_trylock_slot( jq_stats_worker* slot ) {
+  return jq_atomic_cas( &slot->writer, 0, 1 ) == 0;
+}
+
+static inline void jq_stats_unlock_slot( jq_stats_worker* slot ) {
+  jq_atomic_barrier();
+  slot->writer = 0;
+}
+
+static inline void jq_stats_write_begin( jq_stats_worker* slot ) {
+  slot->seq++;
+  jq_atomic_barrier();
+}
+
+static inline void jq_stats_write_end( jq_stats_worker* slot ) {
+  jq_atomic_barrier();
+  slot->seq++;
+}
+
+static inline int jq_stats_bucket( uint64_t wait_ns ) {
+  uint64_t us = wait_ns / 1000;
+  int bucket = 0;
+  
+  while( us && bucket < JQ_STATS_BUCKETS - 1 ) {
+    us >>= 1;
+    bucket++;
+  }
+  
+  return bucket;
+}
+
+/*-----------------------------------------------------------------------------
+  Private.
+-----------------------------------------------------------------------------*/
+
+uint64_t jq_stats_now() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+jq_stats_worker* jq_stats_claim( const char* name, unsigned generation ) {
+  jq_stats_worker* slot = NULL;
+  size_t i;
+  
+  jq_lock( &segment_lock );
+  
+  if( jq_stats_enabled && generation == jq_stats_generation ) {
+    for( i = 0; i < JQ_STATS_WORKERS; ++i ) {
+      if( !segment->worker[i].used ) {
+        slot = &segment->worker[i];
+        break;
+      }
+    }
+  }
+  
+  if( slot ) {
+    jq_stats_lock_slot( slot );
+    jq_stats_write_begin( slot );
+    
+    memset( (char*)slot + offsetof(jq_stats_worker, used), 0,
+      sizeof(*slot) - offsetof(jq_stats_worker, used) );
+    
+    slot->used = 1;
+    strncpy( slot->name, name, JQ_STATS_NAME_SIZE - 1 );
+    slot->updated = jq_stats_now();
+    
+    jq_stats_write_end( slot );
+    jq_stats_unlock_slot( slot );
+  }
+  
+  jq_unlock( &segment_lock );
+  
+  return slot;
+}
+
+void jq_stats_release( jq_stats_worker* slot, unsigned generation ) {
+  jq_lock( &segment_lock );
+  
+  if( generation == jq_stats_generation ) {
+    jq_stats_lock_slot( slot );
+    jq_stats_write_begin( slot );
+    slot->used = 0;
+    jq_stats_write_end( slot );
+    jq_stats_unlock_slot( slot );
+  }
+  
+  jq_unlock( &segment_lock );
+}
+
+int jq_stats_record( jq_stats_worker* slot, uint64_t enqueued ) {
+  uint64_t now = jq_stats_now();
+  
+  if( pending.slot != slot ) {
+    memset( &pending, 0, sizeof(pending) );
+    pending.slot = slot;
+    pending.flushed = now;
+  }
+  
+  pending.tasks++;
+  pending.histogram[enqueued && now > enqueued ? jq_stats_bucket( now - enqueued ) : 0]++;
+  
+  return pending.tasks >= JQ_STATS_FLUSH_TASKS || now - pending.flushed >= JQ_STATS_FLUSH_NS;
+}
+
+int jq_stats_pending( jq_stats_worker* slot ) {
+  return pending.slot == slot && pending.tasks > 0;
+}
+
+void jq_stats_flush( jq_stats_worker* slot, const jq_stats_gauges* gauges ) {
+  size_t i;
+  
+  /* Other thread is writing: counts stay pending till next time. */
+  if( !jq_stats_trylock_slot( slot ) )
+    return;
+  
+  jq_stats_write_begin( slot );
+  
+  if( pending.slot == slot ) {
+    slot->tasks += pending.tasks;
+    pending.tasks = 0;
+    
+    for( i = 0; i < JQ_STATS_BUCKETS; ++i ) {
+      slot->wait_histogram[i] += pending.histogram[i];
+      pending.histogram[i] = 0;
+    }
+  }
+  
+  slot->queue_length = gauges->queue_length;
+  slot->queues = gauges->queues;
+  slot->requested_threads = gauges->requested_threads;
+  slot->launched_threads = gauges->launched_threads;
+  slot->working_threads = gauges->working_threads;
+  slot->sleeping_threads = gauges->sleeping_threads;
+  slot->updated = jq_stats_now();
+  
+  jq_stats_write_end( slot );
+  jq_stats_unlock_slot( slot );
+  
+  pending.flushed = slot->updated;
+}
+
+/*-----------------------------------------------------------------------------
+  Public.
+-----------------------------------------------------------------------------*/
+
+int jq_stats_publish( const char* name ) {
+  char default_name[32];
+  jq_stats_segment* published;
+  int fd;
+  
+  if( !name ) {
+    snprintf( default_name, sizeof(default_name), "/jq-stats-%d", (int)getpid() );
+    name = default_name;
+  }
+  
+  jq_stats_unpublish();
+  
+  /* Segment of previous run with the same name is replaced. */
+  shm_unlink( name );
+  
+  if( (fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0644 )) < 0 )
+    return 0;
+  
+  if( ftruncate( fd, sizeof(jq_stats_segment) ) != 0 ) {
+    close( fd );
+    shm_unlink( name );
+    return 0;
+  }
+  
+  published = (jq_stats_segment*)mmap( NULL, sizeof(jq_stats_segment),
+    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  
+  if( published == MAP_FAILED ) {
+    shm_unlink( name );
+    return 0;
+  }
+  
+  published->version = JQ_STATS_VERSION;
+  published->pid = (uint32_t)getpid();
+  published->workers = JQ_STATS_WORKERS;
+  jq_atomic_barrier();
+  published->magic = JQ_STATS_MAGIC;
+  
+  jq_lock( &segment_lock );
+  segment = published;
+  segment_name = strdup( name );
+  jq_stats_generation++;
+  jq_stats_enabled = 1;
+  jq_unlock( &segment_lock );
+  
+  return 1;
+}
+
+void jq_stats_unpublish() {
+  jq_lock( &segment_lock );
+  
+  if( segment_name ) {
+    shm_unlink( segment_name );
+    free( segment_name );
+  }
+  
+  segment_name = NULL;
+  jq_stats_enabled = 0;
+  jq_stats_generation++;
+  
+  jq_unlock( &segment_lock );
+}
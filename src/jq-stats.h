@@ -0,0 +1,85 @@
+#ifndef _JQ_STATS_H_
+#define _JQ_STATS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*-----------------------------------------------------------------------------
+  Layout of stats segment published by jq_stats_publish.
+  Each worker slot is guarded by seqlock: writer makes seq odd, updates
+  slot and makes seq even again. Reader copies slot and retries if seq was
+  odd or changed meanwhile, so it never blocks or disturbs the writer.
+-----------------------------------------------------------------------------*/
+
+#define JQ_STATS_MAGIC 0x4A515354
+#define JQ_STATS_VERSION 1
+
+#define JQ_STATS_WORKERS 64
+#define JQ_STATS_NAME_SIZE 16
+
+/**
+  Queue wait histogram: bucket 0 counts waits under 1 microsecond,
+  bucket i waits in [2^(i-1), 2^i) microseconds, the last one the rest.
+*/
+#define JQ_STATS_BUCKETS 32
+
+typedef struct jq_stats_worker jq_stats_worker;
+typedef struct jq_stats_segment jq_stats_segment;
+
+struct jq_stats_worker {
+  /** Seqlock counter, odd while slot is written. */
+  volatile uint32_t seq;
+  
+  /** Lock of writers, flushing threads only try it. */
+  volatile uint32_t writer;
+  
+  /** Slot belongs to live worker. */
+  uint32_t used;
+  
+  char name[JQ_STATS_NAME_SIZE];
+  
+  /** Gauges sampled at last update. */
+  uint64_t queue_length;
+  uint64_t queues;
+  uint64_t requested_threads;
+  uint64_t launched_threads;
+  uint64_t working_threads;
+  uint64_t sleeping_threads;
+  
+  /** Requests executed so far. */
+  uint64_t tasks;
+  
+  uint64_t wait_histogram[JQ_STATS_BUCKETS];
+  
+  /** CLOCK_MONOTONIC time of last update, nanoseconds. */
+  uint64_t updated;
+} __attribute__((aligned(64)));
+
+struct jq_stats_segment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t workers;
+  
+  jq_stats_worker worker[JQ_STATS_WORKERS];
+};
+
+/** Consistent copy of slot. Returns 0 if writer didn't let it in tries. */
+static inline int jq_stats_read_worker( const jq_stats_worker* slot, jq_stats_worker* copy, int tries ) {
+  while( tries-- > 0 ) {
+    uint32_t seq = slot->seq;
+    
+    if( seq & 1 ) continue;
+    
+    __sync_synchronize();
+    memcpy( copy, (const void*)slot, sizeof(*copy) );
+    __sync_synchronize();
+    
+    if( slot->seq == seq )
+      return 1;
+  }
+  
+  return 0;
+}
+
+#endif /* ndef _JQ_STATS_H_ */
@@ -0,0 +1,291 @@
+#include "jq-private.h"
+#include <stdlib.h>
+
+/*-----------------------------------------------------------------------------
+  Internals.
+  Each thread executing reqs owns slot telling what it runs and since when,
+  guarded by seqlock as stats slots are. Watchdog thread scans slots every
+  quarter of budget; execution is identified by id which nested dispatch
+  saves and restores with the rest of state, so it's reported once however
+  many reqs it helps with. Compensation is for thread being occupied, so
+  it ends with outermost execution rather than with any nested one.
+  Slots are removed under slots_mutex, so worker of listed slot still has
+  a working thread and can't be deallocated while watchdog uses it.
+-----------------------------------------------------------------------------*/
+
+#define JQ_WATCHDOG_MAX_PERIOD_MS 100
+
+struct jq_watchdog_slot {
+  jq_watchdog_slot* next;
+  
+  /** Worker of thread, NULL for other threads. */
+  jq_worker_t worker;
+  
+  /** Seqlock counter, odd while fields below are written. */
+  volatile unsigned seq;
+  
+  /** Running handler, NULL if idle. */
+  volatile jq_handler_t handler;
+  volatile uint64_t started;
+  volatile uint64_t enqueued;
+  
+  /** Id of running execution and of outermost one it's nested in. */
+  volatile unsigned execution;
+  volatile unsigned outer;
+  
+  /** Used by owning thread only: last id given. */
+  unsigned executions;
+  
+  /** Used by watchdog thread only: id of last reported execution. */
+  unsigned reported;
+  
+  /** Worker runs extra thread until compensated_outer ends. */
+  int compensated;
+  unsigned compensated_outer;
+};
+
+volatile int jq_watchdog_enabled = 0;
+
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static jq_watchdog_slot* slots = NULL;
+
+static JQ_THREAD_LOCAL jq_watchdog_slot* current_slot = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+/* Watchdog thread and its settings, changed only while it's stopped. */
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t watchdog_thread;
+static volatile int watchdog_stop = 0;
+static int watchdog_running = 0;
+static uint64_t budget_ns;
+static int period_ms;
+static jq_watchdog_t report;
+static void* report_arg;
+
+static inline void jq_watchdog_write( jq_watchdog_slot* slot, const jq_watchdog_state* state, unsigned outer ) {
+  slot->seq++;
+  jq_atomic_barrier();
+  slot->handler = state->handler;
+  slot->started = state->started;
+  slot->enqueued = state->enqueued;
+  slot->execution = state->execution;
+  slot->outer = outer;
+  jq_atomic_barrier();
+  slot->seq++;
+}
+
+/* End compensation of slot's execution. Called with slots_mutex held. */
+static void jq_watchdog_lockless_uncompensate( jq_watchdog_slot* slot ) {
+  if( slot->compensated ) {
+    slot->compensated = 0;
+    jq_worker_compensate( slot->worker, -1 );
+  }
+}
+
+/* Unlink and free slot. */
+static void jq_watchdog_remove( jq_watchdog_slot* slot ) {
+  jq_watchdog_slot** p;
+  
+  pthread_mutex_lock( &slots_mutex );
+  
+  for( p = &slots; *p; p = &(*p)->next ) {
+    if( *p == slot ) {
+      *p = slot->next;
+      break;
+    }
+  }
+  
+  jq_watchdog_lockless_uncompensate( slot );
+  
+  pthread_mutex_unlock( &slots_mutex );
+  
+  free( slot );
+}
+
+static void jq_watchdog_slot_exit( void* slot ) {
+  jq_watchdog_remove( (jq_watchdog_slot*)slot );
+}
+
+static void jq_watchdog_slot_key_init() {
+  pthread_key_create( &slot_key, jq_watchdog_slot_exit );
+}
+
+static jq_watchdog_slot* jq_watchdog_slot_get() {
+  jq_watchdog_slot* slot = current_slot;
+  
+  if( slot ) return slot;
+  
+  pthread_once( &slot_key_once, jq_watchdog_slot_key_init );
+  
+  slot = (jq_watchdog_slot*)calloc( 1, sizeof(jq_watchdog_slot) );
+  if( !slot ) return NULL;
+  
+  slot->worker = jq_worker_current();
+  
+  if( pthread_setspecific( slot_key, slot ) != 0 ) {
+    free( slot );
+    return NULL;
+  }
+  
+  pthread_mutex_lock( &slots_mutex );
+  slot->next = slots;
+  slots = slot;
+  pthread_mutex_unlock( &slots_mutex );
+  
+  current_slot = slot;
+  return slot;
+}
+
+/* Check one slot, called with slots_mutex held. */
+static void jq_watchdog_check( jq_watchdog_slot* slot, uint64_t now ) {
+  unsigned seq = slot->seq;
+  jq_handler_t handler;
+  uint64_t started, enqueued;
+  unsigned execution, outer;
+  
+  /* Being written - checked next time. */
+  if( seq & 1 ) return;
+  
+  jq_atomic_barrier();
+  handler = slot->handler;
+  started = slot->started;
+  enqueued = slot->enqueued;
+  execution = slot->execution;
+  outer = slot->outer;
+  jq_atomic_barrier();
+  
+  if( slot->seq != seq ) return;
+  
+  if( slot->compensated && (!handler || slot->compensated_outer != outer) )
+    jq_watchdog_lockless_uncompensate( slot );
+  
+  if( !handler || slot->reported == execution || now < started || now - started < budget_ns )
+    return;
+  
+  slot->reported = execution;
+  
+  if( report ) {
+    report( report_arg, handler, (unsigned)((now - started) / 1000000),
+      enqueued && started > enqueued ? (unsigned)((started - enqueued) / 1000000) : 0 );
+  }
+  
+  if( slot->worker && !slot->compensated && jq_worker_compensate( slot->worker, 1 ) ) {
+    slot->compensated = 1;
+    slot->compensated_outer = outer;
+  }
+}
+
+static void* jq_watchdog_main( void* arg ) {
+  jq_watchdog_slot* slot;
+  
+  while( !watchdog_stop ) {
+    jq_futex_wait( &watchdog_stop, 0, period_ms );
+    
+    pthread_mutex_lock( &slots_mutex );
+    
+    for( slot = slots; slot; slot = slot->next )
+      jq_watchdog_check( slot, jq_stats_now() );
+    
+    pthread_mutex_unlock( &slots_mutex );
+  }
+  
+  return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+  Private.
+-----------------------------------------------------------------------------*/
+
+jq_watchdog_slot* jq_watchdog_enter( jq_handler_t handler, uint64_t enqueued, jq_watchdog_state* saved ) {
+  jq_watchdog_slot* slot = jq_watchdog_slot_get();
+  jq_watchdog_state state;
+  
+  if( slot ) {
+    saved->handler = slot->handler;
+    saved->started = slot->started;
+    saved->enqueued = slot->enqueued;
+    saved->execution = slot->execution;
+    
+    state.handler = handler;
+    state.started = jq_stats_now();
+    state.enqueued = enqueued;
+    state.execution = ++slot->executions;
+    
+    /* Idle thread starts outermost execution. */
+    jq_watchdog_write( slot, &state, saved->handler ? slot->outer : state.execution );
+  }
+  
+  return slot;
+}
+
+/* Outer execution goes on with its id: it's not new one. */
+void jq_watchdog_leave( jq_watchdog_slot* slot, const jq_watchdog_state* saved ) {
+  jq_watchdog_write( slot, saved, slot->outer );
+}
+
+void jq_watchdog_thread_exit() {
+  jq_watchdog_slot* slot = current_slot;
+  
+  if( slot ) {
+    current_slot = NULL;
+    pthread_setspecific( slot_key, NULL );
+    jq_watchdog_remove( slot );
+  }
+}
+
+/*-----------------------------------------------------------------------------
+  Public.
+-----------------------------------------------------------------------------*/
+
+int jq_watchdog_start( unsigned budget_ms, jq_watchdog_t callback, void* arg ) {
+  int res = 0;
+  
+  pthread_mutex_lock( &control_mutex );
+  
+  if( !watchdog_running ) {
+    budget_ns = (uint64_t)budget_ms * 1000000;
+    period_ms = budget_ms / 4;
+    
+    if( period_ms < 1 ) period_ms = 1;
+    if( period_ms > JQ_WATCHDOG_MAX_PERIOD_MS ) period_ms = JQ_WATCHDOG_MAX_PERIOD_MS;
+    
+    report = callback;
+    report_arg = arg;
+    watchdog_stop = 0;
+    
+    if( pthread_create( &watchdog_thread, NULL, jq_watchdog_main, NULL ) == 0 ) {
+      watchdog_running = 1;
+      jq_watchdog_enabled = 1;
+      res = 1;
+    }
+  }
+  
+  pthread_mutex_unlock( &control_mutex );
+  
+  return res;
+}
+
+void jq_watchdog_stop() {
+  jq_watchdog_slot* slot;
+  
+  pthread_mutex_lock( &control_mutex );
+  
+  if( watchdog_running ) {
+    jq_watchdog_enabled = 0;
+    
+    watchdog_stop = 1;
+    jq_futex_wake( &watchdog_stop, 1 );
+    pthread_join( watchdog_thread, NULL );
+    watchdog_running = 0;
+    
+    pthread_mutex_lock( &slots_mutex );
+    
+    for( slot = slots; slot; slot = slot->next )
+      jq_watchdog_lockless_uncompensate( slot );
+    
+    pthread_mutex_unlock( &slots_mutex );
+  }
+  
+  pthread_mutex_unlock( &control_mutex );
+}
@@ -1,5 +1,13 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "jq-private.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
 
 /*-----------------------------------------------------------------------------
   Internals.
@@ -11,7 +19,37 @@
 #define LOG( a )
 #endif
 
+/** Number of reader counts threads of worker are spread over. */
+#define JQ_WORKER_READER_SHARDS 16
+
 typedef struct jq_worker jq_worker;
+typedef struct jq_worker_queue jq_worker_queue;
+typedef struct jq_worker_readers jq_worker_readers;
+typedef struct jq_helper jq_helper;
+
+/** Queue served by worker. */
+struct jq_worker_queue {
+  jq_queue_t queue;
+  
+  /** Number of reqs taken from queue per scheduling round. */
+  volatile size_t weight;
+  
+  /** Wakes worker threads when reqs are put to queue. */
+  jq_watcher watcher;
+};
+
+/** Thread blocked in jq_worker_help on empty queues, lives on its stack. */
+struct jq_helper {
+  jq_helper* next;
+  jq_wake_t wake;
+  void* object;
+};
+
+/** Threads reading served queues without queues_lock, one cache line. */
+struct jq_worker_readers {
+  volatile size_t count;
+  char padding[JQ_CACHE_LINE - sizeof(size_t)];
+};
 
 struct jq_worker {
   jq_object object;
@@ -20,7 +58,7 @@ struct jq_worker {
   jq_queue_t queue;
   
   /* Spinlock for counters. */
-  pthread_spinlock_t lock;
+  jq_lock_t lock;
   
   /**
     Number of threads requested by client.
@@ -38,15 +76,353 @@ struct jq_worker {
     This counter increments each time thread created and decrements when thread actually stopped.
   */
   size_t working_threads;
+  
+  /**
+    Served queues. The first one is always worker->queue.
+    Reqs are taken from them in deficit round robin order.
+  */
+  jq_worker_queue** volatile queues;
+  volatile size_t queues_count;
+  size_t queues_capacity;
+  
+  /** Spinlock for queues, taken by their changes and by slow readers. */
+  jq_lock_t queues_lock;
+  
+  /**
+    Threads picking reqs don't take queues_lock: each one counts itself in
+    shard of its index while reading queues, so picks from different queues
+    share no lock. Rare changes set writing and wait till shards drain.
+  */
+  jq_worker_readers readers[JQ_WORKER_READER_SHARDS];
+  volatile int writing;
+  
+  /** Incremented each time req is put to any served queue. Futex word. */
+  volatile int events;
+  
+  /** Number of threads sleeping on events. */
+  volatile size_t sleepers;
+  
+  /** Attributes of started threads. */
+  pthread_attr_t attr;
+  
+  /** Thread name prefix or NULL. */
+  char* name;
+  
+  /** Number of threads ever started, used for names. */
+  volatile size_t started_threads;
+  
+  /** Number of started threads which haven't reached loop yet. */
+  size_t starting_threads;
+  
+  /** Start threads on demand, see jq_worker_config. */
+  int lazy;
+  
+  /**
+    Spawn of lazy worker and wake up of helpers, deferred by queue watcher
+    till queue is unlocked. Pending call is deferred only once; deferrals
+    counts deferred calls not yet done, worker is not deallocated until
+    they are.
+  */
+  jq_deferred spawn;
+  volatile int spawn_pending;
+  jq_deferred wake;
+  volatile int wake_pending;
+  volatile size_t deferrals;
+  
+  /** Helping threads sleeping on their waited objects. */
+  jq_helper* volatile helpers;
+  jq_lock_t helpers_lock;
+  
+  /** Worker is destroyed - no more threads are started. */
+  int stopping;
+  
+  /** Threads run instead of stalled ones, up to stall_threads. */
+  size_t extra_threads;
+  size_t stall_threads;
+  
+  /** Thread hooks, see jq_worker_config. */
+  jq_thread_init_t thread_init;
+  jq_thread_exit_t thread_exit;
+  void* thread_arg;
+  
+  /** Thread indices in use, see jq_worker_thread_index. */
+  unsigned char* indices;
+  size_t indices_capacity;
+  
+  /** Lanes of keyed requests, created on first use. */
+  jq_lanes* volatile lanes;
+  size_t lanes_count;
+  
+  /** Slot in stats segment of stats_generation, see jq_stats_publish. */
+  jq_stats_worker* stats;
+  unsigned stats_generation;
 };
 
+/** Worker owning current thread. */
+static JQ_THREAD_LOCAL jq_worker* current_worker = NULL;
+
+/** Index and slot of current worker thread. */
+static JQ_THREAD_LOCAL int thread_index = -1;
+static JQ_THREAD_LOCAL void* thread_slot = NULL;
+
+/** Nesting of jq_worker_help on current thread. */
+static JQ_THREAD_LOCAL int help_depth = 0;
+
+/** Deficit round robin state of current thread: queue and its deficit. */
+static JQ_THREAD_LOCAL size_t drr_current = 0;
+static JQ_THREAD_LOCAL size_t drr_deficit = 0;
+
 /* Destruct and dealloc worker. */
 static void jq_worker_dealloc( jq_worker* worker ) {
+  size_t i;
+  
+  for( i = 0; i < worker->queues_count; ++i )
+    jq_queue_unwatch( worker->queues[i]->queue, &worker->queues[i]->watcher );
+  
+  /* No more calls can be deferred, wait for ones which are. */
+  while( worker->deferrals )
+    sched_yield();
+  
+  for( i = 0; i < worker->queues_count; ++i ) {
+    jq_release( worker->queues[i]->queue );
+    free( worker->queues[i] );
+  }
+  
+  if( worker->stats )
+    jq_stats_release( worker->stats, worker->stats_generation );
+  
+  if( worker->lanes )
+    jq_lanes_destroy( worker->lanes );
+  
+  free( worker->queues );
+  free( worker->indices );
+  free( worker->name );
   jq_release( worker->queue );
-  pthread_spin_destroy( &worker->lock );
+  pthread_attr_destroy( &worker->attr );
+  jq_lock_destroy( &worker->helpers_lock );
+  jq_lock_destroy( &worker->queues_lock );
+  jq_lock_destroy( &worker->lock );
   free( worker );
 }
 
+/*
+  Queue watcher callback. Thread of lazy worker is spawned and helpers are
+  woken after unlock.
+*/
+static jq_deferred* jq_worker_notify( void* arg ) {
+  jq_worker* worker = (jq_worker*)arg;
+  jq_deferred* deferred = NULL;
+  
+  /* Full barrier: either helper sees new event or it's seen here. */
+  jq_atomic_add( &worker->events, 1 );
+  
+  if( worker->helpers && jq_atomic_cas( &worker->wake_pending, 0, 1 ) == 0 ) {
+    jq_atomic_add( &worker->deferrals, 1 );
+    worker->wake.next = NULL;
+    deferred = &worker->wake;
+  }
+  
+  if( worker->sleepers ) {
+    jq_futex_wake( &worker->events, 1 );
+  }
+  else if( worker->lazy && jq_atomic_cas( &worker->spawn_pending, 0, 1 ) == 0 ) {
+    jq_atomic_add( &worker->deferrals, 1 );
+    worker->spawn.next = deferred;
+    deferred = &worker->spawn;
+  }
+  
+  return deferred;
+}
+
+/* Sleep until events counter changes. */
+static void jq_worker_sleep( jq_worker* worker, int events ) {
+  jq_atomic_add( &worker->sleepers, 1 );
+  
+  if( worker->events == events )
+    jq_futex_wait( &worker->events, events, -1 );
+  
+  jq_atomic_sub( &worker->sleepers, 1 );
+}
+
+/* Start reading queues without queues_lock. */
+static jq_worker_readers* jq_worker_read_begin( jq_worker* worker ) {
+  jq_worker_readers* readers = &worker->readers[thread_index >= 0 ? thread_index % JQ_WORKER_READER_SHARDS : 0];
+  
+  while( 1 ) {
+    /* Full barrier: either writer sees the count or it's seen here. */
+    jq_atomic_add( &readers->count, 1 );
+    
+    if( !worker->writing )
+      return readers;
+    
+    jq_atomic_sub( &readers->count, 1 );
+    
+    while( worker->writing )
+      sched_yield();
+  }
+}
+
+static inline void jq_worker_read_end( jq_worker_readers* readers ) {
+  jq_atomic_sub( &readers->count, 1 );
+}
+
+/* Exclude readers of queues. Called with queues_lock held. */
+static void jq_worker_write_begin( jq_worker* worker ) {
+  size_t i;
+  
+  worker->writing = 1;
+  jq_atomic_barrier();
+  
+  for( i = 0; i < JQ_WORKER_READER_SHARDS; ++i ) {
+    while( worker->readers[i].count )
+      sched_yield();
+  }
+}
+
+static inline void jq_worker_write_end( jq_worker* worker ) {
+  jq_atomic_barrier();
+  worker->writing = 0;
+}
+
+/*
+  Take next req from served queues using deficit round robin:
+  each time queue's turn comes its deficit is set to its weight,
+  and every req taken from it costs one. Each thread keeps its own round,
+  so weights hold for worker as a whole. Quit reqs of worker's queue
+  are skipped unless take_quit is set.
+*/
+static jq_req* jq_worker_pick( jq_worker* worker, jq_queue_t* from, int take_quit ) {
+  jq_worker_readers* readers;
+  jq_req* req = NULL;
+  size_t tries, count;
+  
+  /* Single queue - nothing to schedule. Worker's queue is never detached. */
+  if( worker->queues_count == 1 ) {
+    *from = worker->queue;
+    return jq_queue_take( worker->queue, take_quit );
+  }
+  
+  readers = jq_worker_read_begin( worker );
+  count = worker->queues_count;
+  
+  /* Queues were detached since. */
+  if( drr_current >= count ) {
+    drr_current = 0;
+    drr_deficit = 0;
+  }
+  
+  /* Two passes give every queue a fresh quantum. */
+  for( tries = 0; tries <= 2 * count; ++tries ) {
+    jq_worker_queue* wq = worker->queues[drr_current];
+    
+    /* Only quit reqs of worker's own queue are for its threads. */
+    if( drr_deficit > 0 && (req = jq_queue_take( wq->queue, take_quit && wq->queue == worker->queue )) ) {
+      drr_deficit--;
+      *from = wq->queue;
+      break;
+    }
+    
+    drr_current = (drr_current + 1) % count;
+    drr_deficit = worker->queues[drr_current]->weight;
+  }
+  
+  jq_worker_read_end( readers );
+  
+  return req;
+}
+
+/* Worker's slot in published stats segment, claimed on first use. */
+static jq_stats_worker* jq_worker_stats_slot( jq_worker* worker ) {
+  unsigned generation = jq_stats_generation;
+  
+  if( worker->stats_generation != generation ) {
+    jq_lock( &worker->lock );
+    
+    if( worker->stats_generation != generation ) {
+      worker->stats = jq_stats_claim( worker->name ? worker->name : "worker", generation );
+      worker->stats_generation = generation;
+    }
+    
+    jq_unlock( &worker->lock );
+  }
+  
+  return worker->stats;
+}
+
+/* Add counts of current thread to worker's stats with fresh gauges. */
+static void jq_worker_publish( jq_worker* worker, jq_stats_worker* slot ) {
+  jq_stats_gauges gauges;
+  size_t i;
+  
+  gauges.queue_length = 0;
+  
+  jq_lock( &worker->queues_lock );
+  
+  for( i = 0; i < worker->queues_count; ++i )
+    gauges.queue_length += jq_queue_get_length( worker->queues[i]->queue );
+  
+  gauges.queues = worker->queues_count;
+  
+  jq_unlock( &worker->queues_lock );
+  
+  gauges.requested_threads = worker->requested_threads;
+  gauges.launched_threads = worker->launched_threads;
+  gauges.working_threads = worker->working_threads;
+  gauges.sleeping_threads = worker->sleepers;
+  
+  jq_stats_flush( slot, &gauges );
+}
+
+/*
+  Execute req taken from queue, counting it in stats if they are published.
+  Lane runner isn't counted: reqs it dispatches are.
+*/
+static void jq_worker_dispatch( jq_worker* worker, jq_queue_t queue, jq_req* req, jq_req_source* source ) {
+  uint64_t enqueued = req->enqueued;
+  int counted = req->handler != jq_lane_run;
+  jq_stats_worker* slot;
+  
+  jq_queue_dispatch( queue, req, source );
+  
+  if( jq_stats_enabled && counted && (slot = jq_worker_stats_slot( worker )) ) {
+    if( jq_stats_record( slot, enqueued ) )
+      jq_worker_publish( worker, slot );
+  }
+}
+
+/* Serve queues until quit req is taken. */
+static void jq_worker_loop( jq_worker* worker ) {
+  while( 1 ) {
+    int events = worker->events;
+    jq_queue_t queue;
+    jq_req* req = jq_worker_pick( worker, &queue, 1 );
+    
+    if( !req ) {
+      /*
+        Idle worker still shows what it has done. Flush is skipped while
+        other thread writes the slot, so retry: counts left now would stay
+        unpublished for all the sleep.
+      */
+      while( jq_stats_enabled && worker->stats && jq_stats_pending( worker->stats ) ) {
+        jq_worker_publish( worker, worker->stats );
+        
+        if( jq_stats_pending( worker->stats ) )
+          sched_yield();
+      }
+      
+      jq_worker_sleep( worker, events );
+      continue;
+    }
+    
+    if( jq_req_is_quit( req ) ) {
+      jq_req_destroy( req );
+      break;
+    }
+    
+    jq_worker_dispatch( worker, queue, req, NULL );
+  }
+}
+
 /* Is is good to dealloc worker now? */
 static int jq_worker_can_dealloc( jq_worker* worker ) {
   return worker->object.refs < 1 && worker->working_threads < 1;
@@ -61,25 +437,108 @@ static void jq_worker_dealloc_if_possible( jq_worker* worker ) {
 /* Called by working thread when it's ready to work. */
 static inline void jq_worker_thread_added( jq_worker* worker ) {
   LOG(( "jq_worker_thread_added\n" ));
+  
+  jq_lock( &worker->lock );
+  worker->starting_threads--;
+  jq_unlock( &worker->lock );
+}
+
+static void jq_worker_set_thread_name( jq_worker* worker ) {
+  char name[16];
+  size_t index = jq_atomic_add( &worker->started_threads, 1 );
+  
+  if( !worker->name ) return;
+  
+  /* Linux limits names to 15 characters. */
+  snprintf( name, sizeof(name), "%.10s-%lu", worker->name, (unsigned long)index );
+  
+#if defined(__linux__)
+  pthread_setname_np( pthread_self(), name );
+#elif defined(__APPLE__)
+  pthread_setname_np( name );
+#endif
+}
+
+/* Take the lowest free thread index, -1 if out of memory. */
+static int jq_worker_take_index( jq_worker* worker ) {
+  size_t index;
+  
+  jq_lock( &worker->lock );
+  
+  for( index = 0; index < worker->indices_capacity && worker->indices[index]; ++index );
+  
+  if( index == worker->indices_capacity ) {
+    size_t capacity = worker->indices_capacity ? worker->indices_capacity * 2 : 16;
+    unsigned char* indices = (unsigned char*)realloc( worker->indices, capacity );
+    
+    if( !indices ) {
+      jq_unlock( &worker->lock );
+      return -1;
+    }
+    
+    memset( indices + worker->indices_capacity, 0, capacity - worker->indices_capacity );
+    worker->indices = indices;
+    worker->indices_capacity = capacity;
+  }
+  
+  worker->indices[index] = 1;
+  
+  jq_unlock( &worker->lock );
+  
+  return (int)index;
+}
+
+/* Run thread_init hook of worker on current thread. */
+static void jq_worker_thread_init( jq_worker* worker ) {
+  thread_index = jq_worker_take_index( worker );
+  
+  if( worker->thread_init )
+    thread_slot = worker->thread_init( worker->thread_arg, thread_index );
+}
+
+/* Run thread_exit hook of worker on current thread. */
+static void jq_worker_thread_exit( jq_worker* worker ) {
+  if( worker->thread_exit )
+    worker->thread_exit( worker->thread_arg, thread_index, thread_slot );
+  
+  thread_slot = NULL;
 }
 
 /* Called by working thread right before it quits. */
 static inline void jq_worker_thread_removed( jq_worker* worker ) {
   LOG(( "jq_worker_thread_removed\n" ));
   
-  pthread_spin_lock( &worker->lock );
+  jq_lock( &worker->lock );
   worker->working_threads--;
-  pthread_spin_unlock( &worker->lock );
+  
+  if( thread_index >= 0 )
+    worker->indices[thread_index] = 0;
+  
+  thread_index = -1;
+  jq_unlock( &worker->lock );
   
   jq_worker_dealloc_if_possible( worker );
 }
 
+static void jq_worker_spawn( jq_worker* worker, size_t reserved );
+
 /* Working thread code. */
 static void* jq_worker_thread_main( void* arg ) {
   jq_worker* worker = (jq_worker*)arg;
   
+  current_worker = worker;
+  
+  jq_worker_set_thread_name( worker );
+  jq_worker_thread_init( worker );
   jq_worker_thread_added( worker );
-  jq_queue_loop( worker->queue );
+  
+  /* Reqs of burst beyond this thread's one need more threads. */
+  if( worker->lazy )
+    jq_worker_spawn( worker, 1 );
+  
+  jq_worker_loop( worker );
+  jq_worker_thread_exit( worker );
+  jq_watchdog_thread_exit();
   jq_worker_thread_removed( worker );
   
   return NULL;
@@ -88,32 +547,124 @@ static void* jq_worker_thread_main( void* arg ) {
 /* Start one thread. */
 static inline int jq_worker_start_thread( jq_worker* worker ) {
   pthread_t t;
+  int res = pthread_create( &t, &worker->attr, jq_worker_thread_main, worker );
+  
+  /* Policy not permitted to process - inherit it instead. */
+  if( res == EPERM ) {
+    pthread_attr_setinheritsched( &worker->attr, PTHREAD_INHERIT_SCHED );
+    res = pthread_create( &t, &worker->attr, jq_worker_thread_main, worker );
+  }
   
-  if( pthread_create( &t, NULL, jq_worker_thread_main, worker ) == 0 ) {
+  if( res == 0 ) {
+    pthread_detach( t );
     worker->working_threads++;
     worker->launched_threads++;
+    worker->starting_threads++;
     return 1;
   }
   
   return 0;
 }
 
-/* Stop one thread. Put quit req to request queue. */
-static inline void jq_worker_stop_thread( jq_worker* worker ) {
-  jq_queue_stop( worker->queue );
-  worker->launched_threads--;
+/* Number of reqs in served queues. */
+static size_t jq_worker_queued( jq_worker* worker ) {
+  size_t queued = 0, i;
+  
+  jq_lock( &worker->queues_lock );
+  
+  for( i = 0; i < worker->queues_count; ++i )
+    queued += jq_queue_get_length( worker->queues[i]->queue );
+  
+  jq_unlock( &worker->queues_lock );
+  
+  return queued;
+}
+
+/*
+  Start one more thread of lazy worker if there is room and queued reqs
+  outnumber threads which will take them: reserved ones (calling thread
+  itself), starting and idle ones. Must not be called under queue lock.
+*/
+static void jq_worker_spawn( jq_worker* worker, size_t reserved ) {
+  size_t queued = jq_worker_queued( worker );
+  
+  jq_lock( &worker->lock );
+  
+  if( !worker->stopping
+    && queued > reserved + worker->starting_threads + worker->sleepers
+    && (worker->launched_threads < worker->requested_threads + worker->extra_threads
+      || worker->launched_threads == 0) )
+  {
+    jq_worker_start_thread( worker );
+  }
+  
+  jq_unlock( &worker->lock );
+}
+
+/* Spawn deferred by jq_worker_notify. */
+static void jq_worker_spawn_deferred( void* arg ) {
+  jq_worker* worker = (jq_worker*)arg;
+  
+  /* Reqs put from now on defer another spawn. */
+  worker->spawn_pending = 0;
+  jq_atomic_barrier();
+  
+  jq_worker_spawn( worker, 0 );
+  jq_atomic_sub( &worker->deferrals, 1 );
+}
+
+/* Wake up of helpers deferred by jq_worker_notify. */
+static void jq_worker_wake_deferred( void* arg ) {
+  jq_worker* worker = (jq_worker*)arg;
+  jq_helper* helper;
+  
+  worker->wake_pending = 0;
+  jq_atomic_barrier();
+  
+  /* Helper stays registered, so its object is alive, while lock is held. */
+  jq_lock( &worker->helpers_lock );
+  
+  for( helper = worker->helpers; helper; helper = helper->next )
+    helper->wake( helper->object );
+  
+  jq_unlock( &worker->helpers_lock );
+  
+  jq_atomic_sub( &worker->deferrals, 1 );
+}
+
+/*
+  Stop count threads by putting quit reqs to request queue. Called after
+  launched_threads was decreased, without worker lock: putting req may
+  spawn thread of lazy worker, which takes the lock.
+*/
+static void jq_worker_stop_threads( jq_worker* worker, size_t count ) {
+  while( count-- > 0 )
+    jq_queue_stop( worker->queue );
 }
 
 /* Start or stop threads to sync requested_threads and launched_threads. */
 static void jq_worker_manage_threads( jq_worker* worker ) {
-  size_t threads;
+  size_t threads, stop = 0;
+  
+  jq_lock( &worker->lock );
   
-  pthread_spin_lock( &worker->lock );
+  if( worker->stopping ) {
+    jq_unlock( &worker->lock );
+    return;
+  }
   
   threads = worker->requested_threads > 1 ? worker->requested_threads : 1;
   
-  while( worker->launched_threads > threads ) {
-    jq_worker_stop_thread( worker );
+  /* Lazy worker starts threads on demand, here they can be only stopped. */
+  if( worker->lazy && worker->launched_threads < threads )
+    threads = worker->launched_threads;
+  
+  /* Extra threads are started right away: stalled ones hold queued reqs. */
+  threads += worker->extra_threads;
+  
+  if( worker->launched_threads > threads ) {
+    stop = worker->launched_threads - threads;
+    worker->launched_threads = threads;
   }
   
   while( worker->launched_threads < threads ) {
@@ -121,26 +672,30 @@ static void jq_worker_manage_threads( jq_worker* worker ) {
       break;
   }
   
-  pthread_spin_unlock( &worker->lock );
+  jq_unlock( &worker->lock );
+  
+  jq_worker_stop_threads( worker, stop );
 }
 
 static void jq_worker_vtable_destroy( void* ptr ) {
   jq_worker_t worker = (jq_worker_t)ptr;
   
-  pthread_spin_lock( &worker->lock );
+  jq_lock( &worker->lock );
   
   if( jq_worker_can_dealloc( worker ) ) {
-    pthread_spin_unlock( &worker->lock );
+    jq_unlock( &worker->lock );
     jq_worker_dealloc( worker );
   }
   else {
-    /* Stop all working threads. */
-    while( worker->launched_threads > 0 ) {
-      worker->launched_threads--;
-      jq_worker_stop_thread( worker );
-    }
+    size_t stop = worker->launched_threads;
+    
+    worker->stopping = 1;
+    worker->launched_threads = 0;
     
-    pthread_spin_unlock( &worker->lock );
+    jq_unlock( &worker->lock );
+    
+    /* Stop all working threads. */
+    jq_worker_stop_threads( worker, stop );
   }
 }
 
@@ -148,21 +703,195 @@ static jq_object_vtable worker_vtable = {
   jq_worker_vtable_destroy
 };
 
+/*-----------------------------------------------------------------------------
+  Private.
+-----------------------------------------------------------------------------*/
+
+void jq_worker_execute( jq_worker_t worker, jq_queue_t queue, jq_req* req, jq_req_source* source ) {
+  jq_worker_dispatch( worker, queue, req, source );
+}
+
+size_t jq_worker_get_queued( jq_worker_t worker ) {
+  return jq_worker_queued( worker );
+}
+
+/*
+  Sleep in wait() on empty queues. Helper is registered meanwhile, so reqs
+  put wake it through wake(). Returns result of wait().
+*/
+static int jq_worker_help_sleep( jq_worker* worker, int events, jq_wait_t wait, jq_helper* helper ) {
+  jq_helper* volatile* p;
+  int done = 0;
+  
+  jq_lock( &worker->helpers_lock );
+  helper->next = worker->helpers;
+  worker->helpers = helper;
+  jq_unlock( &worker->helpers_lock );
+  
+  /* Reqs put before registration are seen here. */
+  jq_atomic_barrier();
+  
+  if( worker->events == events )
+    done = wait( helper->object, JQ_HELP_WAIT_MS );
+  
+  jq_lock( &worker->helpers_lock );
+  
+  for( p = &worker->helpers; *p != helper; p = &(*p)->next );
+  *p = helper->next;
+  
+  jq_unlock( &worker->helpers_lock );
+  
+  return done;
+}
+
+/*
+  Execute reqs of current thread's worker until wait() reports condition
+  satisfied. Returns 0 if current thread is not a worker thread or helps
+  JQ_HELP_MAX_DEPTH times on its stack already: caller blocks then.
+  Quit reqs are left in queue for threads in their loops (this one too,
+  once it returns there), reqs queued after them are still executed.
+*/
+int jq_worker_help( jq_wait_t wait, jq_wake_t wake, void* object ) {
+  jq_worker* worker = current_worker;
+  jq_helper helper;
+  
+  if( !worker || help_depth >= JQ_HELP_MAX_DEPTH ) return 0;
+  
+  helper.wake = wake;
+  helper.object = object;
+  help_depth++;
+  
+  while( !wait( object, 0 ) ) {
+    int events = worker->events;
+    jq_queue_t queue;
+    jq_req* req = jq_worker_pick( worker, &queue, 0 );
+    
+    if( !req ) {
+      if( jq_worker_help_sleep( worker, events, wait, &helper ) )
+        break;
+    }
+    else {
+      jq_worker_dispatch( worker, queue, req, NULL );
+    }
+  }
+  
+  help_depth--;
+  return 1;
+}
+
+size_t jq_worker_get_threads( jq_worker_t worker ) {
+  return worker->requested_threads;
+}
+
+jq_worker_t jq_worker_current() {
+  return current_worker;
+}
+
+int jq_worker_compensate( jq_worker_t worker, int delta ) {
+  jq_lock( &worker->lock );
+  
+  if( delta > 0 && worker->extra_threads >= worker->stall_threads ) {
+    jq_unlock( &worker->lock );
+    return 0;
+  }
+  
+  worker->extra_threads += delta;
+  
+  jq_unlock( &worker->lock );
+  
+  jq_worker_manage_threads( worker );
+  return 1;
+}
+
 /*-----------------------------------------------------------------------------
   Public.
 -----------------------------------------------------------------------------*/
 
+void jq_worker_config_init( jq_worker_config* config ) {
+  memset( config, 0, sizeof(jq_worker_config) );
+  config->threads = 1;
+  config->sched_policy = -1;
+}
+
 jq_worker_t jq_worker_create( jq_queue_t queue, size_t threads ) {
+  jq_worker_config config;
+  
+  jq_worker_config_init( &config );
+  config.threads = threads;
+  
+  return jq_worker_create_ex( queue, &config );
+}
+
+jq_worker_t jq_worker_create_ex( jq_queue_t queue, const jq_worker_config* config ) {
   jq_worker_t worker = (jq_worker_t)malloc( sizeof(jq_worker) );
   
   if( worker ) {
     jq_object_init( &worker->object, &worker_vtable );
     
-    worker->requested_threads = threads;
+    worker->requested_threads = config->threads;
     worker->launched_threads = 0;
     worker->working_threads = 0;
+    worker->started_threads = 0;
+    worker->starting_threads = 0;
+    worker->lazy = config->lazy;
+    worker->spawn.next = NULL;
+    worker->spawn.call = jq_worker_spawn_deferred;
+    worker->spawn.arg = worker;
+    worker->spawn_pending = 0;
+    worker->wake.next = NULL;
+    worker->wake.call = jq_worker_wake_deferred;
+    worker->wake.arg = worker;
+    worker->wake_pending = 0;
+    worker->deferrals = 0;
+    worker->helpers = NULL;
+    worker->stopping = 0;
+    worker->extra_threads = 0;
+    worker->stall_threads = config->stall_threads;
+    worker->thread_init = config->thread_init;
+    worker->thread_exit = config->thread_exit;
+    worker->thread_arg = config->thread_arg;
+    worker->indices = NULL;
+    worker->indices_capacity = 0;
+    worker->lanes = NULL;
+    worker->lanes_count = config->lanes ? config->lanes : JQ_WORKER_LANES;
+    
+    worker->queues = NULL;
+    worker->queues_count = 0;
+    worker->queues_capacity = 0;
+    worker->writing = 0;
+    memset( worker->readers, 0, sizeof(worker->readers) );
+    worker->events = 0;
+    worker->sleepers = 0;
+    worker->name = NULL;
+    worker->stats = NULL;
+    worker->stats_generation = 0;
+    
+    jq_lock_init( &worker->lock );
+    jq_lock_init( &worker->queues_lock );
+    jq_lock_init( &worker->helpers_lock );
+    pthread_attr_init( &worker->attr );
+    
+    if( config->stack_size )
+      pthread_attr_setstacksize( &worker->attr, config->stack_size );
+    
+    if( config->guard_size )
+      pthread_attr_setguardsize( &worker->attr, config->guard_size );
     
-    pthread_spin_init( &worker->lock, 0 );
+    if( config->sched_policy >= 0 ) {
+      struct sched_param param;
+      
+      memset( &param, 0, sizeof(param) );
+      param.sched_priority = config->sched_priority;
+      
+      pthread_attr_setinheritsched( &worker->attr, PTHREAD_EXPLICIT_SCHED );
+      pthread_attr_setschedpolicy( &worker->attr, config->sched_policy );
+      pthread_attr_setschedparam( &worker->attr, &param );
+    }
+    
+    if( config->name && !(worker->name = strdup( config->name )) ) {
+      worker->queue = NULL;
+      goto fail;
+    }
     
     if( queue ) {
       jq_retain( queue );
@@ -175,12 +904,21 @@ jq_worker_t jq_worker_create( jq_queue_t queue, size_t threads ) {
         goto fail;
     }
     
-    /* Launch threads. */
-    jq_worker_manage_threads( worker );
-    
-    /* If no threads running - we can't operate normally. */
-    if( worker->launched_threads < 1 )
+    if( !jq_worker_attach( worker, worker->queue, 1 ) )
       goto fail;
+    
+    if( worker->lazy ) {
+      /* Queue may already hold reqs. */
+      jq_worker_spawn( worker, 0 );
+    }
+    else {
+      /* Launch threads. */
+      jq_worker_manage_threads( worker );
+      
+      /* If no threads running - we can't operate normally. */
+      if( worker->launched_threads < 1 )
+        goto fail;
+    }
   }
   
   return worker;
@@ -195,6 +933,125 @@ void jq_worker_set_threads( jq_worker_t worker, size_t threads ) {
   jq_worker_manage_threads( worker );
 }
 
+int jq_worker_attach( jq_worker_t worker, jq_queue_t queue, size_t weight ) {
+  jq_worker_queue* wq;
+  size_t i;
+  
+  if( weight < 1 ) weight = 1;
+  
+  jq_lock( &worker->queues_lock );
+  
+  /* Already served - just change weight. */
+  for( i = 0; i < worker->queues_count; ++i ) {
+    if( worker->queues[i]->queue == queue ) {
+      worker->queues[i]->weight = weight;
+      jq_unlock( &worker->queues_lock );
+      return 1;
+    }
+  }
+  
+  if( worker->queues_count == worker->queues_capacity ) {
+    size_t capacity = worker->queues_capacity ? worker->queues_capacity * 2 : 4;
+    jq_worker_queue** queues;
+    
+    /* Readers may be in the old array. */
+    jq_worker_write_begin( worker );
+    queues = (jq_worker_queue**)realloc( worker->queues, capacity * sizeof(jq_worker_queue*) );
+    
+    if( queues ) {
+      worker->queues = queues;
+      worker->queues_capacity = capacity;
+    }
+    
+    jq_worker_write_end( worker );
+    
+    if( !queues ) {
+      jq_unlock( &worker->queues_lock );
+      return 0;
+    }
+  }
+  
+  if( !(wq = (jq_worker_queue*)malloc( sizeof(jq_worker_queue) )) ) {
+    jq_unlock( &worker->queues_lock );
+    return 0;
+  }
+  
+  jq_retain( queue );
+  wq->queue = queue;
+  wq->weight = weight;
+  wq->watcher.notify = jq_worker_notify;
+  wq->watcher.arg = worker;
+  
+  jq_worker_write_begin( worker );
+  worker->queues[worker->queues_count++] = wq;
+  jq_worker_write_end( worker );
+  
+  jq_unlock( &worker->queues_lock );
+  
+  jq_queue_watch( queue, &wq->watcher );
+  
+  /* Queue may already hold reqs - wake everybody. */
+  jq_atomic_add( &worker->events, 1 );
+  jq_futex_wake( &worker->events, 0x7fffffff );
+  
+  if( worker->lazy )
+    jq_worker_spawn( worker, 0 );
+  
+  return 1;
+}
+
+void jq_worker_detach( jq_worker_t worker, jq_queue_t queue ) {
+  jq_worker_queue* wq = NULL;
+  size_t i;
+  
+  if( queue == worker->queue ) return;
+  
+  jq_lock( &worker->queues_lock );
+  
+  for( i = 0; i < worker->queues_count; ++i ) {
+    if( worker->queues[i]->queue == queue ) {
+      wq = worker->queues[i];
+      break;
+    }
+  }
+  
+  /* Once readers drain, none of them takes from detached queue. */
+  if( wq ) {
+    jq_worker_write_begin( worker );
+    
+    for( ; i + 1 < worker->queues_count; ++i )
+      worker->queues[i] = worker->queues[i + 1];
+    
+    worker->queues_count--;
+    
+    jq_worker_write_end( worker );
+  }
+  
+  jq_unlock( &worker->queues_lock );
+  
+  if( wq ) {
+    jq_queue_unwatch( queue, &wq->watcher );
+    jq_release( queue );
+    free( wq );
+  }
+}
+
+jq_queue_t jq_worker_get_queue( jq_worker_t worker ) {
+  return worker->queue;
+}
+
+int jq_worker_thread_index() {
+  return thread_index;
+}
+
+void* jq_worker_thread_slot() {
+  return thread_slot;
+}
+
+void jq_worker_set_fibers( jq_worker_t worker, int enabled ) {
+  jq_queue_set_fibers( worker->queue, enabled );
+}
+
 void jq_worker_async(
   jq_worker_t worker,
   jq_handler_t handler,
@@ -217,9 +1074,31 @@ void jq_worker_sync(
   jq_handler_t handler,
   void* context )
 {
-  jq_group_t group = jq_group_create();
-  if( group ) {
-    jq_queue_submit( worker->queue, group, handler, context );
-    jq_group_wait( group );
+  jq_queue_sync( worker->queue, handler, context );
+}
+
+int jq_worker_async_keyed(
+  jq_worker_t worker,
+  size_t key,
+  jq_group_t group,
+  jq_handler_t handler,
+  void* context )
+{
+  jq_lanes* lanes = worker->lanes;
+  
+  if( !lanes ) {
+    jq_lock( &worker->lock );
+    
+    if( !worker->lanes && (lanes = jq_lanes_create( worker, worker->lanes_count )) ) {
+      jq_atomic_barrier();
+      worker->lanes = lanes;
+    }
+    
+    lanes = worker->lanes;
+    jq_unlock( &worker->lock );
+    
+    if( !lanes ) return 0;
   }
+  
+  return jq_lanes_submit( lanes, key, group, handler, context );
 }
@@ -2,6 +2,7 @@
 #define _JQ_H_
 
 #include <stddef.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,6 +14,9 @@ extern "C" {
 
 typedef void (*jq_handler_t)( void* );
 
+/** Size of context storage of requests made by jq_req_alloc. */
+#define JQ_REQ_INLINE_SIZE (6 * sizeof(void*))
+
 void jq_retain( void* );
 void jq_release( void* );
 
@@ -20,6 +24,15 @@ void jq_release( void* );
   Group.
 -----------------------------------------------------------------------------*/
 
+/*
+  Group is biased to thread which created it: its references are counted
+  without atomics there. References dropped by other threads are merged
+  by creating thread on its next jq_retain, jq_release or jq_group_wait,
+  so fan-out group whose last reference is dropped by a request while its
+  creator just waits is destroyed (with its arena) only when creator's
+  wait returns.
+*/
+
 typedef struct jq_group* jq_group_t;
 
 jq_group_t jq_group_create();
@@ -27,6 +40,41 @@ void jq_group_enter( jq_group_t );
 void jq_group_leave( jq_group_t );
 void jq_group_wait( jq_group_t );
 
+/**
+  Allocate memory (16 byte aligned) which lives as long as group: all of it
+  is freed at once when group is destroyed. Meant for contexts of grouped
+  requests, no free is needed for them.
+*/
+void* jq_group_alloc( jq_group_t group, size_t size );
+
+/*-----------------------------------------------------------------------------
+  Barrier, latch and semaphore.
+  Uncontended operations are single atomic, threads sleep on futex only
+  when they have to wait. Waiting worker thread executes requests of its
+  worker meanwhile, so it may run another participant of the same barrier:
+  barrier used for several phases needs a thread per participant.
+  Released with jq_release.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_barrier* jq_barrier_t;
+typedef struct jq_latch* jq_latch_t;
+typedef struct jq_semaphore* jq_semaphore_t;
+
+jq_barrier_t jq_barrier_create( int count );
+
+/** Returns 1 in exactly one thread of each phase (the last one), 0 in others. */
+int jq_barrier_wait( jq_barrier_t barrier );
+
+jq_latch_t jq_latch_create( int count );
+void jq_latch_count_down( jq_latch_t latch, int n );
+int jq_latch_try_wait( jq_latch_t latch );
+void jq_latch_wait( jq_latch_t latch );
+
+jq_semaphore_t jq_semaphore_create( int value );
+void jq_semaphore_post( jq_semaphore_t sem, int n );
+int jq_semaphore_try_wait( jq_semaphore_t sem );
+void jq_semaphore_wait( jq_semaphore_t sem );
+
 /*-----------------------------------------------------------------------------
   Queue.
 -----------------------------------------------------------------------------*/
@@ -49,16 +97,239 @@ int jq_queue_submit(
 
 size_t jq_queue_get_length( jq_queue_t queue );
 
+/*
+  Two-phase submit with context stored inside request itself:
+  jq_req_alloc request, construct context (up to JQ_REQ_INLINE_SIZE bytes,
+  pointer aligned) at jq_req_get_storage and submit it with
+  jq_queue_submit_req. Handler gets pointer to the storage. If request is
+  discarded without being run (jq_queue_empty) dispose is called instead.
+  Request not submitted must be returned by jq_req_free.
+*/
+
+typedef struct jq_req* jq_req_t;
+
+jq_req_t jq_req_alloc( jq_group_t group, jq_handler_t handler, jq_handler_t dispose );
+void* jq_req_get_storage( jq_req_t req );
+void jq_req_free( jq_req_t req );
+void jq_queue_submit_req( jq_queue_t queue, jq_req_t req );
+
+/**
+  Run handlers of queue on fibers (lightweight user-space stacks).
+  Handler running on fiber doesn't block its thread in jq_group_wait and
+  jq_worker_sync: fiber is suspended and resumed via queue later.
+*/
+void jq_queue_set_fibers( jq_queue_t queue, int enabled );
+
+/**
+  Batch handler for requests of single handler. When consumer takes request
+  whose handler has batch registered, it also takes following requests
+  with same handler from head of that queue (up to max_count, at most
+  JQ_BATCH_MAX) and calls batch once with their contexts in queue order.
+  Meant to amortize per-call setup: locks, transactions and so on.
+  Requests run on fibers are not batched. Pass NULL batch to unregister.
+  Returns 0 if too many handlers are registered.
+*/
+typedef void (*jq_batch_handler_t)( void** contexts, size_t count );
+
+#define JQ_BATCH_MAX 64
+
+int jq_handler_set_batch( jq_handler_t handler, jq_batch_handler_t batch, size_t max_count );
+
+/*-----------------------------------------------------------------------------
+  Shared memory queue.
+  Queue of byte payloads in named POSIX shared memory, usable from several
+  processes at once. Payloads are copied into preallocated slots on submit
+  and handed to handler in place.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_shm_queue* jq_shm_queue_t;
+typedef void (*jq_shm_handler_t)( void* data, size_t size );
+
+jq_shm_queue_t jq_shm_queue_create( const char* name, size_t slots, size_t slot_size );
+jq_shm_queue_t jq_shm_queue_open( const char* name );
+int jq_shm_queue_unlink( const char* name );
+
+void jq_shm_queue_loop( jq_shm_queue_t queue, jq_shm_handler_t handler );
+int jq_shm_queue_poll( jq_shm_queue_t queue, jq_shm_handler_t handler );
+
+int jq_shm_queue_stop( jq_shm_queue_t queue );
+
+/** Blocks while all slots are in use. Fails if size exceeds slot size. */
+int jq_shm_queue_submit( jq_shm_queue_t queue, const void* data, size_t size );
+
+size_t jq_shm_queue_get_length( jq_shm_queue_t queue );
+
+/*-----------------------------------------------------------------------------
+  Journal.
+  Persistent queue mode: payloads are appended to memory-mapped segment files
+  in a directory before being submitted to a queue, and acknowledged after
+  handler returns. Appends are synced to disk by background thread in
+  groups, so crash may lose the last few milliseconds of submits.
+  Unacknowledged payloads are submitted again when journal is reopened
+  (handling is at-least-once).
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_journal* jq_journal_t;
+typedef void (*jq_journal_handler_t)( void* data, size_t size );
+
+/** Opens or creates journal and replays its pending payloads. */
+jq_journal_t jq_journal_open(
+  const char* dir,
+  size_t segment_size,
+  jq_queue_t queue,
+  jq_journal_handler_t handler );
+
+/** Returns 0 if payload doesn't fit into segment or is 4 GB or larger. */
+int jq_journal_submit( jq_journal_t journal, const void* data, size_t size );
+
+/** Wait until everything submitted so far is synced to disk. */
+void jq_journal_flush( jq_journal_t journal );
+
+/*-----------------------------------------------------------------------------
+  Asynchronous file I/O.
+  Operations are performed by io_uring when kernel supports it, or by small
+  thread pool otherwise. Handler of each operation is submitted to given
+  queue on completion with number of bytes transferred or negative errno.
+  Submit blocks while depth operations are outstanding, so handlers must not
+  submit I/O if their queue is served only by the blocked thread. Reads and
+  writes of 4 GB or more are rejected: submit returns 0.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_io* jq_io_t;
+typedef void (*jq_io_handler_t)( void* context, ssize_t result );
+
+enum {
+  JQ_IO_AUTO,
+  JQ_IO_URING,
+  JQ_IO_THREADS
+};
+
+/** Depth 0 means default. Backend JQ_IO_AUTO prefers io_uring. */
+jq_io_t jq_io_create( size_t depth, int backend );
+int jq_io_get_backend( jq_io_t io );
+
+int jq_io_read(
+  jq_io_t io,
+  int fd,
+  void* buf,
+  size_t size,
+  off_t offset,
+  jq_queue_t queue,
+  jq_group_t group,
+  jq_io_handler_t handler,
+  void* context );
+
+int jq_io_write(
+  jq_io_t io,
+  int fd,
+  const void* buf,
+  size_t size,
+  off_t offset,
+  jq_queue_t queue,
+  jq_group_t group,
+  jq_io_handler_t handler,
+  void* context );
+
+int jq_io_fsync(
+  jq_io_t io,
+  int fd,
+  jq_queue_t queue,
+  jq_group_t group,
+  jq_io_handler_t handler,
+  void* context );
+
+/**
+  Operations submitted between plug and unplug are passed to kernel at once
+  by jq_io_unplug, with one system call. Calls nest.
+*/
+void jq_io_plug( jq_io_t io );
+void jq_io_unplug( jq_io_t io );
+
 /*-----------------------------------------------------------------------------
   Worker.
 -----------------------------------------------------------------------------*/
 
 typedef struct jq_worker* jq_worker_t;
 
+/**
+  Hooks run on each worker thread: init before it serves requests, exit
+  after it's done. Init returns thread's slot for per-thread resources.
+*/
+typedef void* (*jq_thread_init_t)( void* arg, int index );
+typedef void (*jq_thread_exit_t)( void* arg, int index, void* slot );
+
+typedef struct jq_worker_config {
+  /** Number of threads. */
+  size_t threads;
+  
+  /**
+    Start threads on demand: one more thread is started when req arrives
+    and no thread is idle, up to threads.
+  */
+  int lazy;
+  
+  /** Stack and guard sizes of threads, 0 for system defaults. */
+  size_t stack_size;
+  size_t guard_size;
+  
+  /** Threads are named "name-N" where supported. NULL for no names. */
+  const char* name;
+  
+  /**
+    Scheduling policy (SCHED_*) and priority of threads, policy -1 to
+    inherit. Policy not permitted to process is ignored.
+  */
+  int sched_policy;
+  int sched_priority;
+  
+  /**
+    Extra threads worker may run while its handlers exceed watchdog budget,
+    one per stalled handler. 0 to not compensate, see jq_watchdog_start.
+  */
+  size_t stall_threads;
+  
+  /** Lanes of keyed requests, rounded up to power of 2. 0 for JQ_WORKER_LANES. */
+  size_t lanes;
+  
+  /** Thread hooks and their argument, NULL for none. */
+  jq_thread_init_t thread_init;
+  jq_thread_exit_t thread_exit;
+  void* thread_arg;
+} jq_worker_config;
+
+#define JQ_WORKER_LANES 256
+
+/** Defaults: one thread started right away, system thread attributes. */
+void jq_worker_config_init( jq_worker_config* config );
+
 jq_worker_t jq_worker_create( jq_queue_t queue, size_t threads );
+jq_worker_t jq_worker_create_ex( jq_queue_t queue, const jq_worker_config* config );
 
 void jq_worker_set_threads( jq_worker_t worker, size_t threads );
 
+void jq_worker_set_fibers( jq_worker_t worker, int enabled );
+
+/**
+  Serve one more queue by worker threads, or change weight of served one.
+  Queues are served in deficit round robin order: in each round queue gives
+  up to weight requests, so busy queue can't starve others.
+  Worker's own queue is served with weight 1 unless changed.
+*/
+int jq_worker_attach( jq_worker_t worker, jq_queue_t queue, size_t weight );
+void jq_worker_detach( jq_worker_t worker, jq_queue_t queue );
+
+jq_queue_t jq_worker_get_queue( jq_worker_t worker );
+
+/**
+  Index of current worker thread, -1 on other threads. Indices are the
+  lowest free ones when threads start, so they stay below the largest
+  number of threads worker ran at once and can index per-thread arrays.
+*/
+int jq_worker_thread_index();
+
+/** Slot returned by thread_init of current thread, NULL on other threads. */
+void* jq_worker_thread_slot();
+
 void jq_worker_async(
   jq_worker_t worker,
   jq_handler_t handler,
@@ -75,6 +346,120 @@ void jq_worker_sync(
   jq_handler_t handler,
   void* context );
 
+/**
+  Keyed request. Requests of the same key run one at a time in submit
+  order, requests of different keys in parallel. Keys are hashed onto
+  fixed set of serial lanes, so no per key state is kept: keys sharing
+  lane are serialized too. Lane with many requests gives its thread to
+  requests of worker's queues from time to time. Requests run as queued
+  ones do: on fibers, batched with following ones of their lane, watched
+  and counted in stats. Returns 0 if out of memory.
+*/
+int jq_worker_async_keyed(
+  jq_worker_t worker,
+  size_t key,
+  jq_group_t group,
+  jq_handler_t handler,
+  void* context );
+
+/*-----------------------------------------------------------------------------
+  Pipeline.
+  Items pushed to pipeline pass its stages in order of adding, on worker
+  threads. Parallel stage runs for many items at once, serial stage for one
+  item at a time: in push order (in-order) or in arrival order. Item is
+  carried to next stage by the same thread when possible. Push blocks
+  while max_tokens items are in flight.
+-----------------------------------------------------------------------------*/
+
+typedef struct jq_pipeline* jq_pipeline_t;
+
+/** Returns item for next stage, or NULL to drop it. */
+typedef void* (*jq_stage_t)( void* arg, void* item );
+
+enum {
+  JQ_STAGE_PARALLEL,
+  JQ_STAGE_SERIAL_IN_ORDER,
+  JQ_STAGE_SERIAL_OUT_OF_ORDER
+};
+
+jq_pipeline_t jq_pipeline_create( jq_worker_t worker, size_t max_tokens );
+
+/** Stages can be added only before the first push. */
+int jq_pipeline_add_stage( jq_pipeline_t pipeline, int mode, jq_stage_t stage, void* arg );
+
+int jq_pipeline_push( jq_pipeline_t pipeline, void* item );
+
+/** Wait until all pushed items have passed pipeline. */
+void jq_pipeline_wait( jq_pipeline_t pipeline );
+
+/*-----------------------------------------------------------------------------
+  Parallel algorithms.
+  Array is split into cache sized chunks processed by worker threads and
+  calling thread, which takes part and returns when all work is done.
+  Called from worker thread, it runs other requests while waiting.
+  Functions return 0 if out of memory, if size is 0 or if count items of
+  size don't fit in memory; array is left unchanged then.
+-----------------------------------------------------------------------------*/
+
+/** Comparator of qsort. */
+typedef int (*jq_compare_t)( const void* a, const void* b );
+
+/** Store a op b to result, which may be a. Op must be associative. */
+typedef void (*jq_combine_t)( void* arg, void* result, const void* a, const void* b );
+
+typedef int (*jq_predicate_t)( void* arg, const void* item );
+
+/** Merge sort of qsort sorted chunks, not stable. Needs buffer of array size. */
+int jq_parallel_sort( jq_worker_t worker, void* base, size_t count, size_t size, jq_compare_t compare );
+
+/**
+  out[i] = in[0] op ... op in[i] for inclusive scan,
+  out[i] = init op in[0] op ... op in[i - 1] for exclusive one.
+  Output may be the input. Exclusive scan returns 0 if init is NULL.
+*/
+int jq_parallel_inclusive_scan( jq_worker_t worker, const void* in, void* out, size_t count, size_t size,
+  jq_combine_t combine, void* arg );
+
+int jq_parallel_exclusive_scan( jq_worker_t worker, const void* in, void* out, size_t count, size_t size,
+  jq_combine_t combine, void* arg, const void* init );
+
+/**
+  Move items satisfying predicate before the others, keeping order within
+  both parts. Stores number of the former to selected.
+*/
+int jq_parallel_partition( jq_worker_t worker, void* base, size_t count, size_t size,
+  jq_predicate_t predicate, void* arg, size_t* selected );
+
+/*-----------------------------------------------------------------------------
+  Stats.
+  Live state of workers (queue length, threads, executed requests, queue
+  wait histogram) is published to named POSIX shared memory segment, laid
+  out as in jq-stats.h, for inspection from outside (see tools/jq-top.c).
+  Workers update it from their threads every few milliseconds.
+-----------------------------------------------------------------------------*/
+
+/** NULL name means "/jq-stats-<pid>". Replaces segment published before. */
+int jq_stats_publish( const char* name );
+void jq_stats_unpublish();
+
+/*-----------------------------------------------------------------------------
+  Watchdog.
+  Watchdog thread checks what every thread executing requests runs and
+  since when, and reports handlers running longer than budget, each one
+  once per execution. Worker with stall_threads runs an extra thread for
+  each stalled handler until it returns.
+-----------------------------------------------------------------------------*/
+
+/**
+  Called on watchdog thread with handler running for running_ms and time
+  its request waited in queue (0 if not known). Must not stop watchdog.
+*/
+typedef void (*jq_watchdog_t)( void* arg, jq_handler_t handler, unsigned running_ms, unsigned waited_ms );
+
+/** Returns 0 if watchdog already runs. Report may be NULL. */
+int jq_watchdog_start( unsigned budget_ms, jq_watchdog_t report, void* arg );
+void jq_watchdog_stop();
+
 /*-----------------------------------------------------------------------------
   Once.
 -----------------------------------------------------------------------------*/
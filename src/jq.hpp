@@ -0,0 +1,234 @@
+#ifndef _JQ_HPP_
+#define _JQ_HPP_
+
+#include "jq.h"
+#include <new>
+#include <utility>
+#include <type_traits>
+
+/*
+  C++ interface. Header only, C++11.
+  Any callable (including move-only lambdas) can be submitted. Callable is
+  moved into request itself if it fits JQ_REQ_INLINE_SIZE, so submit does
+  no allocations besides request; bigger callables are moved to heap.
+  Callables must not throw: handlers are run from C code.
+*/
+
+namespace jq {
+
+/*-----------------------------------------------------------------------------
+  Internals.
+-----------------------------------------------------------------------------*/
+
+namespace detail {
+
+template<class F>
+struct inline_task {
+  static void run( void* storage ) {
+    F* f = static_cast<F*>( storage );
+    (*f)();
+    f->~F();
+  }
+  
+  static void dispose( void* storage ) {
+    static_cast<F*>( storage )->~F();
+  }
+  
+  template<class A>
+  static void construct( void* storage, A&& f ) {
+    new (storage) F( std::forward<A>( f ) );
+  }
+};
+
+template<class F>
+struct heap_task {
+  static void run( void* storage ) {
+    F* f = *static_cast<F**>( storage );
+    (*f)();
+    delete f;
+  }
+  
+  static void dispose( void* storage ) {
+    delete *static_cast<F**>( storage );
+  }
+  
+  template<class A>
+  static void construct( void* storage, A&& f ) {
+    *static_cast<F**>( storage ) = new F( std::forward<A>( f ) );
+  }
+};
+
+template<class F>
+struct task_traits {
+  typedef typename std::decay<F>::type type;
+  
+  static const bool fits = sizeof(type) <= JQ_REQ_INLINE_SIZE
+    && alignof(type) <= alignof(void*);
+  
+  typedef typename std::conditional<fits,
+    inline_task<type>, heap_task<type> >::type task;
+};
+
+/* Frees request if callable construction throws. */
+struct req_guard {
+  jq_req_t req;
+  
+  ~req_guard() {
+    if( req ) jq_req_free( req );
+  }
+};
+
+template<class F>
+bool submit( jq_queue_t queue, jq_group_t group, F&& f ) {
+  typedef typename task_traits<F>::task task;
+  
+  req_guard guard = { jq_req_alloc( group, task::run, task::dispose ) };
+  if( !guard.req ) return false;
+  
+  task::construct( jq_req_get_storage( guard.req ), std::forward<F>( f ) );
+  
+  jq_queue_submit_req( queue, guard.req );
+  guard.req = NULL;
+  
+  return true;
+}
+
+template<class F>
+void invoke( void* f ) {
+  (*static_cast<F*>( f ))();
+}
+
+/* Owning reference to jq object. */
+template<class T>
+class handle {
+public:
+  handle() : ptr( NULL ) {}
+  
+  handle( const handle& other ) : ptr( other.ptr ) {
+    jq_retain( ptr );
+  }
+  
+  handle( handle&& other ) : ptr( other.ptr ) {
+    other.ptr = NULL;
+  }
+  
+  ~handle() {
+    jq_release( ptr );
+  }
+  
+  handle& operator=( handle other ) {
+    std::swap( ptr, other.ptr );
+    return *this;
+  }
+  
+  /** Underlying C object, not retained. */
+  T get() const { return ptr; }
+  
+  explicit operator bool() const { return ptr != NULL; }
+  
+protected:
+  /** Takes ownership of reference. */
+  explicit handle( T ptr ) : ptr( ptr ) {}
+  
+  T ptr;
+};
+
+} /* namespace detail */
+
+/*-----------------------------------------------------------------------------
+  Group.
+-----------------------------------------------------------------------------*/
+
+class group : public detail::handle<jq_group_t> {
+public:
+  group() : handle( jq_group_create() ) {}
+  
+  void enter() { jq_group_enter( ptr ); }
+  void leave() { jq_group_leave( ptr ); }
+  void wait() { jq_group_wait( ptr ); }
+  
+  /** Memory freed with group, see jq_group_alloc. */
+  void* alloc( size_t size ) { return jq_group_alloc( ptr, size ); }
+};
+
+/*-----------------------------------------------------------------------------
+  Queue.
+-----------------------------------------------------------------------------*/
+
+class queue : public detail::handle<jq_queue_t> {
+public:
+  queue() : handle( jq_queue_create() ) {}
+  
+  /** Wraps existing queue, retaining it. */
+  static queue wrap( jq_queue_t ptr ) {
+    jq_retain( ptr );
+    return queue( ptr );
+  }
+  
+  template<class F>
+  bool submit( F&& f ) {
+    return detail::submit( ptr, NULL, std::forward<F>( f ) );
+  }
+  
+  template<class F>
+  bool submit( const group& group, F&& f ) {
+    return detail::submit( ptr, group.get(), std::forward<F>( f ) );
+  }
+  
+  void loop() { jq_queue_loop( ptr ); }
+  bool poll() { return jq_queue_poll( ptr ) != 0; }
+  bool stop() { return jq_queue_stop( ptr ) != 0; }
+  void empty() { jq_queue_empty( ptr ); }
+  
+  void set_fibers( bool enabled ) { jq_queue_set_fibers( ptr, enabled ); }
+  
+  size_t length() const { return jq_queue_get_length( ptr ); }
+  
+private:
+  explicit queue( jq_queue_t ptr ) : handle( ptr ) {}
+};
+
+/*-----------------------------------------------------------------------------
+  Worker.
+-----------------------------------------------------------------------------*/
+
+class worker : public detail::handle<jq_worker_t> {
+public:
+  explicit worker( size_t threads = 1 )
+    : handle( jq_worker_create( NULL, threads ) ) {}
+  
+  worker( const jq::queue& queue, size_t threads )
+    : handle( jq_worker_create( queue.get(), threads ) ) {}
+  
+  template<class F>
+  bool async( F&& f ) {
+    return detail::submit( jq_worker_get_queue( ptr ), NULL, std::forward<F>( f ) );
+  }
+  
+  template<class F>
+  bool async( const group& group, F&& f ) {
+    return detail::submit( jq_worker_get_queue( ptr ), group.get(), std::forward<F>( f ) );
+  }
+  
+  /** Callable is invoked in place, it is neither copied nor moved. */
+  template<class F>
+  void sync( F&& f ) {
+    typedef typename std::remove_reference<F>::type type;
+    jq_worker_sync( ptr, detail::invoke<type>, (void*)&f );
+  }
+  
+  void set_threads( size_t threads ) { jq_worker_set_threads( ptr, threads ); }
+  void set_fibers( bool enabled ) { jq_worker_set_fibers( ptr, enabled ); }
+  
+  bool attach( const jq::queue& queue, size_t weight = 1 ) {
+    return jq_worker_attach( ptr, queue.get(), weight ) != 0;
+  }
+  
+  void detach( const jq::queue& queue ) { jq_worker_detach( ptr, queue.get() ); }
+  
+  jq::queue queue() const { return jq::queue::wrap( jq_worker_get_queue( ptr ) ); }
+};
+
+} /* namespace jq */
+
+#endif /* ndef _JQ_HPP_ */
@@ -9,7 +9,8 @@ my $out = "$Bin/../tmp/tests";
 
 make_path $out;
 
-my $CC = "gcc -Werror -Wall -I$Bin -I$Bin/../src $Bin/../src/*.c";
+my $CC = "gcc -Werror -Wall -I$Bin -I$Bin/../src";
+my $SRC = "$Bin/../src/*.c";
 my $res = 0;
 my $i = 0;
 
@@ -19,7 +20,9 @@ for( @tests ) {
   $i++;
   
   my $name = $i;
-  my $cmd = "$CC $_ -o $out/$name && $out/$name";
+  my $cmd = /\.cpp$/
+    ? "$CC -x c $SRC -x c++ $_ -lstdc++ -o $out/$name && $out/$name"
+    : "$CC $SRC $_ -o $out/$name && $out/$name";
   
   print qq/===> Running test "$_"\n/;
   
@@ -1,6 +1,7 @@
 #include "jq.h"
 #include "jq-test.h"
 #include <unistd.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +32,26 @@ void check_enter_leave( jq_group_t group, int num ) {
   alarm_enabled = 0;
 }
 
+void* leave_proc( void* group ) {
+  jq_group_leave( group );
+  return NULL;
+}
+
+/* The last member leaves on other thread while this one waits. */
+void check_leave_waited( jq_group_t group ) {
+  pthread_t thread;
+  
+  jq_group_enter( group );
+  pthread_create( &thread, NULL, leave_proc, group );
+  
+  alarm_enabled = 1;
+  alarm( 1 );
+  jq_group_wait( group );
+  alarm_enabled = 0;
+  
+  pthread_join( thread, NULL );
+}
+
 int main() {
   int i;
   
@@ -43,6 +64,10 @@ int main() {
     check_enter_leave( group, i );
   }
   
+  for( i = 0; i < 1000; ++i ) {
+    check_leave_waited( group );
+  }
+  
   jq_release( group );
   
   return 0;
@@ -1,12 +1,100 @@
+#define _GNU_SOURCE
 #include "jq.h"
 #include "jq-test.h"
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
 
 static void proc( void* p ) {
   
 }
 
+static void inc( void* p ) {
+  (*(int*)p)++;
+}
+
+static volatile int released = 0;
+static volatile int running = 0;
+static volatile int named = 0;
+static volatile size_t stack_size = 0;
+
+static void block( void* p ) {
+  char name[16] = "";
+  pthread_attr_t attr;
+  
+  pthread_getname_np( pthread_self(), name, sizeof(name) );
+  
+  if( strncmp( name, "lazy-", 5 ) == 0 )
+    __sync_fetch_and_add( &named, 1 );
+  
+  pthread_getattr_np( pthread_self(), &attr );
+  pthread_attr_getstacksize( &attr, (size_t*)&stack_size );
+  pthread_attr_destroy( &attr );
+  
+  __sync_fetch_and_add( &running, 1 );
+  
+  while( !released )
+    usleep( 1000 );
+}
+
+static int count_threads() {
+  DIR* dir = opendir( "/proc/self/task" );
+  struct dirent* entry;
+  int count = 0;
+  
+  while( (entry = readdir( dir )) )
+    if( entry->d_name[0] != '.' ) count++;
+  
+  closedir( dir );
+  return count;
+}
+
+static void check_lazy() {
+  jq_worker_config config;
+  jq_worker_t worker;
+  jq_group_t group = jq_group_create();
+  int base = count_threads();
+  int i;
+  
+  jq_worker_config_init( &config );
+  config.threads = 3;
+  config.lazy = 1;
+  config.name = "lazy";
+  config.stack_size = 512 * 1024;
+  
+  worker = jq_worker_create_ex( NULL, &config );
+  ok( worker != NULL );
+  
+  /* Nothing to do - no threads. */
+  ok( count_threads() == base );
+  
+  /* Burst starts threads up to limit. */
+  for( i = 0; i < 5; ++i )
+    jq_worker_async_group( worker, group, block, NULL );
+  
+  for( i = 0; i < 2000 && running < 3; ++i )
+    usleep( 1000 );
+  
+  ok( running == 3 );
+  ok( count_threads() == base + 3 );
+  ok( named == 3 );
+  ok( stack_size == 512 * 1024 );
+  
+  released = 1;
+  jq_group_wait( group );
+  
+  jq_release( group );
+  jq_release( worker );
+}
+
 testing() {
-  jq_worker_t worker = jq_worker_create( NULL, 4 );
+  jq_worker_t worker;
+  
+  /* Before other workers, their threads would be counted. */
+  check_lazy();
+  
+  worker = jq_worker_create( NULL, 4 );
   assert( worker != NULL );
   
   jq_group_t group = jq_group_create();
@@ -18,5 +106,13 @@ testing() {
   
   jq_group_wait( group );
   
+  int counter = 0;
+  for( i = 0; i < 100000; ++i ) {
+    jq_worker_sync( worker, inc, &counter );
+  }
+  
+  ok( counter == 100000 );
+  
+  jq_release( group );
   jq_release( worker );
 }
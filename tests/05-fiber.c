@@ -0,0 +1,63 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <unistd.h>
+
+#define OUTER 1000
+#define INNER 10
+
+jq_worker_t worker;
+volatile size_t inner_done = 0;
+volatile size_t outer_done = 0;
+
+static void inner( void* p ) {
+  __sync_fetch_and_add( &inner_done, 1 );
+}
+
+static void outer_group( void* p ) {
+  int i;
+  jq_group_t group = jq_group_create();
+  
+  for( i = 0; i < INNER; ++i )
+    jq_worker_async_group( worker, group, inner, NULL );
+  
+  jq_group_wait( group );
+  jq_release( group );
+  
+  __sync_fetch_and_add( &outer_done, 1 );
+}
+
+static void outer_sync( void* p ) {
+  jq_worker_sync( worker, inner, NULL );
+  __sync_fetch_and_add( &outer_done, 1 );
+}
+
+testing() {
+  int i;
+  jq_group_t group;
+  
+  /* Without fibers single thread would deadlock here. */
+  alarm( 10 );
+  
+  worker = jq_worker_create( NULL, 1 );
+  assert( worker != NULL );
+  jq_worker_set_fibers( worker, 1 );
+  
+  group = jq_group_create();
+  
+  for( i = 0; i < OUTER; ++i )
+    jq_worker_async_group( worker, group, outer_group, NULL );
+  
+  jq_group_wait( group );
+  ok( outer_done == OUTER );
+  ok( inner_done == OUTER * INNER );
+  
+  for( i = 0; i < OUTER; ++i )
+    jq_worker_async_group( worker, group, outer_sync, NULL );
+  
+  jq_group_wait( group );
+  ok( outer_done == 2 * OUTER );
+  ok( inner_done == OUTER * INNER + OUTER );
+  
+  jq_release( group );
+  jq_release( worker );
+}
@@ -0,0 +1,190 @@
+#include "jq.h"
+#include "jq-private.h"
+#include "jq-test.h"
+#include <unistd.h>
+#include <sys/time.h>
+
+#define INNER 10
+#define LEVELS 8
+#define PINGS 50
+
+jq_worker_t worker;
+volatile int started = 0;
+volatile int go = 1;
+volatile int released = 0;
+volatile int inner_done = 0;
+volatile int outer_done = 0;
+
+static void inner( void* p ) {
+  __sync_fetch_and_add( &inner_done, 1 );
+}
+
+/* Waits for requests it queues behind itself on the same worker. */
+static void outer( void* p ) {
+  jq_group_t group = jq_group_create();
+  int i;
+  
+  __sync_fetch_and_add( &started, 1 );
+  
+  while( !go )
+    usleep( 1000 );
+  
+  for( i = 0; i < INNER; ++i )
+    jq_worker_async_group( worker, group, inner, NULL );
+  
+  jq_group_wait( group );
+  jq_release( group );
+  
+  __sync_fetch_and_add( &outer_done, 1 );
+}
+
+static void blocker( void* p ) {
+  __sync_fetch_and_add( &started, 1 );
+  
+  while( !released )
+    usleep( 1000 );
+}
+
+/* Handlers running on current thread's stack and the most seen. */
+static JQ_THREAD_LOCAL int nesting = 0;
+static volatile int max_nesting = 0;
+
+/* Each level waits for the next one, queued on the same worker. */
+static void nest( void* p ) {
+  size_t level = (size_t)p;
+  
+  if( ++nesting > max_nesting )
+    max_nesting = nesting;
+  
+  if( level < LEVELS ) {
+    jq_group_t group = jq_group_create();
+    
+    jq_worker_async_group( worker, group, nest, (void*)(level + 1) );
+    jq_group_wait( group );
+    jq_release( group );
+  }
+  
+  nesting--;
+}
+
+static uint64_t now_us() {
+  struct timeval tv;
+  
+  gettimeofday( &tv, NULL );
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static volatile uint64_t ping_sent = 0;
+static volatile uint64_t ping_total = 0;
+static volatile int pings = 0;
+static jq_queue_t side;
+
+static void ping( void* p ) {
+  ping_total += now_us() - ping_sent;
+  pings++;
+}
+
+static void noop( void* p ) {
+  
+}
+
+/* Waits for request of queue no thread serves: helps meanwhile. */
+static void idle_helper( void* p ) {
+  jq_group_t group = jq_group_create();
+  
+  jq_queue_submit( side, group, noop, NULL );
+  __sync_fetch_and_add( &started, 1 );
+  jq_group_wait( group );
+  jq_release( group );
+}
+
+static void wait_count( volatile int* counter, int count ) {
+  int i;
+  
+  for( i = 0; i < 2000 && *counter < count; ++i )
+    usleep( 1000 );
+}
+
+testing() {
+  jq_group_t group = jq_group_create();
+  
+  alarm( 10 );
+  
+  /* Single thread would deadlock here if it didn't help. */
+  worker = jq_worker_create( NULL, 1 );
+  assert( worker != NULL );
+  
+  jq_worker_async_group( worker, group, outer, NULL );
+  jq_worker_async_group( worker, group, outer, NULL );
+  jq_group_wait( group );
+  
+  ok( outer_done == 2 );
+  ok( inner_done == 2 * INNER );
+  
+  jq_release( worker );
+  
+  /*
+    Thread stop request queued ahead of waited requests is left for thread
+    in its loop: helping thread executes requests behind it.
+  */
+  worker = jq_worker_create( NULL, 2 );
+  assert( worker != NULL );
+  
+  started = 0;
+  go = 0;
+  jq_worker_async_group( worker, group, outer, NULL );
+  jq_worker_async_group( worker, group, blocker, NULL );
+  wait_count( &started, 2 );
+  
+  jq_worker_set_threads( worker, 1 );
+  go = 1;
+  wait_count( &outer_done, 3 );
+  
+  ok( outer_done == 3 );
+  ok( inner_done == 3 * INNER );
+  
+  released = 1;
+  jq_group_wait( group );
+  
+  jq_release( worker );
+  
+  /* Helping nests only so deep on one stack, other threads take the rest. */
+  worker = jq_worker_create( NULL, 3 );
+  assert( worker != NULL );
+  
+  jq_worker_async_group( worker, group, nest, (void*)0 );
+  jq_group_wait( group );
+  
+  ok( max_nesting >= 1 && max_nesting <= JQ_HELP_MAX_DEPTH + 1 );
+  
+  jq_release( worker );
+  
+  /* Sleeping helper is woken by requests put to its worker. */
+  worker = jq_worker_create( NULL, 1 );
+  side = jq_queue_create();
+  started = 0;
+  
+  jq_worker_async_group( worker, group, idle_helper, NULL );
+  wait_count( &started, 1 );
+  
+  while( pings < PINGS ) {
+    int sent = pings;
+    
+    usleep( 2000 );
+    ping_sent = now_us();
+    jq_worker_async( worker, ping, NULL );
+    
+    while( pings == sent )
+      usleep( 100 );
+  }
+  
+  /* Polled every JQ_HELP_WAIT_MS it would wait half of it on average. */
+  ok( ping_total / PINGS < JQ_HELP_WAIT_MS * 1000 / 4 );
+  
+  jq_queue_poll( side );
+  jq_group_wait( group );
+  
+  jq_release( side );
+  jq_release( group );
+  jq_release( worker );
+}
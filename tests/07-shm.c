@@ -0,0 +1,137 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define COUNT 100000
+
+long sum = 0;
+size_t received = 0;
+
+static void handle( void* data, size_t size ) {
+  sum += *(int*)data;
+  received++;
+}
+
+static void ignore( void* data, size_t size ) {
+  
+}
+
+static void hang( void* data, size_t size ) {
+  while( 1 )
+    pause();
+}
+
+testing() {
+  char name[64];
+  jq_shm_queue_t queue;
+  pid_t child;
+  int status, i;
+  
+  alarm( 10 );
+  
+  snprintf( name, sizeof(name), "/jq-test-%d", (int)getpid() );
+  
+  /* Fewer slots than requests - submitters must wait for free slots. */
+  queue = jq_shm_queue_create( name, 64, sizeof(int) );
+  assert( queue != NULL );
+  
+  ok( jq_shm_queue_submit( queue, &i, 2 * sizeof(int) ) == 0 );
+  ok( jq_shm_queue_get_length( queue ) == 0 );
+  
+  child = fork();
+  assert( child >= 0 );
+  
+  if( child == 0 ) {
+    jq_shm_queue_t q = jq_shm_queue_open( name );
+    
+    if( !q ) _exit( 1 );
+    
+    for( i = 0; i < COUNT; ++i )
+      jq_shm_queue_submit( q, &i, sizeof(int) );
+    
+    /* Stop request overtakes queued payloads, so submit it behind them. */
+    while( jq_shm_queue_get_length( q ) > 0 )
+      usleep( 1000 );
+    
+    jq_shm_queue_stop( q );
+    jq_release( q );
+    _exit( 0 );
+  }
+  
+  jq_shm_queue_loop( queue, handle );
+  
+  ok( waitpid( child, &status, 0 ) == child );
+  ok( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+  ok( received == COUNT );
+  ok( sum == (long)COUNT * (COUNT - 1) / 2 );
+  
+  i = 42;
+  jq_shm_queue_submit( queue, &i, sizeof(int) );
+  ok( jq_shm_queue_poll( queue, handle ) == 1 );
+  ok( received == COUNT + 1 );
+  
+  jq_shm_queue_stop( queue );
+  ok( jq_shm_queue_poll( queue, handle ) == 0 );
+  
+  /* Process killed while it may hold mutex doesn't break queue. */
+  child = fork();
+  assert( child >= 0 );
+  
+  if( child == 0 ) {
+    while( 1 ) {
+      jq_shm_queue_submit( queue, &i, sizeof(int) );
+      jq_shm_queue_poll( queue, ignore );
+    }
+  }
+  
+  usleep( 20000 );
+  kill( child, SIGKILL );
+  ok( waitpid( child, &status, 0 ) == child );
+  
+  jq_shm_queue_poll( queue, ignore );
+  ok( jq_shm_queue_get_length( queue ) == 0 );
+  
+  received = 0;
+  
+  for( i = 0; i < 64; ++i )
+    jq_shm_queue_submit( queue, &i, sizeof(int) );
+  
+  ok( jq_shm_queue_poll( queue, handle ) == 1 );
+  ok( received == 64 );
+  
+  jq_release( queue );
+  ok( jq_shm_queue_unlink( name ) );
+  ok( jq_shm_queue_open( name ) == NULL );
+  
+  /* Slot held by killed consumer is reclaimed before it's reaped. */
+  queue = jq_shm_queue_create( name, 1, sizeof(int) );
+  assert( queue != NULL );
+  
+  jq_shm_queue_submit( queue, &i, sizeof(int) );
+  child = fork();
+  assert( child >= 0 );
+  
+  if( child == 0 ) {
+    jq_shm_queue_poll( queue, hang );
+    _exit( 0 );
+  }
+  
+  while( jq_shm_queue_get_length( queue ) > 0 )
+    usleep( 1000 );
+  
+  kill( child, SIGKILL );
+  ok( jq_shm_queue_submit( queue, &i, sizeof(int) ) );
+  ok( jq_shm_queue_get_length( queue ) == 1 );
+  ok( waitpid( child, &status, 0 ) == child );
+  
+  jq_release( queue );
+  jq_shm_queue_unlink( name );
+  
+  /* Segment size overflows. */
+  ok( jq_shm_queue_create( name, SIZE_MAX / 64, 64 ) == NULL );
+  ok( jq_shm_queue_create( name, 1, SIZE_MAX - 8 ) == NULL );
+}
@@ -0,0 +1,117 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#define COUNT 1000
+
+int handled[COUNT];
+size_t received = 0;
+size_t empty = 0;
+
+static void handle( void* data, size_t size ) {
+  int value;
+  
+  if( size == 0 ) empty++;
+  if( size != sizeof(int) ) return;
+  
+  memcpy( &value, data, sizeof(int) );
+  
+  if( value >= 0 && value < COUNT )
+    handled[value]++;
+  
+  received++;
+}
+
+static size_t count_segments( const char* path ) {
+  size_t count = 0;
+  struct dirent* ent;
+  DIR* dir = opendir( path );
+  
+  while( (ent = readdir( dir )) ) {
+    if( strstr( ent->d_name, ".jql" ) )
+      count++;
+  }
+  
+  closedir( dir );
+  return count;
+}
+
+testing() {
+  char dir[] = "/tmp/jq-journal-XXXXXX";
+  char cmd[64];
+  jq_queue_t queue;
+  jq_journal_t journal;
+  pid_t child;
+  int status, i;
+  
+  assert( mkdtemp( dir ) != NULL );
+  
+  /* Child submits and dies before anything is handled. */
+  child = fork();
+  assert( child >= 0 );
+  
+  if( child == 0 ) {
+    queue = jq_queue_create();
+    journal = jq_journal_open( dir, 4096, queue, handle );
+    
+    if( !journal ) _exit( 1 );
+    
+    for( i = 0; i < COUNT; ++i ) {
+      jq_journal_submit( journal, &i, sizeof(int) );
+      
+      /* Empty payload doesn't end segment. */
+      if( i == COUNT / 2 )
+        jq_journal_submit( journal, NULL, 0 );
+    }
+    
+    jq_journal_flush( journal );
+    _exit( 0 );
+  }
+  
+  ok( waitpid( child, &status, 0 ) == child );
+  ok( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+  ok( count_segments( dir ) > 1 );
+  
+  /* Pending payloads are replayed on open. */
+  queue = jq_queue_create();
+  journal = jq_journal_open( dir, 4096, queue, handle );
+  assert( journal != NULL );
+  
+  ok( jq_queue_get_length( queue ) == COUNT + 1 );
+  jq_queue_poll( queue );
+  ok( received == COUNT );
+  ok( empty == 1 );
+  
+  for( i = 0; i < COUNT; ++i ) {
+    if( handled[i] != 1 ) break;
+  }
+  
+  ok( i == COUNT );
+  
+  /* Acknowledged segments are removed. */
+  jq_journal_flush( journal );
+  ok( count_segments( dir ) == 1 );
+  
+  i = 7;
+  ok( jq_journal_submit( journal, &i, sizeof(int) ) );
+  jq_queue_poll( queue );
+  ok( handled[7] == 2 );
+  
+  jq_release( journal );
+  
+  /* Everything was acknowledged - nothing to replay. */
+  journal = jq_journal_open( dir, 4096, queue, handle );
+  assert( journal != NULL );
+  ok( jq_queue_get_length( queue ) == 0 );
+  
+  jq_release( journal );
+  jq_release( queue );
+  
+  snprintf( cmd, sizeof(cmd), "rm -rf %s", dir );
+  ok( system( cmd ) == 0 );
+}
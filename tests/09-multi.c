@@ -0,0 +1,98 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <unistd.h>
+
+#define COUNT 400
+
+volatile int released = 0;
+char order[2 * COUNT + 2];
+size_t executed = 0;
+
+static void block( void* p ) {
+  while( !released )
+    usleep( 1000 );
+}
+
+static void record( void* p ) {
+  order[executed++] = *(char*)p;
+}
+
+static volatile size_t counted = 0;
+
+static void count( void* p ) {
+  __sync_fetch_and_add( &counted, 1 );
+}
+
+testing() {
+  jq_worker_t worker;
+  jq_queue_t a, b;
+  jq_group_t group;
+  size_t i, count_a = 0;
+  char tag_a = 'a', tag_b = 'b';
+  
+  alarm( 10 );
+  
+  worker = jq_worker_create( NULL, 1 );
+  assert( worker != NULL );
+  
+  a = jq_queue_create();
+  b = jq_queue_create();
+  group = jq_group_create();
+  
+  /* Keep the only thread busy until both queues are filled and attached. */
+  jq_worker_async( worker, block, NULL );
+  
+  for( i = 0; i < COUNT; ++i ) {
+    jq_queue_submit( a, group, record, &tag_a );
+    jq_queue_submit( b, group, record, &tag_b );
+  }
+  
+  ok( jq_worker_attach( worker, a, 3 ) );
+  ok( jq_worker_attach( worker, b, 1 ) );
+  
+  released = 1;
+  jq_group_wait( group );
+  
+  ok( executed == 2 * COUNT );
+  
+  /* While both queues are busy, a gets three times more turns than b. */
+  for( i = 0; i < COUNT; ++i )
+    count_a += order[i] == 'a';
+  
+  ok( count_a >= 3 * COUNT / 4 - 4 && count_a <= 3 * COUNT / 4 + 4 );
+  
+  /* Detached queue is not served anymore. */
+  jq_worker_detach( worker, b );
+  jq_queue_submit( b, NULL, record, &tag_b );
+  jq_queue_submit( a, group, record, &tag_a );
+  jq_group_wait( group );
+  
+  ok( executed == 2 * COUNT + 1 );
+  ok( jq_queue_get_length( b ) == 1 );
+  
+  jq_queue_poll( b );
+  ok( executed == 2 * COUNT + 2 );
+  
+  jq_release( worker );
+  
+  /* Threads keep picking from queues while others come and go. */
+  worker = jq_worker_create( NULL, 4 );
+  jq_worker_attach( worker, a, 2 );
+  
+  for( i = 0; i < 100 * COUNT; ++i ) {
+    jq_queue_submit( i % 2 ? a : jq_worker_get_queue( worker ), group, count, NULL );
+    
+    if( i % 100 == 0 )
+      jq_worker_attach( worker, b, 1 );
+    else if( i % 100 == 50 )
+      jq_worker_detach( worker, b );
+  }
+  
+  jq_group_wait( group );
+  ok( counted == 100 * COUNT );
+  
+  jq_release( group );
+  jq_release( worker );
+  jq_release( a );
+  jq_release( b );
+}
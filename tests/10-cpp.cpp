@@ -0,0 +1,111 @@
+#include "jq.hpp"
+#include "jq-test.h"
+#include <memory>
+#include <atomic>
+#include <unistd.h>
+
+static size_t allocations = 0;
+
+void* operator new( size_t size ) {
+  ++allocations;
+  
+  if( void* p = malloc( size ) )
+    return p;
+  
+  throw std::bad_alloc();
+}
+
+void operator delete( void* p ) noexcept {
+  free( p );
+}
+
+void operator delete( void* p, size_t ) noexcept {
+  free( p );
+}
+
+static int alive = 0;
+
+struct tracked {
+  tracked() { ++alive; }
+  tracked( const tracked& ) { ++alive; }
+  ~tracked() { --alive; }
+};
+
+testing() {
+  alarm( 10 );
+  
+  /* Move-only callable stored inline, no heap allocations. */
+  {
+    jq::queue queue;
+    std::unique_ptr<int> value( new int( 5 ) );
+    int result = 0;
+    size_t before;
+    
+    ok( !!queue );
+    
+    before = allocations;
+    ok( queue.submit( [&result, v = std::move( value )]() { result = *v; } ) );
+    ok( allocations == before );
+    ok( queue.length() == 1 );
+    
+    ok( queue.poll() );
+    ok( result == 5 );
+    ok( queue.length() == 0 );
+  }
+  
+  /* Big callable goes to heap and is destroyed after run. */
+  {
+    jq::queue queue;
+    char big[128] = { 1 };
+    tracked t;
+    int result = 0;
+    
+    ok( queue.submit( [big, t, &result]() { result = big[0]; } ) );
+    ok( alive == 2 );
+    
+    queue.poll();
+    ok( result == 1 );
+    ok( alive == 1 );
+  }
+  
+  ok( alive == 0 );
+  
+  /* Discarded callables are destroyed without being run. */
+  {
+    jq::queue queue;
+    char big[128] = { 0 };
+    tracked t;
+    int runs = 0;
+    
+    queue.submit( [t, &runs]() { ++runs; } );
+    queue.submit( [big, t, &runs]() { ++runs; } );
+    ok( alive == 3 );
+    
+    queue.empty();
+    ok( alive == 1 );
+    ok( runs == 0 );
+  }
+  
+  /* Worker with group and sync. */
+  {
+    jq::worker worker( 2 );
+    jq::group group;
+    std::atomic<int> counter( 0 );
+    int i, value = 0;
+    
+    ok( !!worker );
+    ok( !!group );
+    
+    for( i = 0; i < 1000; ++i )
+      worker.async( group, [&counter]() { ++counter; } );
+    
+    group.wait();
+    ok( counter == 1000 );
+    
+    worker.sync( [&value]() { value = 42; } );
+    ok( value == 42 );
+    
+    jq::queue queue = worker.queue();
+    ok( queue.get() == jq_worker_get_queue( worker.get() ) );
+  }
+}
@@ -0,0 +1,124 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#define BLOCKS 64
+#define BLOCK_SIZE 4096
+#define READS 2000
+
+static char blocks[BLOCKS][BLOCK_SIZE];
+static char readback[BLOCKS][BLOCK_SIZE];
+static volatile int completed = 0;
+static volatile int failed = 0;
+static ssize_t last_result = 0;
+
+static void on_done( void* context, ssize_t result ) {
+  size_t expected = (size_t)context;
+  
+  if( result != (ssize_t)expected )
+    failed++;
+  
+  completed++;
+}
+
+static void on_error( void* context, ssize_t result ) {
+  last_result = result;
+}
+
+static void run( int backend ) {
+  char path[] = "/tmp/jq-io-XXXXXX";
+  jq_io_t io;
+  jq_worker_t worker;
+  jq_queue_t queue;
+  jq_group_t group;
+  int fd, i;
+  
+  io = jq_io_create( 16, backend );
+  
+  if( !io ) {
+    /* Kernel without io_uring. */
+    ok( backend == JQ_IO_URING );
+    return;
+  }
+  
+  ok( backend == JQ_IO_AUTO || jq_io_get_backend( io ) == backend );
+  
+  worker = jq_worker_create( NULL, 1 );
+  queue = jq_worker_get_queue( worker );
+  group = jq_group_create();
+  
+  fd = mkstemp( path );
+  ok( fd >= 0 );
+  unlink( path );
+  
+  completed = 0;
+  failed = 0;
+  
+  for( i = 0; i < BLOCKS; ++i )
+    memset( blocks[i], 'a' + i % 26, BLOCK_SIZE );
+  
+  /* Writes in one batch. */
+  jq_io_plug( io );
+  
+  for( i = 0; i < BLOCKS; ++i ) {
+    ok( jq_io_write( io, fd, blocks[i], BLOCK_SIZE, (off_t)i * BLOCK_SIZE,
+      queue, group, on_done, (void*)(size_t)BLOCK_SIZE ) );
+  }
+  
+  jq_io_unplug( io );
+  jq_group_wait( group );
+  
+  ok( completed == BLOCKS );
+  ok( failed == 0 );
+  
+  ok( jq_io_fsync( io, fd, queue, group, on_done, (void*)0 ) );
+  jq_group_wait( group );
+  ok( failed == 0 );
+  
+  /* Many more reads than depth. */
+  completed = 0;
+  memset( readback, 0, sizeof(readback) );
+  
+  for( i = 0; i < READS; ++i ) {
+    jq_io_read( io, fd, readback[i % BLOCKS], BLOCK_SIZE, (off_t)(i % BLOCKS) * BLOCK_SIZE,
+      queue, group, on_done, (void*)(size_t)BLOCK_SIZE );
+  }
+  
+  jq_group_wait( group );
+  ok( completed == READS );
+  ok( failed == 0 );
+  ok( memcmp( blocks, readback, sizeof(blocks) ) == 0 );
+  
+  /* Short read at end of file. */
+  completed = 0;
+  jq_io_read( io, fd, readback[0], BLOCK_SIZE, (off_t)BLOCKS * BLOCK_SIZE - 10,
+    queue, group, on_done, (void*)10 );
+  jq_group_wait( group );
+  ok( completed == 1 );
+  ok( failed == 0 );
+  
+  /* Errors are reported as negative errno. */
+  jq_io_read( io, -1, readback[0], BLOCK_SIZE, 0, queue, group, on_error, NULL );
+  jq_group_wait( group );
+  ok( last_result == -EBADF );
+  
+  /* Size io_uring can't take whole is rejected by both backends. */
+  ok( !jq_io_read( io, fd, readback[0], (size_t)UINT_MAX + 1, 0, queue, group, on_error, NULL ) );
+  
+  close( fd );
+  jq_release( io );
+  jq_release( group );
+  jq_release( worker );
+}
+
+testing() {
+  alarm( 20 );
+  
+  run( JQ_IO_AUTO );
+  run( JQ_IO_URING );
+  run( JQ_IO_THREADS );
+}
@@ -0,0 +1,208 @@
+#include "jq.h"
+#include "jq-private.h"
+#include "jq-test.h"
+#include <unistd.h>
+
+#define COUNT 10000
+
+typedef struct {
+  jq_object object;
+} counted;
+
+static volatile int destroyed = 0;
+
+static void counted_destroy( void* p ) {
+  jq_atomic_add( &destroyed, 1 );
+}
+
+static jq_object_vtable counted_vtable = {
+  counted_destroy
+};
+
+static counted* counted_create() {
+  counted* c = (counted*)malloc( sizeof(counted) );
+  
+  jq_object_init( &c->object, &counted_vtable );
+  jq_object_bias( &c->object );
+  
+  return c;
+}
+
+static void retain_proc( void* p ) {
+  jq_retain( p );
+}
+
+static void release_proc( void* p ) {
+  jq_release( p );
+}
+
+static void* create_and_exit( void* arg ) {
+  counted** result = (counted**)arg;
+  
+  *result = counted_create();
+  jq_retain( *result );
+  jq_release( *result );
+  
+  return NULL;
+}
+
+/* Creates object shared by two threads with its refs and exits at once. */
+static counted* volatile handed = NULL;
+
+static void* create_and_hand( void* arg ) {
+  counted* c = counted_create();
+  int i;
+  
+  for( i = 0; i < 2 * COUNT; ++i )
+    jq_retain( c );
+  
+  handed = c;
+  jq_release( c );
+  
+  return NULL;
+}
+
+/* Drops refs taken by creator, retaining and releasing in between. */
+static void* churn( void* arg ) {
+  counted* c;
+  int i;
+  
+  while( !(c = handed) )
+    sched_yield();
+  
+  for( i = 0; i < COUNT; ++i ) {
+    jq_retain( c );
+    jq_release( c );
+    jq_release( c );
+  }
+  
+  return NULL;
+}
+
+static void* release_later( void* arg ) {
+  usleep( 10000 );
+  jq_release( arg );
+  return NULL;
+}
+
+testing() {
+  jq_worker_t worker;
+  jq_group_t group;
+  pthread_t thread;
+  pthread_t churners[2];
+  counted* c;
+  counted* objects[4];
+  int i;
+  
+  alarm( 10 );
+  
+  /* Owner only. */
+  destroyed = 0;
+  c = counted_create();
+  
+  for( i = 0; i < 3; ++i )
+    jq_retain( c );
+  
+  for( i = 0; i < 3; ++i )
+    jq_release( c );
+  
+  ok( destroyed == 0 );
+  jq_release( c );
+  ok( destroyed == 1 );
+  
+  /* Owner retains, other thread releases. */
+  destroyed = 0;
+  worker = jq_worker_create( NULL, 2 );
+  group = jq_group_create();
+  c = counted_create();
+  
+  for( i = 0; i < COUNT; ++i ) {
+    jq_retain( c );
+    jq_worker_async_group( worker, group, release_proc, c );
+  }
+  
+  jq_group_wait( group );
+  ok( destroyed == 0 );
+  jq_release( c );
+  ok( destroyed == 1 );
+  
+  /* Owner gives away its reference, other thread releases the last one. */
+  destroyed = 0;
+  c = counted_create();
+  pthread_create( &thread, NULL, release_later, c );
+  pthread_join( thread, NULL );
+  ok( destroyed == 0 );
+  
+  /* It is queued to owner and merged on its next call. */
+  jq_retain( group );
+  jq_release( group );
+  ok( destroyed == 1 );
+  
+  /* Other thread retains, owner releases first. */
+  destroyed = 0;
+  c = counted_create();
+  jq_worker_sync( worker, retain_proc, c );
+  jq_release( c );
+  ok( destroyed == 0 );
+  jq_worker_sync( worker, release_proc, c );
+  ok( destroyed == 1 );
+  
+  /* Owner thread exits, reference is released elsewhere. */
+  destroyed = 0;
+  pthread_create( &thread, NULL, create_and_exit, &c );
+  pthread_join( thread, NULL );
+  ok( destroyed == 0 );
+  
+  for( i = 0; i < 4; ++i )
+    jq_retain( c );
+  
+  for( i = 0; i < 4; ++i )
+    jq_worker_async_group( worker, group, release_proc, c );
+  
+  jq_group_wait( group );
+  ok( destroyed == 0 );
+  jq_release( c );
+  ok( destroyed == 1 );
+  
+  /* Owner exits while two threads merge its object by turns. */
+  destroyed = 0;
+  
+  for( i = 0; i < 2; ++i )
+    pthread_create( &churners[i], NULL, churn, NULL );
+  
+  pthread_create( &thread, NULL, create_and_hand, NULL );
+  pthread_join( thread, NULL );
+  
+  for( i = 0; i < 2; ++i )
+    pthread_join( churners[i], NULL );
+  
+  ok( destroyed == 1 );
+  
+  /* Many objects shared by owner and workers. */
+  destroyed = 0;
+  
+  for( i = 0; i < 4; ++i )
+    objects[i] = counted_create();
+  
+  for( i = 0; i < COUNT; ++i ) {
+    jq_retain( objects[i % 4] );
+    jq_worker_async_group( worker, group, release_proc, objects[i % 4] );
+    
+    if( i % 100 == 0 )
+      jq_group_wait( group );
+  }
+  
+  for( i = 0; i < 4; ++i )
+    jq_release( objects[i] );
+  
+  jq_group_wait( group );
+  
+  /* Last releases may have happened on worker and be queued to this thread. */
+  jq_retain( group );
+  jq_release( group );
+  
+  ok( destroyed == 4 );
+  
+  jq_release( group );
+  jq_release( worker );
+}
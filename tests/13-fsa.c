@@ -0,0 +1,83 @@
+#include "jq.h"
+#include "jq-private.h"
+#include "jq-test.h"
+#include <string.h>
+
+#define COUNT 100000
+
+static void* blocks[COUNT];
+
+static void burst( jq_fsa* fsa, size_t size ) {
+  jq_fsa_stats stats;
+  size_t i, misaligned = 0;
+  
+  for( i = 0; i < COUNT; ++i ) {
+    blocks[i] = jq_fsa_alloc( fsa );
+    
+    if( !blocks[i] || (size_t)blocks[i] % fsa->align )
+      misaligned++;
+    else
+      memset( blocks[i], 0xAA, size );
+  }
+  
+  ok( misaligned == 0 );
+  
+  jq_fsa_get_stats( fsa, &stats );
+  ok( stats.live == COUNT );
+  ok( stats.live_bytes == COUNT * size );
+  ok( stats.resident >= COUNT * size );
+  
+  /* Geometric growth keeps number of chunks small. */
+  ok( stats.chunks < 64 );
+  
+  for( i = 0; i < COUNT; ++i )
+    jq_fsa_free( fsa, blocks[i] );
+  
+  /* All but one chunk are returned right away. */
+  jq_fsa_get_stats( fsa, &stats );
+  ok( stats.live == 0 );
+  ok( stats.chunks == 1 );
+  ok( stats.empty_chunks == 1 );
+  ok( stats.released_chunks > 0 );
+  ok( stats.peak_resident >= COUNT * size );
+  
+  jq_fsa_trim( fsa );
+  jq_fsa_get_stats( fsa, &stats );
+  ok( stats.chunks == 0 );
+  ok( stats.resident == 0 );
+}
+
+testing() {
+  jq_fsa fsa = JQ_FSA_INITIALIZER( 40, 0 );
+  jq_fsa_stats stats;
+  void* a;
+  void* b;
+  void* c;
+  
+  burst( &fsa, 40 );
+  
+  /* Freed block is reused. */
+  a = jq_fsa_alloc( &fsa );
+  jq_fsa_free( &fsa, a );
+  b = jq_fsa_alloc( &fsa );
+  ok( a == b );
+  
+  /* Blocks keep working after chunk was released and reallocated. */
+  c = jq_fsa_alloc( &fsa );
+  ok( c != b );
+  jq_fsa_free( &fsa, b );
+  jq_fsa_free( &fsa, c );
+  
+  jq_fsa_free_all( &fsa );
+  jq_fsa_get_stats( &fsa, &stats );
+  ok( stats.resident == 0 );
+  jq_fsa_destroy( &fsa );
+  
+  jq_fsa_init_ex( &fsa, 100, 16, 8192, 128, JQ_FSA_MMAP );
+  burst( &fsa, 100 );
+  jq_fsa_destroy( &fsa );
+  
+  jq_fsa_init_ex( &fsa, 200, 64, 0, 0, JQ_FSA_HUGE );
+  burst( &fsa, 200 );
+  jq_fsa_destroy( &fsa );
+}
@@ -0,0 +1,125 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <string.h>
+#include <malloc.h>
+#include <stdint.h>
+
+#define COUNT 100000
+
+typedef struct {
+  int value;
+  volatile int* sum;
+} task;
+
+static volatile int sum = 0;
+static volatile int misaligned = 0;
+
+static void task_proc( void* p ) {
+  task* t = (task*)p;
+  __sync_fetch_and_add( t->sum, t->value );
+}
+
+typedef struct {
+  jq_worker_t worker;
+  jq_group_t group;
+} fanout;
+
+static void noop( void* p ) {
+  
+}
+
+static size_t in_use() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+/* Second submitter running on worker thread. */
+static void submit_proc( void* p ) {
+  fanout* f = (fanout*)p;
+  int i;
+  
+  for( i = 0; i < COUNT; ++i ) {
+    task* t = (task*)jq_group_alloc( f->group, sizeof(task) );
+    
+    if( (size_t)t % 16 )
+      misaligned++;
+    
+    t->value = 1;
+    t->sum = &sum;
+    jq_worker_async_group( f->worker, f->group, task_proc, t );
+  }
+}
+
+testing() {
+  fanout f;
+  char* big;
+  char* small;
+  size_t used;
+  int i;
+  
+  f.worker = jq_worker_create( NULL, 2 );
+  f.group = jq_group_create();
+  
+  jq_worker_async_group( f.worker, f.group, submit_proc, &f );
+  
+  for( i = 0; i < COUNT; ++i ) {
+    task* t = (task*)jq_group_alloc( f.group, sizeof(task) );
+    
+    if( (size_t)t % 16 )
+      misaligned++;
+    
+    t->value = 2;
+    t->sum = &sum;
+    jq_worker_async_group( f.worker, f.group, task_proc, t );
+  }
+  
+  jq_group_wait( f.group );
+  
+  ok( sum == 3 * COUNT );
+  ok( misaligned == 0 );
+  
+  /* Big blocks don't overlap small ones. */
+  small = (char*)jq_group_alloc( f.group, 10 );
+  big = (char*)jq_group_alloc( f.group, 100000 );
+  ok( small != NULL && big != NULL );
+  memset( big, 1, 100000 );
+  memset( small, 2, 10 );
+  ok( big[0] == 1 && big[99999] == 1 );
+  
+  ok( jq_group_alloc( NULL, 10 ) == NULL );
+  
+  /* Rounded up size doesn't wrap around. */
+  ok( jq_group_alloc( f.group, SIZE_MAX ) == NULL );
+  ok( jq_group_alloc( f.group, SIZE_MAX - 20 ) == NULL );
+  
+  jq_release( f.group );
+  
+  /* New group doesn't reuse slab of released one. */
+  f.group = jq_group_create();
+  small = (char*)jq_group_alloc( f.group, 10 );
+  ok( small != NULL );
+  jq_release( f.group );
+  
+  jq_release( f.worker );
+  
+  /* Group released last by request is destroyed once its creator waits. */
+  f.worker = jq_worker_create( NULL, 1 );
+  f.group = jq_group_create();
+  
+  for( i = 0; i < 8; ++i )
+    jq_group_alloc( f.group, 1024 * 1024 );
+  
+  used = in_use();
+  jq_worker_async_group( f.worker, f.group, noop, NULL );
+  jq_release( f.group );
+  
+  /* Single thread runs it after request of released group. */
+  f.group = jq_group_create();
+  jq_worker_async_group( f.worker, f.group, noop, NULL );
+  jq_group_wait( f.group );
+  
+  ok( in_use() + 4 * 1024 * 1024 < used );
+  
+  jq_release( f.group );
+  jq_release( f.worker );
+}
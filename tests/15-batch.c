@@ -0,0 +1,103 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <unistd.h>
+
+#define COUNT 100000
+
+static size_t order[256];
+static size_t recorded = 0;
+static size_t batches[256];
+static size_t batch_count = 0;
+static volatile size_t sum = 0;
+
+static void record( void* context ) {
+  order[recorded++] = (size_t)context;
+}
+
+static void record_batch( void** contexts, size_t count ) {
+  size_t i;
+  
+  for( i = 0; i < count; ++i )
+    record( contexts[i] );
+  
+  batches[batch_count++] = count;
+}
+
+static void other( void* context ) {
+  record( context );
+}
+
+static void add( void* context ) {
+  __sync_fetch_and_add( &sum, (size_t)context );
+}
+
+static void add_batch( void** contexts, size_t count ) {
+  size_t i, total = 0;
+  
+  for( i = 0; i < count; ++i )
+    total += (size_t)contexts[i];
+  
+  __sync_fetch_and_add( &sum, total );
+}
+
+testing() {
+  jq_queue_t queue = jq_queue_create();
+  jq_worker_t worker;
+  jq_group_t group;
+  size_t i;
+  int ordered = 1;
+  
+  alarm( 10 );
+  
+  /* Runs are split by limit and by other handlers, order is kept. */
+  ok( jq_handler_set_batch( record, record_batch, 32 ) );
+  
+  for( i = 0; i < 100; ++i )
+    jq_queue_submit( queue, NULL, record, (void*)i );
+  
+  jq_queue_submit( queue, NULL, other, (void*)i++ );
+  
+  for( ; i < 151; ++i )
+    jq_queue_submit( queue, NULL, record, (void*)i );
+  
+  jq_queue_poll( queue );
+  
+  ok( recorded == 151 );
+  
+  for( i = 0; i < recorded; ++i )
+    ordered = ordered && order[i] == i;
+  
+  ok( ordered );
+  ok( batch_count == 6 );
+  ok( batches[0] == 32 && batches[1] == 32 && batches[2] == 32 && batches[3] == 4 );
+  ok( batches[4] == 32 && batches[5] == 18 );
+  
+  /* Unregistered handler is called for each request. */
+  ok( jq_handler_set_batch( record, NULL, 0 ) );
+  
+  recorded = 0;
+  batch_count = 0;
+  
+  for( i = 0; i < 10; ++i )
+    jq_queue_submit( queue, NULL, record, (void*)i );
+  
+  jq_queue_poll( queue );
+  ok( recorded == 10 );
+  ok( batch_count == 0 );
+  
+  /* Worker threads batch concurrently. */
+  ok( jq_handler_set_batch( add, add_batch, 0 ) );
+  
+  worker = jq_worker_create( NULL, 4 );
+  group = jq_group_create();
+  
+  for( i = 0; i < COUNT; ++i )
+    jq_worker_async_group( worker, group, add, (void*)1 );
+  
+  jq_group_wait( group );
+  ok( sum == COUNT );
+  
+  jq_release( group );
+  jq_release( worker );
+  jq_release( queue );
+}
@@ -0,0 +1,129 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <pthread.h>
+#include <unistd.h>
+
+#define THREADS 4
+#define PHASES 1000
+#define TASKS 1000
+
+static jq_barrier_t barrier;
+static volatile int arrived[PHASES];
+static volatile int serial = 0;
+static volatile int consistent = 1;
+
+static jq_latch_t latch;
+static jq_semaphore_t sem;
+static volatile int inside = 0;
+static volatile int max_inside = 0;
+
+static void* phases( void* arg ) {
+  int i;
+  
+  for( i = 0; i < PHASES; ++i ) {
+    __sync_fetch_and_add( &arrived[i], 1 );
+    
+    if( jq_barrier_wait( barrier ) )
+      __sync_fetch_and_add( &serial, 1 );
+    
+    /* Everyone arrived before anyone passed. */
+    if( arrived[i] != THREADS )
+      consistent = 0;
+  }
+  
+  return NULL;
+}
+
+static void count_down( void* p ) {
+  jq_latch_count_down( latch, 1 );
+}
+
+/* Waits for requests of the only worker thread it runs on. */
+static void nested( void* p ) {
+  jq_worker_t worker = (jq_worker_t)p;
+  int i;
+  
+  for( i = 0; i < 10; ++i )
+    jq_worker_async( worker, count_down, NULL );
+  
+  jq_latch_wait( latch );
+}
+
+static void limited( void* p ) {
+  int n;
+  
+  jq_semaphore_wait( sem );
+  
+  n = __sync_add_and_fetch( &inside, 1 );
+  if( n > max_inside ) max_inside = n;
+  usleep( 100 );
+  __sync_sub_and_fetch( &inside, 1 );
+  
+  jq_semaphore_post( sem, 1 );
+}
+
+testing() {
+  pthread_t threads[THREADS];
+  jq_worker_t worker;
+  jq_group_t group;
+  int i;
+  
+  alarm( 20 );
+  
+  /* Barrier phases. */
+  barrier = jq_barrier_create( THREADS );
+  ok( barrier != NULL );
+  
+  for( i = 0; i < THREADS; ++i )
+    pthread_create( &threads[i], NULL, phases, NULL );
+  
+  for( i = 0; i < THREADS; ++i )
+    pthread_join( threads[i], NULL );
+  
+  ok( consistent );
+  ok( serial == PHASES );
+  jq_release( barrier );
+  
+  /* Latch counted down by worker threads. */
+  worker = jq_worker_create( NULL, THREADS );
+  latch = jq_latch_create( TASKS );
+  ok( !jq_latch_try_wait( latch ) );
+  
+  for( i = 0; i < TASKS; ++i )
+    jq_worker_async( worker, count_down, NULL );
+  
+  jq_latch_wait( latch );
+  ok( jq_latch_try_wait( latch ) );
+  jq_release( latch );
+  jq_release( worker );
+  
+  /* Single worker thread runs requests it waits for. */
+  worker = jq_worker_create( NULL, 1 );
+  latch = jq_latch_create( 10 );
+  jq_worker_sync( worker, nested, worker );
+  ok( jq_latch_try_wait( latch ) );
+  jq_release( latch );
+  jq_release( worker );
+  
+  /* Semaphore limits concurrency. */
+  sem = jq_semaphore_create( 0 );
+  ok( !jq_semaphore_try_wait( sem ) );
+  jq_semaphore_post( sem, 2 );
+  ok( jq_semaphore_try_wait( sem ) );
+  jq_semaphore_post( sem, 1 );
+  
+  worker = jq_worker_create( NULL, 8 );
+  group = jq_group_create();
+  
+  for( i = 0; i < TASKS; ++i )
+    jq_worker_async_group( worker, group, limited, NULL );
+  
+  jq_group_wait( group );
+  ok( max_inside > 0 && max_inside <= 2 );
+  ok( jq_semaphore_try_wait( sem ) && jq_semaphore_try_wait( sem ) );
+  ok( !jq_semaphore_try_wait( sem ) );
+  
+  jq_release( sem );
+  jq_release( group );
+  jq_release( worker );
+}
@@ -0,0 +1,111 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <unistd.h>
+
+#define ITEMS 10000
+#define TOKENS 8
+
+typedef struct {
+  size_t index;
+  size_t value;
+} item_t;
+
+static item_t items[ITEMS];
+static size_t collected[ITEMS];
+static size_t collected_count = 0;
+static size_t counted = 0;
+static volatile int inside = 0;
+static volatile int overlapped = 0;
+static volatile int in_flight = 0;
+static volatile int max_in_flight = 0;
+
+static void* enter( void* arg, void* p ) {
+  int n = __sync_add_and_fetch( &in_flight, 1 );
+  
+  if( n > max_in_flight )
+    max_in_flight = n;
+  
+  return p;
+}
+
+static void* square( void* arg, void* p ) {
+  item_t* item = (item_t*)p;
+  item->value = item->index * item->index;
+  
+  /* Drop every tenth. */
+  if( item->index % 10 == 9 ) {
+    __sync_sub_and_fetch( &in_flight, 1 );
+    return NULL;
+  }
+  
+  return item;
+}
+
+static void* collect( void* arg, void* p ) {
+  item_t* item = (item_t*)p;
+  collected[collected_count++] = item->index;
+  return item;
+}
+
+static void* count( void* arg, void* p ) {
+  if( __sync_add_and_fetch( &inside, 1 ) != 1 )
+    overlapped = 1;
+  
+  counted++;
+  
+  __sync_sub_and_fetch( &inside, 1 );
+  return p;
+}
+
+static void* leave( void* arg, void* p ) {
+  __sync_sub_and_fetch( &in_flight, 1 );
+  return p;
+}
+
+testing() {
+  jq_worker_t worker = jq_worker_create( NULL, 4 );
+  jq_pipeline_t pipeline;
+  size_t i;
+  int ordered = 1;
+  
+  alarm( 20 );
+  
+  ok( jq_pipeline_create( worker, 0 ) == NULL );
+  
+  pipeline = jq_pipeline_create( worker, TOKENS );
+  ok( pipeline != NULL );
+  
+  ok( jq_pipeline_add_stage( pipeline, JQ_STAGE_SERIAL_IN_ORDER, enter, NULL ) );
+  ok( jq_pipeline_add_stage( pipeline, JQ_STAGE_PARALLEL, square, NULL ) );
+  ok( jq_pipeline_add_stage( pipeline, JQ_STAGE_SERIAL_IN_ORDER, collect, NULL ) );
+  ok( jq_pipeline_add_stage( pipeline, JQ_STAGE_SERIAL_OUT_OF_ORDER, count, NULL ) );
+  ok( jq_pipeline_add_stage( pipeline, JQ_STAGE_PARALLEL, leave, NULL ) );
+  
+  for( i = 0; i < ITEMS; ++i ) {
+    items[i].index = i;
+    ok( jq_pipeline_push( pipeline, &items[i] ) );
+  }
+  
+  /* No more stages once items are flowing. */
+  ok( !jq_pipeline_add_stage( pipeline, JQ_STAGE_PARALLEL, leave, NULL ) );
+  
+  jq_pipeline_wait( pipeline );
+  
+  /* In-order stage sees survivors in push order. */
+  ok( collected_count == ITEMS - ITEMS / 10 );
+  
+  for( i = 1; i < collected_count; ++i )
+    ordered = ordered && collected[i - 1] < collected[i];
+  
+  ok( ordered );
+  ok( items[ITEMS - 2].value == (ITEMS - 2) * (ITEMS - 2) );
+  
+  ok( counted == collected_count );
+  ok( !overlapped );
+  
+  ok( in_flight == 0 );
+  ok( max_in_flight > 0 && max_in_flight <= TOKENS );
+  
+  jq_release( pipeline );
+  jq_release( worker );
+}
@@ -0,0 +1,96 @@
+#include "jq.h"
+#include "jq-stats.h"
+#include "jq-test.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define COUNT 10000
+
+static void proc( void* p ) {
+}
+
+static const jq_stats_worker* find( const jq_stats_segment* segment, const char* name ) {
+  int i;
+  
+  for( i = 0; i < JQ_STATS_WORKERS; ++i ) {
+    if( segment->worker[i].used && strcmp( segment->worker[i].name, name ) == 0 )
+      return &segment->worker[i];
+  }
+  
+  return NULL;
+}
+
+testing() {
+  char name[64];
+  const jq_stats_segment* segment;
+  const jq_stats_worker* slot;
+  jq_stats_worker copy;
+  jq_worker_config config;
+  jq_worker_t worker;
+  jq_group_t group;
+  uint64_t waits = 0;
+  int fd, i;
+  
+  alarm( 10 );
+  
+  snprintf( name, sizeof(name), "/jq-test-stats-%d", (int)getpid() );
+  ok( jq_stats_publish( name ) );
+  
+  fd = shm_open( name, O_RDONLY, 0 );
+  ok( fd >= 0 );
+  
+  segment = (const jq_stats_segment*)mmap( NULL, sizeof(jq_stats_segment), PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  
+  ok( segment != MAP_FAILED );
+  ok( segment->magic == JQ_STATS_MAGIC );
+  ok( segment->pid == (uint32_t)getpid() );
+  
+  jq_worker_config_init( &config );
+  config.threads = 2;
+  config.name = "stats";
+  
+  worker = jq_worker_create_ex( NULL, &config );
+  group = jq_group_create();
+  
+  for( i = 0; i < COUNT; ++i )
+    jq_worker_async_group( worker, group, proc, NULL );
+  
+  jq_group_wait( group );
+  
+  /* Threads publish what's left before going to sleep. */
+  for( i = 0; i < 100; ++i ) {
+    slot = find( segment, "stats" );
+    
+    if( slot && jq_stats_read_worker( slot, &copy, 100 ) && copy.tasks == COUNT )
+      break;
+    
+    usleep( 10000 );
+  }
+  
+  ok( slot != NULL );
+  ok( copy.tasks == COUNT );
+  ok( copy.requested_threads == 2 );
+  ok( copy.working_threads == 2 );
+  ok( copy.queue_length == 0 );
+  ok( copy.updated > 0 );
+  
+  for( i = 0; i < JQ_STATS_BUCKETS; ++i )
+    waits += copy.wait_histogram[i];
+  
+  ok( waits == COUNT );
+  
+  jq_release( group );
+  jq_release( worker );
+  
+  /* Slot is freed with worker. */
+  for( i = 0; i < 100 && find( segment, "stats" ); ++i )
+    usleep( 10000 );
+  
+  ok( find( segment, "stats" ) == NULL );
+  
+  jq_stats_unpublish();
+  ok( shm_open( name, O_RDONLY, 0 ) < 0 );
+}
@@ -0,0 +1,116 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <unistd.h>
+
+#define COUNT 1000
+
+static volatile int released = 0;
+static volatile int reports = 0;
+static volatile jq_handler_t reported_handler = NULL;
+static volatile unsigned reported_running = 0;
+static volatile size_t fast_done = 0;
+
+static void on_stall( void* arg, jq_handler_t handler, unsigned running_ms, unsigned waited_ms ) {
+  __sync_fetch_and_add( &reports, 1 );
+  reported_handler = handler;
+  reported_running = running_ms;
+}
+
+/* Blocks its thread until released, at most 5 seconds. */
+static void slow( void* context ) {
+  int i;
+  
+  for( i = 0; i < 5000 && !released; ++i )
+    usleep( 1000 );
+}
+
+static void release( void* context ) {
+  released = 1;
+}
+
+static void fast( void* context ) {
+  __sync_fetch_and_add( &fast_done, 1 );
+}
+
+/* Stalls, helps its only thread run nested request, then stalls again. */
+static void nesting( void* context ) {
+  jq_worker_t worker = (jq_worker_t)context;
+  jq_group_t group = jq_group_create();
+  
+  usleep( 150000 );
+  
+  jq_worker_async_group( worker, group, fast, NULL );
+  jq_group_wait( group );
+  jq_release( group );
+  
+  usleep( 150000 );
+}
+
+testing() {
+  jq_worker_config config;
+  jq_worker_t worker;
+  jq_group_t group;
+  int i;
+  
+  alarm( 10 );
+  
+  ok( jq_watchdog_start( 50, on_stall, NULL ) );
+  ok( !jq_watchdog_start( 50, on_stall, NULL ) );
+  
+  /* Fast handlers are never reported. */
+  worker = jq_worker_create( NULL, 2 );
+  group = jq_group_create();
+  
+  for( i = 0; i < COUNT; ++i )
+    jq_worker_async_group( worker, group, fast, NULL );
+  
+  jq_group_wait( group );
+  
+  ok( fast_done == COUNT );
+  ok( reports == 0 );
+  
+  jq_release( worker );
+  
+  /* Single thread is stalled: only extra thread can release it. */
+  jq_worker_config_init( &config );
+  config.threads = 1;
+  config.stall_threads = 1;
+  
+  worker = jq_worker_create_ex( NULL, &config );
+  
+  jq_worker_async_group( worker, group, slow, NULL );
+  jq_worker_async_group( worker, group, release, NULL );
+  jq_group_wait( group );
+  
+  ok( released );
+  ok( reports == 1 );
+  ok( reported_handler == slow );
+  ok( reported_running >= 50 );
+  
+  /* Reported once per execution. */
+  usleep( 200000 );
+  ok( reports == 1 );
+  
+  jq_release( worker );
+  
+  /* Outer execution goes on after nested one: it isn't reported again. */
+  worker = jq_worker_create( NULL, 1 );
+  reported_handler = NULL;
+  fast_done = 0;
+  
+  jq_worker_async_group( worker, group, nesting, worker );
+  jq_group_wait( group );
+  
+  ok( fast_done == 1 );
+  ok( reports == 2 );
+  ok( reported_handler == nesting );
+  
+  jq_release( worker );
+  jq_release( group );
+  
+  jq_watchdog_stop();
+  
+  /* Restarts after stop. */
+  ok( jq_watchdog_start( 1000, NULL, NULL ) );
+  jq_watchdog_stop();
+}
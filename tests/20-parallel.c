@@ -0,0 +1,141 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Prime: chunks don't divide it evenly. */
+#define COUNT 1000003
+
+/* Three full chunks of items and a few more. */
+#define SMALL_COUNT (3 * 256 * 1024 / sizeof(item_t) + 5)
+
+typedef struct {
+  unsigned key;
+  unsigned index;
+} item_t;
+
+static int compare_items( const void* a, const void* b ) {
+  unsigned x = ((const item_t*)a)->key, y = ((const item_t*)b)->key;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_ints( const void* a, const void* b ) {
+  int x = *(const int*)a, y = *(const int*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void add( void* arg, void* result, const void* a, const void* b ) {
+  *(long*)result = *(const long*)a + *(const long*)b;
+}
+
+static int is_even( void* arg, const void* item ) {
+  return ((const item_t*)item)->key % 2 == 0;
+}
+
+static void fill( item_t* items, size_t count ) {
+  size_t i;
+  
+  for( i = 0; i < count; ++i ) {
+    items[i].key = (unsigned)rand() % 1000;
+    items[i].index = (unsigned)i;
+  }
+}
+
+/* Keys are ordered and items are those filled in: each index once. */
+static int sorted( const item_t* items, size_t count ) {
+  char* seen = (char*)calloc( count, 1 );
+  size_t i;
+  int res = 1;
+  
+  for( i = 0; i < count && res; ++i ) {
+    if( i > 0 && items[i - 1].key > items[i].key ) res = 0;
+    if( items[i].index >= count || seen[items[i].index]++ ) res = 0;
+  }
+  
+  free( seen );
+  return res;
+}
+
+testing() {
+  jq_worker_t worker = jq_worker_create( NULL, 3 );
+  item_t* items = (item_t*)malloc( COUNT * sizeof(item_t) );
+  long* values = (long*)malloc( COUNT * sizeof(long) );
+  long* sums = (long*)malloc( COUNT * sizeof(long) );
+  int small[] = { 5, 3, 9, 1, 7 };
+  long zero = 0, ten = 10, sum;
+  size_t i, selected;
+  int scanned = 1, partitioned = 1;
+  
+  alarm( 30 );
+  
+  /* Many equal keys check merge path search. */
+  fill( items, COUNT );
+  ok( jq_parallel_sort( worker, items, COUNT, sizeof(item_t), compare_items ) );
+  ok( sorted( items, COUNT ) );
+  
+  /* Odd number of chunks, the last one short. */
+  fill( items, SMALL_COUNT );
+  ok( jq_parallel_sort( worker, items, SMALL_COUNT, sizeof(item_t), compare_items ) );
+  ok( sorted( items, SMALL_COUNT ) );
+  
+  /* Single chunk is sorted by calling thread. */
+  ok( jq_parallel_sort( worker, small, 5, sizeof(int), compare_ints ) );
+  ok( small[0] == 1 && small[2] == 5 && small[4] == 9 );
+  
+  for( i = 0; i < COUNT; ++i )
+    values[i] = (long)(i % 7);
+  
+  ok( jq_parallel_inclusive_scan( worker, values, sums, COUNT, sizeof(long), add, NULL ) );
+  
+  for( i = 0, sum = 0; i < COUNT; ++i ) {
+    sum += values[i];
+    scanned = scanned && sums[i] == sum;
+  }
+  
+  ok( scanned );
+  
+  /* In place. */
+  ok( jq_parallel_exclusive_scan( worker, values, values, COUNT, sizeof(long), add, NULL, &ten ) );
+  
+  for( i = 0, sum = 10; i < COUNT; ++i ) {
+    scanned = scanned && values[i] == sum;
+    sum += (long)(i % 7);
+  }
+  
+  ok( scanned );
+  
+  ok( jq_parallel_exclusive_scan( worker, small, sums, 0, sizeof(long), add, NULL, &zero ) );
+  
+  /* Exclusive scan has no first value without init. */
+  ok( !jq_parallel_exclusive_scan( worker, values, sums, COUNT, sizeof(long), add, NULL, NULL ) );
+  
+  /* Items of no size and arrays larger than memory are rejected. */
+  ok( !jq_parallel_sort( worker, small, 5, 0, compare_ints ) );
+  ok( !jq_parallel_inclusive_scan( worker, values, sums, COUNT, 0, add, NULL ) );
+  ok( !jq_parallel_partition( worker, items, COUNT, 0, is_even, NULL, &selected ) );
+  ok( !jq_parallel_sort( worker, items, SIZE_MAX / 4, sizeof(item_t), compare_items ) );
+  ok( !jq_parallel_exclusive_scan( worker, values, sums, SIZE_MAX / 4, sizeof(long), add, NULL, &zero ) );
+  ok( !jq_parallel_partition( worker, items, SIZE_MAX / 4, sizeof(item_t), is_even, NULL, &selected ) );
+  ok( small[0] == 1 && small[4] == 9 );
+  
+  fill( items, COUNT );
+  
+  ok( jq_parallel_partition( worker, items, COUNT, sizeof(item_t), is_even, NULL, &selected ) );
+  ok( selected > 0 && selected < COUNT );
+  
+  for( i = 0; i < COUNT; ++i ) {
+    partitioned = partitioned && (items[i].key % 2 == 0) == (i < selected);
+    
+    /* Order kept within both parts. */
+    if( i > 0 && i != selected )
+      partitioned = partitioned && items[i - 1].index < items[i].index;
+  }
+  
+  ok( partitioned );
+  
+  free( items );
+  free( values );
+  free( sums );
+  jq_release( worker );
+}
@@ -0,0 +1,153 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+#define KEYS 1000
+#define COUNT 100000
+#define HOT 1000
+
+typedef struct {
+  size_t key;
+  size_t seq;
+} event_t;
+
+static size_t last[KEYS];
+static volatile int running[KEYS];
+static volatile int ordered = 1;
+static volatile int exclusive = 1;
+static volatile size_t hot_done = 0;
+static volatile size_t hot_done_at_other = 0;
+
+static void handle( void* context ) {
+  event_t* event = (event_t*)context;
+  
+  if( __sync_val_compare_and_swap( &running[event->key], 0, 1 ) != 0 )
+    exclusive = 0;
+  
+  if( last[event->key] + 1 != event->seq )
+    ordered = 0;
+  
+  last[event->key] = event->seq;
+  running[event->key] = 0;
+}
+
+static void hot( void* context ) {
+  usleep( 100 );
+  hot_done++;
+}
+
+static void other( void* context ) {
+  hot_done_at_other = hot_done;
+}
+
+static size_t batched = 0;
+static size_t batch_calls = 0;
+static volatile int batch_ordered = 1;
+
+static void item( void* context ) {
+  if( (size_t)context != batched++ )
+    batch_ordered = 0;
+}
+
+static void item_batch( void** contexts, size_t count ) {
+  size_t i;
+  
+  for( i = 0; i < count; ++i )
+    item( contexts[i] );
+  
+  batch_calls++;
+}
+
+testing() {
+  event_t* events = (event_t*)malloc( COUNT * sizeof(event_t) );
+  size_t seq[KEYS] = { 0 };
+  jq_worker_config config;
+  jq_worker_t worker;
+  jq_queue_t queue;
+  jq_group_t group = jq_group_create();
+  size_t i;
+  int submitted = 1;
+  
+  alarm( 20 );
+  
+  /* Fewer lanes than keys: lanes are shared. */
+  jq_worker_config_init( &config );
+  config.threads = 4;
+  config.lanes = 16;
+  
+  worker = jq_worker_create_ex( NULL, &config );
+  
+  for( i = 0; i < COUNT; ++i ) {
+    events[i].key = (size_t)rand() % KEYS;
+    events[i].seq = ++seq[events[i].key];
+    submitted = submitted && jq_worker_async_keyed( worker, events[i].key, group, handle, &events[i] );
+  }
+  
+  jq_group_wait( group );
+  
+  ok( submitted );
+  ok( ordered );
+  ok( exclusive );
+  
+  for( i = 0; i < KEYS; ++i )
+    ordered = ordered && last[i] == seq[i];
+  
+  ok( ordered );
+  
+  jq_release( worker );
+  
+  /* Single thread is not pinned by hot key. */
+  worker = jq_worker_create( NULL, 1 );
+  
+  for( i = 0; i < HOT; ++i )
+    jq_worker_async_keyed( worker, 42, group, hot, NULL );
+  
+  jq_worker_async_group( worker, group, other, NULL );
+  jq_group_wait( group );
+  
+  ok( hot_done == HOT );
+  ok( hot_done_at_other < HOT );
+  
+  /* Nor does it pin thread while attached queue has work. */
+  queue = jq_queue_create();
+  jq_worker_attach( worker, queue, 1 );
+  hot_done_at_other = HOT;
+  
+  for( i = 0; i < HOT; ++i )
+    jq_worker_async_keyed( worker, 42, group, hot, NULL );
+  
+  jq_queue_submit( queue, group, other, NULL );
+  jq_group_wait( group );
+  
+  ok( hot_done == 2 * HOT );
+  ok( hot_done_at_other < 2 * HOT );
+  
+  jq_worker_detach( worker, queue );
+  jq_release( queue );
+  
+  /* Lane reqs are batched in order. */
+  jq_handler_set_batch( item, item_batch, 8 );
+  
+  for( i = 0; i < HOT; ++i )
+    jq_worker_async_keyed( worker, 7, group, item, (void*)i );
+  
+  jq_group_wait( group );
+  jq_handler_set_batch( item, NULL, 0 );
+  
+  ok( batched == HOT );
+  ok( batch_ordered );
+  ok( batch_calls < HOT );
+  
+  /* Released worker finishes keyed requests. */
+  for( i = 0; i < 100; ++i )
+    jq_worker_async_keyed( worker, i, group, hot, NULL );
+  
+  jq_release( worker );
+  jq_group_wait( group );
+  
+  ok( hot_done == 2 * HOT + 100 );
+  
+  jq_release( group );
+  free( events );
+}
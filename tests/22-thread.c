@@ -0,0 +1,96 @@
+#include "jq.h"
+#include "jq-test.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+#define THREADS 3
+#define COUNT 10000
+
+static volatile int inits = 0;
+static volatile int exits = 0;
+static volatile int slots_ok = 1;
+static volatile int indices_ok = 1;
+static int arg_value = 7;
+
+static void* thread_init( void* arg, int index ) {
+  int* slot = (int*)malloc( sizeof(int) );
+  
+  if( arg != &arg_value ) slots_ok = 0;
+  
+  *slot = index;
+  __sync_fetch_and_add( &inits, 1 );
+  return slot;
+}
+
+static void thread_exit( void* arg, int index, void* slot ) {
+  if( !slot || *(int*)slot != index ) slots_ok = 0;
+  
+  free( slot );
+  __sync_fetch_and_add( &exits, 1 );
+}
+
+static void proc( void* context ) {
+  int index = jq_worker_thread_index();
+  int* slot = (int*)jq_worker_thread_slot();
+  
+  if( index < 0 || index >= THREADS ) indices_ok = 0;
+  if( !slot || *slot != index ) slots_ok = 0;
+}
+
+static void run( jq_worker_t worker ) {
+  jq_group_t group = jq_group_create();
+  int i;
+  
+  for( i = 0; i < COUNT; ++i )
+    jq_worker_async_group( worker, group, proc, NULL );
+  
+  jq_group_wait( group );
+  jq_release( group );
+}
+
+/* Threads start and stop asynchronously. */
+static void wait_count( volatile int* counter, int count ) {
+  int i;
+  
+  for( i = 0; i < 500 && *counter < count; ++i )
+    usleep( 10000 );
+}
+
+testing() {
+  jq_worker_config config;
+  jq_worker_t worker;
+  
+  alarm( 10 );
+  
+  ok( jq_worker_thread_index() == -1 );
+  ok( jq_worker_thread_slot() == NULL );
+  
+  jq_worker_config_init( &config );
+  config.threads = THREADS;
+  config.thread_init = thread_init;
+  config.thread_exit = thread_exit;
+  config.thread_arg = &arg_value;
+  
+  worker = jq_worker_create_ex( NULL, &config );
+  
+  run( worker );
+  wait_count( &inits, THREADS );
+  ok( inits == THREADS );
+  
+  /* Stopped threads free their indices for new ones. */
+  jq_worker_set_threads( worker, 1 );
+  wait_count( &exits, THREADS - 1 );
+  ok( exits == THREADS - 1 );
+  
+  jq_worker_set_threads( worker, THREADS );
+  run( worker );
+  wait_count( &inits, 2 * THREADS - 1 );
+  ok( inits == 2 * THREADS - 1 );
+  
+  jq_release( worker );
+  wait_count( &exits, inits );
+  
+  ok( exits == inits );
+  ok( slots_ok );
+  ok( indices_ok );
+}
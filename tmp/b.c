@@ -0,0 +1,3 @@
+#include "jq.h"
+#include <stdio.h>
+int main(){ jq_io_t io=jq_io_create(0,0); printf("%d\n", jq_io_get_backend(io)); jq_release(io); return 0; }
@@ -0,0 +1,11 @@
+#include "jq.h"
+#include "jq-private.h"
+#include <stdio.h>
+#include <stdlib.h>
+static int destroyed;
+static void d(void* p){ destroyed++; }
+static jq_object_vtable vt = { d };
+static void* th(void* a){ jq_object* o = malloc(sizeof *o); jq_object_init(o,&vt); jq_object_bias(o); *(jq_object**)a = o; return NULL; }
+int main(){ pthread_t t; jq_object* o; pthread_create(&t,0,th,&o); pthread_join(t,0);
+ printf("refs %zx biased %zu owner %p\n", o->refs, o->biased, (void*)o->owner);
+ jq_release(o); printf("refs %zx biased %zu owner %p destroyed %d\n", o->refs, o->biased, (void*)o->owner, destroyed); }
@@ -0,0 +1,2 @@
+#include "jq.hpp"
+int main(){ jq::queue q; struct M{ M(){} M(M&&){} M(const M&)=delete; void operator()(){} }; q.submit(M()); q.poll(); jq::worker w; int x=0; w.sync([&]{x=1;}); return x-1; }
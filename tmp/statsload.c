@@ -0,0 +1,11 @@
+#include "jq.h"
+#include <unistd.h>
+static void proc( void* p ) { volatile int i; for( i = 0; i < 2000; ++i ); }
+int main() {
+  jq_worker_t w = jq_worker_create( NULL, 3 );
+  int i, n;
+  jq_stats_publish( "/jq-demo" );
+  for( n = 0; n < 150; ++n ) { for( i = 0; i < 3000; ++i ) jq_worker_async( w, proc, NULL ); usleep( 10000 ); }
+  jq_stats_unpublish();
+  return 0;
+}
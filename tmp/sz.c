@@ -0,0 +1,3 @@
+#include "jq-private.h"
+#include <stdio.h>
+int main(){ printf("%zu %zu\n", sizeof(jq_req), sizeof(jq_req_inline)); return 0; }
@@ -0,0 +1,7 @@
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+int main(){ struct io_uring_params p; memset(&p,0,sizeof p); int fd=syscall(__NR_io_uring_setup,8,&p); printf("%d %s feat=%x\n",fd,strerror(errno),p.features); }
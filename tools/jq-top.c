@@ -0,0 +1,204 @@
+/*
+  jq-top: live view of libjq stats segment published by jq_stats_publish.
+  Segment is mapped read-only and read with seqlock protocol, so inspected
+  process is never blocked.
+  
+  Usage: jq-top [-i interval_ms] [-n iterations] name|pid
+*/
+
+#include "jq-stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define READ_TRIES 1000
+
+typedef struct {
+  jq_stats_worker now;
+  jq_stats_worker last;
+  int valid;
+  int seen;
+} row_t;
+
+static row_t rows[JQ_STATS_WORKERS];
+
+static void usage() {
+  fprintf( stderr, "usage: jq-top [-i interval_ms] [-n iterations] name|pid\n" );
+  exit( 2 );
+}
+
+static const jq_stats_segment* open_segment( const char* arg ) {
+  char name[64];
+  const jq_stats_segment* segment;
+  const char* p;
+  int fd;
+  
+  for( p = arg; isdigit( (unsigned char)*p ); ++p );
+  
+  if( !*p ) {
+    snprintf( name, sizeof(name), "/jq-stats-%s", arg );
+  }
+  else {
+    snprintf( name, sizeof(name), "%s%s", arg[0] == '/' ? "" : "/", arg );
+  }
+  
+  if( (fd = shm_open( name, O_RDONLY, 0 )) < 0 ) {
+    fprintf( stderr, "jq-top: can't open %s: %s\n", name, strerror( errno ) );
+    exit( 1 );
+  }
+  
+  segment = (const jq_stats_segment*)mmap( NULL, sizeof(jq_stats_segment), PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  
+  if( segment == MAP_FAILED ) {
+    fprintf( stderr, "jq-top: can't map %s: %s\n", name, strerror( errno ) );
+    exit( 1 );
+  }
+  
+  if( segment->magic != JQ_STATS_MAGIC || segment->version != JQ_STATS_VERSION ) {
+    fprintf( stderr, "jq-top: %s is not libjq stats segment of supported version\n", name );
+    exit( 1 );
+  }
+  
+  return segment;
+}
+
+/* Upper bound of bucket holding given quantile of histogram delta, in us. */
+static double wait_quantile( const jq_stats_worker* now, const jq_stats_worker* last, double q ) {
+  uint64_t total = 0, seen = 0, target;
+  int i;
+  
+  for( i = 0; i < JQ_STATS_BUCKETS; ++i )
+    total += now->wait_histogram[i] - last->wait_histogram[i];
+  
+  if( !total ) return -1;
+  
+  target = (uint64_t)(total * q);
+  if( target < 1 ) target = 1;
+  
+  for( i = 0; i < JQ_STATS_BUCKETS; ++i ) {
+    seen += now->wait_histogram[i] - last->wait_histogram[i];
+    
+    if( seen >= target )
+      return i == 0 ? 1 : (double)(1ULL << i);
+  }
+  
+  return (double)(1ULL << (JQ_STATS_BUCKETS - 1));
+}
+
+static void format_wait( char* buf, size_t size, double us ) {
+  if( us < 0 ) {
+    snprintf( buf, size, "-" );
+  }
+  else if( us < 1000 ) {
+    snprintf( buf, size, "<%.0fus", us );
+  }
+  else if( us < 1000000 ) {
+    snprintf( buf, size, "<%.0fms", us / 1000 );
+  }
+  else {
+    snprintf( buf, size, "<%.0fs", us / 1000000 );
+  }
+}
+
+static void show( const jq_stats_segment* segment, int clear ) {
+  char wait[32];
+  int i;
+  
+  if( clear )
+    printf( "\033[H\033[J" );
+  
+  printf( "pid %u\n", segment->pid );
+  printf( "%-3s %-15s %8s %6s %17s %10s %12s %9s\n",
+    "#", "NAME", "QUEUED", "QUEUES", "THR REQ/UP/IDLE", "TASKS/S", "TASKS", "P99 WAIT" );
+  
+  for( i = 0; i < JQ_STATS_WORKERS; ++i ) {
+    row_t* row = &rows[i];
+    double rate = 0;
+    
+    if( !row->valid ) continue;
+    
+    /* Slot reused by another worker or first sample - no rate yet. */
+    if( row->seen && row->now.tasks >= row->last.tasks && row->now.updated > row->last.updated ) {
+      rate = (row->now.tasks - row->last.tasks) * 1e9 / (row->now.updated - row->last.updated);
+      format_wait( wait, sizeof(wait), wait_quantile( &row->now, &row->last, 0.99 ) );
+    }
+    else {
+      snprintf( wait, sizeof(wait), "-" );
+    }
+    
+    printf( "%-3d %-15.15s %8llu %6llu %5llu/%5llu/%5llu %10.0f %12llu %9s\n",
+      i, row->now.name,
+      (unsigned long long)row->now.queue_length,
+      (unsigned long long)row->now.queues,
+      (unsigned long long)row->now.requested_threads,
+      (unsigned long long)row->now.working_threads,
+      (unsigned long long)row->now.sleeping_threads,
+      rate,
+      (unsigned long long)row->now.tasks,
+      wait );
+  }
+  
+  fflush( stdout );
+}
+
+int main( int argc, char** argv ) {
+  const jq_stats_segment* segment;
+  int interval = 1000, iterations = -1, clear;
+  int opt, i;
+  
+  while( (opt = getopt( argc, argv, "i:n:" )) != -1 ) {
+    switch( opt ) {
+      case 'i': interval = atoi( optarg ); break;
+      case 'n': iterations = atoi( optarg ); break;
+      default: usage();
+    }
+  }
+  
+  if( optind != argc - 1 || interval < 1 )
+    usage();
+  
+  segment = open_segment( argv[optind] );
+  clear = isatty( STDOUT_FILENO );
+  
+  while( iterations < 0 || iterations-- > 0 ) {
+    for( i = 0; i < JQ_STATS_WORKERS; ++i ) {
+      row_t* row = &rows[i];
+      jq_stats_worker copy;
+      
+      if( !jq_stats_read_worker( &segment->worker[i], &copy, READ_TRIES ) )
+        continue;
+      
+      if( !copy.used ) {
+        row->valid = 0;
+        row->seen = 0;
+        continue;
+      }
+      
+      row->seen = row->valid && strncmp( row->now.name, copy.name, JQ_STATS_NAME_SIZE ) == 0;
+      row->last = row->now;
+      row->now = copy;
+      row->valid = 1;
+    }
+    
+    show( segment, clear );
+    
+    if( kill( (pid_t)segment->pid, 0 ) != 0 && errno == ESRCH ) {
+      fprintf( stderr, "jq-top: process %u has exited\n", segment->pid );
+      return 1;
+    }
+    
+    if( iterations != 0 )
+      usleep( interval * 1000 );
+  }
+  
+  return 0;
+}